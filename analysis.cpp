@@ -0,0 +1,609 @@
+#include <cmath>
+#include <new>
+#include "analysis.h"
+
+
+// Calculate the occupied bandwidth and the key click energy of a morse dot keyed with the 
+// rising edge in 'table' (table_len+1 entries from 0 to 1) and the mirrored falling edge.
+// 
+// The dot envelope rises during rise_time_s, stays at 1 and then falls during rise_time_s, starting
+// dot_time_s after the start of the rise. The spectrum of one edge is D(f)/(j*2*pi*f), where D(f) 
+// is the Fourier transform of the derivative of the edge. For frequencies well above 1/dot_time_s,
+// the two edges add up incoherently, so the energy spectrum is 2*|D(f)|^2/(2*pi*f)^2.
+key_click_t analyze_key_click(const float *table, int table_len, double rise_time_s, double dot_time_s)
+{
+  const int n_steps = 128;        // Number of points of the edge used in the transform
+  const int n_freqs = 600;        // Number of log spaced frequencies
+  const double f_min = 10.0;
+  const double f_max = 1e6;
+  // Static, about 10 kB would not fit on the stack of the command handler
+  static float edge[n_steps+1];
+  static double f[n_freqs], S[n_freqs];
+  double e_total, e_out, e_out_prev, e_click;
+  key_click_t result;
+
+  if(dot_time_s < rise_time_s) {
+    dot_time_s = rise_time_s;
+  }
+  // Energy of the dot, from the time domain
+  e_total = dot_time_s - rise_time_s;
+  for(int ii = 0; ii <= n_steps; ii++) {
+    edge[ii] = table[(ii*table_len)/n_steps];
+    if(ii < n_steps) {
+      e_total += 2 * edge[ii]*edge[ii] * rise_time_s/n_steps;
+    }
+  }
+
+  // Energy spectrum, using a rotating phasor instead of trigonometric functions for each point
+  for(int jj = 0; jj < n_freqs; jj++) {
+    f[jj] = f_min * pow(f_max/f_min, jj/(double)(n_freqs-1));
+    float w = 2*M_PI*f[jj]*rise_time_s/n_steps;
+    float rot_re = cosf(w), rot_im = -sinf(w);
+    float p_re = cosf(w/2), p_im = -sinf(w/2);
+    float d_re = 0, d_im = 0, tmp;
+    for(int ii = 0; ii < n_steps; ii++) {
+      float dg = edge[ii+1] - edge[ii];
+      d_re += dg*p_re;
+      d_im += dg*p_im;
+      tmp = p_re*rot_re - p_im*rot_im;
+      p_im = p_re*rot_im + p_im*rot_re;
+      p_re = tmp;
+    }
+    S[jj] = 2*(d_re*d_re + d_im*d_im)/(4*M_PI*M_PI*f[jj]*f[jj]);
+  }
+
+  // Integrate the energy outside +-f from the top and down. Above f_max, |D(f)| is assumed to stay constant.
+  e_out = 2*S[n_freqs-1]*f[n_freqs-1];
+  e_click = -1;
+  result.occupied_bw_hz = e_out > 0.01*e_total ? 2*f_max : 2*f_min;
+  for(int jj = n_freqs-2; jj >= 0; jj--) {
+    e_out_prev = e_out;
+    e_out += (S[jj] + S[jj+1])*(f[jj+1] - f[jj]); // Both sidebands
+    if(e_click < 0 && f[jj] <= click_offset_hz) {
+      e_click = e_out;
+    }
+    if(e_out_prev <= 0.01*e_total && e_out > 0.01*e_total) {
+      double k = (0.01*e_total - e_out_prev)/(e_out - e_out_prev);
+      result.occupied_bw_hz = 2*(f[jj+1] - k*(f[jj+1] - f[jj]));
+    }
+  }
+  // Hard keying gives 1/(pi^2*f) outside +-f
+  result.click_db = 10*log10(e_click*M_PI*M_PI*click_offset_hz + 1e-30);
+  return result;
+}
+
+
+// Convert the two bits of a symbol in the synth buffer to the output level, 1, -1 or 0 (both pins equal).
+static inline int symbol_level(uint32_t word, int jj)
+{
+  uint32_t bits = (word >> (2*jj)) & 3;
+  if(bits == 1) {
+    return 1;
+  } else if(bits == 2) {
+    return -1;
+  }
+  return 0;
+}
+
+
+// Common mode of the two pins of a symbol relative to the middle between the levels, 1 for both high,
+// -1 for both low and 0 otherwise.
+static inline int symbol_common_mode(uint32_t word, int jj)
+{
+  uint32_t bits = (word >> (2*jj)) & 3;
+  if(bits == 3) {
+    return 1;
+  } else if(bits == 0) {
+    return -1;
+  }
+  return 0;
+}
+
+
+// Power of the spectral lines around the carrier
+typedef struct {
+  double carrier;
+  double other;     // Sum of the lines other than the carrier
+  double worst;     // Strongest line other than the carrier
+  int worst_m;      // Its offset from the carrier in lines
+} line_powers_t;
+
+
+// Calculate the lines -n_side to n_side around the carrier of the differential output (pin levels
+// as given by symbol_level()) or of the common mode of the pins. Returns false if out of memory.
+// The buffer is first mixed down to DC and summed over each word, after which the lines near the
+// carrier are calculated with one rotating phasor each.
+static bool band_powers(const uint32_t *buffer, int n_words, int n_periods, int n_side, bool common_mode,
+                        line_powers_t *lp)
+{
+  double n_samples = 16.0 * n_words;
+  float mix_re[16], mix_im[16];
+  float *z_re, *z_im;
+
+  lp->carrier = 0;
+  lp->other = 0;
+  lp->worst = 0;
+  lp->worst_m = 0;
+  z_re = new (std::nothrow) float[n_words];
+  z_im = new (std::nothrow) float[n_words];
+  if(z_re == NULL || z_im == NULL) {
+    delete [] z_re;
+    delete [] z_im;
+    return false;
+  }
+
+  // Mix down to DC, one word at a time
+  for(int jj = 0; jj < 16; jj++) {
+    mix_re[jj] = cos(2*M_PI*n_periods*jj/n_samples);
+    mix_im[jj] = -sin(2*M_PI*n_periods*jj/n_samples);
+  }
+  for(int ii = 0; ii < n_words; ii++) {
+    float acc_re = 0, acc_im = 0;
+    uint32_t word = buffer[ii];
+    for(int jj = 0; jj < 16; jj++) {
+      int s = common_mode ? symbol_common_mode(word, jj) : symbol_level(word, jj);
+      acc_re += s*mix_re[jj];
+      acc_im += s*mix_im[jj];
+    }
+    // Phase of the carrier at the start of the word, n_periods*16*ii/n_samples periods
+    double ph = -2*M_PI*fmod((double)n_periods*ii, n_words)/n_words;
+    float c = cos(ph), s = sin(ph);
+    z_re[ii] = acc_re*c - acc_im*s;
+    z_im[ii] = acc_re*s + acc_im*c;
+  }
+
+  for(int m = -n_side; m <= n_side; m++) {
+    float rot_re = cos(2*M_PI*m/(double)n_words), rot_im = -sin(2*M_PI*m/(double)n_words);
+    float p_re = 1, p_im = 0, tmp;
+    float x_re = 0, x_im = 0;
+    for(int ii = 0; ii < n_words; ii++) {
+      x_re += z_re[ii]*p_re - z_im[ii]*p_im;
+      x_im += z_re[ii]*p_im + z_im[ii]*p_re;
+      tmp = p_re*rot_re - p_im*rot_im;
+      p_im = p_re*rot_im + p_im*rot_re;
+      p_re = tmp;
+      if((ii & 1023) == 1023) {
+        // Keep the phasor from drifting in amplitude
+        float norm = 1/sqrtf(p_re*p_re + p_im*p_im);
+        p_re *= norm;
+        p_im *= norm;
+      }
+    }
+    double p = ((double)x_re*x_re + (double)x_im*x_im);
+    if(m == 0) {
+      lp->carrier = p;
+    } else {
+      lp->other += p;
+      if(p > lp->worst) {
+        lp->worst = p;
+        lp->worst_m = m;
+      }
+    }
+  }
+  delete [] z_re;
+  delete [] z_im;
+  return true;
+}
+
+
+// Calculate the spectrum within +-bandwidth_hz/2 of the carrier of the waveform in 'buffer'. 
+// The buffer is played repeatedly, so its spectrum consists of lines spaced fs/(16*n_words) apart 
+// and the carrier is line number n_periods. The small phase rotation of the lines within one word is ignored.
+// High impedance zeros give the same differential output as the both pins equal zeros, but no common mode.
+spectrum_t analyze_buffer(const uint32_t *buffer, int n_words, int n_periods, double fs, double bandwidth_hz,
+                          bool hiz_zero)
+{
+  const int max_bins = 200; // Max number of lines on each side of the carrier
+  double n_samples = 16.0 * n_words;
+  double line_spacing = fs / n_samples;
+  line_powers_t lp, cm;
+  spectrum_t result;
+  int n_side;
+
+  result.valid = false;
+  result.carrier_amplitude = 0;
+  result.worst_spur_dbc = -200;
+  result.worst_spur_offset_hz = 0;
+  result.snr_db = 200;
+  result.n_bins = 0;
+  result.transitions_per_s = 0;
+  result.common_mode_dbc = -200;
+
+  // Lines around the carrier
+  n_side = floor(bandwidth_hz/2/line_spacing);
+  if(n_side > max_bins) {
+    n_side = max_bins;
+  }
+  if(n_side > n_words/2 - 1) {
+    n_side = n_words/2 - 1;
+  }
+  if(n_side < 0) {
+    n_side = 0;
+  }
+  if(!band_powers(buffer, n_words, n_periods, n_side, false, &lp)) {
+    return result;
+  }
+  result.valid = true;
+  if(hiz_zero) {
+    result.transitions_per_s = count_transitions_hiz(buffer, n_words)*fs/n_samples;
+  } else {
+    result.transitions_per_s = count_transitions(buffer, n_words)*fs/n_samples;
+    if(band_powers(buffer, n_words, n_periods, n_side, true, &cm) && lp.carrier > 0 && cm.carrier + cm.other > 0) {
+      result.common_mode_dbc = 10*log10((cm.carrier + cm.other)/lp.carrier);
+    }
+  }
+
+  result.n_bins = 2*n_side + 1;
+  result.carrier_amplitude = 2*sqrt(lp.carrier)/n_samples;
+  result.worst_spur_offset_hz = lp.worst_m*line_spacing;
+  if(lp.carrier > 0) {
+    if(lp.worst > 0) {
+      result.worst_spur_dbc = 10*log10(lp.worst/lp.carrier);
+    }
+    if(lp.other > 0) {
+      result.snr_db = 10*log10(lp.carrier/lp.other);
+    }
+  }
+  return result;
+}
+
+
+// Power of spectral line 'line' of the differential output, one DFT bin. Each word is mixed with a table for
+// the 16 samples and rotated by the exact phase of the line at the start of the word.
+static double line_power(const uint32_t *buffer, int n_words, int line)
+{
+  double n_samples = 16.0 * n_words;
+  float mix_re[16], mix_im[16];
+  double x_re = 0, x_im = 0;
+
+  for(int jj = 0; jj < 16; jj++) {
+    mix_re[jj] = cos(2*M_PI*line*jj/n_samples);
+    mix_im[jj] = -sin(2*M_PI*line*jj/n_samples);
+  }
+  for(int ii = 0; ii < n_words; ii++) {
+    float acc_re = 0, acc_im = 0;
+    uint32_t word = buffer[ii];
+    for(int jj = 0; jj < 16; jj++) {
+      int s = symbol_level(word, jj);
+      acc_re += s*mix_re[jj];
+      acc_im += s*mix_im[jj];
+    }
+    double ph = -2*M_PI*fmod((double)line*ii, n_words)/n_words;
+    double c = cos(ph), s = sin(ph);
+    x_re += acc_re*c - acc_im*s;
+    x_im += acc_re*s + acc_im*c;
+  }
+  return x_re*x_re + x_im*x_im;
+}
+
+
+// Add a product line to the list unless it is a tone, out of band or already there. Negative lines are
+// mirrored at zero.
+static int add_product(int *lines, int n, int line, const int *tone_lines, int n_tones, int n_words)
+{
+  line = abs(line);
+  if(line == 0 || line >= 8*n_words) {
+    return n;
+  }
+  for(int kk = 0; kk < n_tones; kk++) {
+    if(line == tone_lines[kk]) {
+      return n;
+    }
+  }
+  for(int ii = 0; ii < n; ii++) {
+    if(lines[ii] == line) {
+      return n;
+    }
+  }
+  lines[n] = line;
+  return n + 1;
+}
+
+
+imd_t analyze_imd(const uint32_t *buffer, int n_words, const int *tone_lines, int n_tones)
+{
+  const int max_products = max_imd_tones*max_imd_tones*max_imd_tones;
+  int im3[max_products], im5[max_products];
+  int n3 = 0, n5 = 0;
+  double n_samples = 16.0 * n_words;
+  double strongest = 0;
+  imd_t result;
+
+  result.im3_dbc = -200;
+  result.im3_line = 0;
+  result.im5_dbc = -200;
+  result.im5_line = 0;
+  n_tones = (n_tones < max_imd_tones) ? n_tones : max_imd_tones;
+  for(int a = 0; a < n_tones; a++) {
+    double p = line_power(buffer, n_words, tone_lines[a]);
+    result.tone_amplitude[a] = 2*sqrt(p)/n_samples;
+    strongest = (p > strongest) ? p : strongest;
+    for(int b = 0; b < n_tones; b++) {
+      for(int c = 0; c < n_tones; c++) {
+        if(c != a && c != b) {
+          n3 = add_product(im3, n3, tone_lines[a] + tone_lines[b] - tone_lines[c], tone_lines, n_tones, n_words);
+        }
+      }
+      if(b != a) {
+        n5 = add_product(im5, n5, 3*tone_lines[a] - 2*tone_lines[b], tone_lines, n_tones, n_words);
+      }
+    }
+  }
+  result.n_products = n3 + n5;
+  if(strongest <= 0) {
+    return result;
+  }
+  for(int ii = 0; ii < n3; ii++) {
+    double dbc = 10*log10(line_power(buffer, n_words, im3[ii])/strongest + 1e-30);
+    if(dbc > result.im3_dbc) {
+      result.im3_dbc = dbc;
+      result.im3_line = im3[ii];
+    }
+  }
+  for(int ii = 0; ii < n5; ii++) {
+    double dbc = 10*log10(line_power(buffer, n_words, im5[ii])/strongest + 1e-30);
+    if(dbc > result.im5_dbc) {
+      result.im5_dbc = dbc;
+      result.im5_line = im5[ii];
+    }
+  }
+  return result;
+}
+
+
+static uint64_t gcd64(uint64_t a, uint64_t b)
+{
+  while(b != 0) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+
+// Amplitude of a line at f relative to f = 0, from the rectangular symbols
+static inline double symbol_sinc(double f_over_fs)
+{
+  return (f_over_fs == 0) ? 1 : fabs(sin(M_PI*f_over_fs)/(M_PI*f_over_fs));
+}
+
+
+spur_risk_t predict_spurs(uint32_t n_periods, uint32_t n_words, double fs, double amplitude, bool trinary,
+                          double dither_amplitude, double passband_hz, double harmonic_dbc)
+{
+  int64_t n_samples = 16*(int64_t)n_words;
+  int64_t p = n_periods;
+  double line_spacing = fs/n_samples;
+  int64_t half_band = (int64_t)floor(passband_hz/2/line_spacing);  // Lines on each side of the carrier
+  double carrier_sinc = symbol_sinc(p/(double)n_samples);
+  spur_risk_t risk;
+
+  risk.worst_dbc = -200;
+  risk.offset_hz = 0;
+  risk.source = SPUR_NONE;
+  if(n_periods == 0 || amplitude <= 0) {
+    return risk;
+  }
+
+  // Repetition: the noise power near the carrier, on one side, divided among the lines
+  int64_t period = (dither_amplitude > 0) ? n_samples : n_samples/gcd64(p, n_samples);
+  int64_t step = n_samples/period;  // Lines between the lines that have noise
+  if(step <= half_band) {
+    double shaping = 4*pow(sin(M_PI*p/(double)n_samples), 2);
+    double power = (trinary ? 1/12.0 : 1/3.0) + dither_amplitude*dither_amplitude/3;
+    double peak = (dither_amplitude > 0) ? log(2.0*(half_band/step)) + 0.58 : 1;
+    double noise = power*shaping*2/period*peak;
+    risk.worst_dbc = 10*log10(noise/(amplitude*amplitude/2));
+    risk.offset_hz = step*line_spacing;
+    risk.source = SPUR_REPETITION;
+  }
+
+  // Harmonics and images, m*n_samples +- k*p for the first few
+  for(int k = 1; k <= 5; k++) {
+    double level_db = (k == 1) ? 0 : ((k == 3) ? harmonic_dbc : harmonic_dbc - 20*log10(k/3.0));
+    for(int m = 0; m <= 2; m++) {
+      for(int sign = -1; sign <= 1; sign += 2) {
+        int64_t line = m*n_samples + sign*k*p;
+        if(line <= 0 || (k == 1 && m == 0)) {
+          continue;
+        }
+        int64_t offset = line - p;
+        if(offset == 0 || offset > half_band || offset < -half_band) {
+          continue;
+        }
+        double dbc = level_db + 20*log10(symbol_sinc(line/(double)n_samples)/carrier_sinc + 1e-15);
+        if(dbc > risk.worst_dbc) {
+          risk.worst_dbc = dbc;
+          risk.offset_hz = offset*line_spacing;
+          risk.source = (k == 1) ? SPUR_IMAGE : SPUR_HARMONIC;
+        }
+      }
+    }
+  }
+  return risk;
+}
+
+
+const char *spur_source_str(int source)
+{
+  switch(source) {
+    case SPUR_NONE:
+      return "none";
+    case SPUR_REPETITION:
+      return "repetition";
+    case SPUR_IMAGE:
+      return "image";
+    case SPUR_HARMONIC:
+      return "harmonic";
+    default:
+      return "???";
+  }
+}
+
+
+// A pass from the lower plan lags lower_slip cycles behind the ideal carrier, one from the upper plan gains
+// upper_slip cycles, linearly during the pass. The spectrum of n_passes passes, with a Blackman-Harris window, is
+// calculated at steps of half a bin. Pass k, starting at t_k with the phase phi_k and gaining s_k cycles in
+// T_k, contributes T_k*exp(j*2*pi*(phi_k - f*t_k))*G(s_k - f*T_k), G(d) = (exp(j*2*pi*d) - 1)/(j*2*pi*d).
+// The window is constant during a pass, which leaks the carrier to the multiples of the pass rates, so the
+// spectrum of the unmodulated carrier over the same passes is subtracted from the spurs.
+alternation_t analyze_alternation(uint32_t step, double lower_slip, double upper_slip, double lower_pass_s,
+                                  double upper_pass_s, double bandwidth_hz)
+{
+  const int n_passes = 256;
+  // Static to keep about 6 kB off the stack of the command handler
+  static double ph_re[n_passes], ph_im[n_passes];   // Window times the phasor of the phase at the start of each pass
+  static double win[n_passes];
+  static bool upper[n_passes];
+  double phi = 0, t = 0;
+  uint32_t acc = 0;
+  alternation_t result;
+
+  for(int kk = 0; kk < n_passes; kk++) {
+    uint32_t next = acc + step;
+    upper[kk] = (next < acc);
+    acc = next;
+    t += upper[kk] ? upper_pass_s : lower_pass_s;
+  }
+  double duration = t;
+  result.max_phase_deg = 0;
+  t = 0;
+  for(int kk = 0; kk < n_passes; kk++) {
+    double s = upper[kk] ? upper_slip : -lower_slip;
+    double len = upper[kk] ? upper_pass_s : lower_pass_s;
+    double x = 2*M_PI*(t + len/2)/duration;
+    double w = 0.35875 - 0.48829*cos(x) + 0.14128*cos(2*x) - 0.01168*cos(3*x);
+    win[kk] = w*len;
+    ph_re[kk] = w*len*cos(2*M_PI*phi);
+    ph_im[kk] = w*len*sin(2*M_PI*phi);
+    result.max_phase_deg = fmax(result.max_phase_deg, 360*fmax(fabs(phi), fabs(phi + s)));
+    phi += s;
+    t += len;
+  }
+
+  int n_freqs = (int)fmin(bandwidth_hz*2*duration, 16*n_passes);
+  double carrier = 0;
+  result.worst_spur_dbc = -200;
+  result.worst_spur_offset_hz = 0;
+  for(int ff = -n_freqs; ff <= n_freqs; ff++) {
+    double f = ff/(2.0*duration);
+    // G for the two plans, and for the two pass lengths without modulation
+    double g_re[4], g_im[4], rot_re[2], rot_im[2];
+    for(int gg = 0; gg < 4; gg++) {
+      double len = (gg & 1) ? upper_pass_s : lower_pass_s;
+      double d = ((gg >= 2) ? 0 : ((gg & 1) ? upper_slip : -lower_slip)) - f*len;
+      if(fabs(d) < 1e-12) {
+        g_re[gg] = 1;
+        g_im[gg] = 0;
+      } else {
+        g_re[gg] = sin(2*M_PI*d)/(2*M_PI*d);
+        g_im[gg] = (1 - cos(2*M_PI*d))/(2*M_PI*d);
+      }
+    }
+    for(int uu = 0; uu < 2; uu++) {
+      double len = uu ? upper_pass_s : lower_pass_s;
+      // Rotation of exp(-j*2*pi*f*t) during a pass
+      rot_re[uu] = cos(2*M_PI*f*len);
+      rot_im[uu] = -sin(2*M_PI*f*len);
+    }
+    double p_re = 1, p_im = 0, tmp;
+    double x_re[4] = {0, 0, 0, 0}, x_im[4] = {0, 0, 0, 0};
+    for(int kk = 0; kk < n_passes; kk++) {
+      int uu = upper[kk];
+      x_re[uu] += ph_re[kk]*p_re - ph_im[kk]*p_im;
+      x_im[uu] += ph_re[kk]*p_im + ph_im[kk]*p_re;
+      x_re[uu + 2] += win[kk]*p_re;
+      x_im[uu + 2] += win[kk]*p_im;
+      tmp = p_re*rot_re[uu] - p_im*rot_im[uu];
+      p_im = p_re*rot_im[uu] + p_im*rot_re[uu];
+      p_re = tmp;
+    }
+    double re = 0, im = 0;
+    for(int gg = 0; gg < 4; gg++) {
+      double sign = (gg >= 2 && ff != 0) ? -1 : ((gg >= 2) ? 0 : 1);
+      re += sign*(x_re[gg]*g_re[gg] - x_im[gg]*g_im[gg]);
+      im += sign*(x_re[gg]*g_im[gg] + x_im[gg]*g_re[gg]);
+    }
+    double p = re*re + im*im;
+    if(ff == 0) {
+      carrier = p;
+    } else if(abs(ff) > 8 && p > 0) {
+      // Outside the main lobe of the window, four bins
+      double dbc = 10*log10(p);
+      if(dbc > result.worst_spur_dbc) {
+        result.worst_spur_dbc = dbc;
+        result.worst_spur_offset_hz = f;
+      }
+    }
+  }
+  if(carrier > 0) {
+    result.worst_spur_dbc -= 10*log10(carrier);
+  }
+  return result;
+}
+
+
+uint32_t count_transitions(const uint32_t *buffer, int n_words)
+{
+  uint32_t prev_bits = buffer[n_words - 1] >> 30;
+  uint32_t transitions = 0;
+  for(int ii = 0; ii < n_words; ii++) {
+    uint32_t word = buffer[ii];
+    for(int jj = 0; jj < 16; jj++) {
+      uint32_t bits = (word >> (2*jj)) & 3;
+      uint32_t changed = bits ^ prev_bits;
+      transitions += (changed & 1) + (changed >> 1);
+      prev_bits = bits;
+    }
+  }
+  return transitions;
+}
+
+
+double count_transitions_hiz(const uint32_t *buffer, int n_words)
+{
+  uint32_t prev_bits = buffer[n_words - 1] >> 30;
+  double transitions = 0;
+  for(int ii = 0; ii < n_words; ii++) {
+    uint32_t word = buffer[ii];
+    for(int jj = 0; jj < 16; jj++) {
+      uint32_t bits = (word >> (2*jj)) & 3;
+      bool driven = (bits == 1 || bits == 2);
+      bool prev_driven = (prev_bits == 1 || prev_bits == 2);
+      if(driven && prev_driven) {
+        transitions += (bits != prev_bits) ? 2 : 0;
+      } else if(driven) {
+        transitions += 1;   // Both pins from the middle
+      }
+      prev_bits = bits;
+    }
+  }
+  return transitions;
+}
+
+
+uint32_t sniff_crc32(uint32_t crc, const uint32_t *words, int n_words)
+{
+  static uint32_t table[256];
+  static bool table_ready = false;
+
+  if(!table_ready) {
+    for(int ii = 0; ii < 256; ii++) {
+      uint32_t c = (uint32_t)ii << 24;
+      for(int jj = 0; jj < 8; jj++) {
+        c = (c & 0x80000000u) ? (c << 1) ^ 0x04c11db7u : (c << 1);
+      }
+      table[ii] = c;
+    }
+    table_ready = true;
+  }
+  for(int ii = 0; ii < n_words; ii++) {
+    uint32_t w = words[ii];
+    for(int bb = 0; bb < 4; bb++) {
+      crc = (crc << 8) ^ table[(crc >> 24) ^ (w & 0xff)];
+      w >>= 8;
+    }
+  }
+  return crc;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+
+// Analysis of the generated signals, to be able to compare settings directly on the device.
+
+// Spectral properties of a keyed carrier (a morse dot) for a given keying envelope
+typedef struct {
+  double occupied_bw_hz;  // Bandwidth (two-sided) containing 99% of the energy of a dot
+  double click_db;        // Energy outside +-click_offset_hz relative to hard keying, dB
+} key_click_t;
+
+const double click_offset_hz = 1000.0;
+
+key_click_t analyze_key_click(const float *table, int table_len, double rise_time_s, double dot_time_s);
+
+
+// Spectral properties of the periodic waveform in a synth buffer, measured in a band around the carrier
+typedef struct {
+  bool valid;               // False if there was not enough memory for the analysis
+  double carrier_amplitude; // Amplitude of the carrier relative to a full scale sine
+  double worst_spur_dbc;    // Strongest spurious tone in the band
+  double worst_spur_offset_hz;
+  double snr_db;            // Carrier power relative to everything else in the band
+  int n_bins;               // Number of spectral lines in the band, including the carrier
+  double transitions_per_s; // Pin level changes per second, both pins counted
+  double common_mode_dbc;   // Power of the common mode of the pins in the band, relative to the carrier
+} spectrum_t;
+
+// With hiz_zero, the zeros are played with the pins high impedance instead of as the pin levels in the buffer
+spectrum_t analyze_buffer(const uint32_t *buffer, int n_words, int n_periods, double fs, double bandwidth_hz,
+                          bool hiz_zero = false);
+
+// Intermodulation of the tones in a buffer. The tones are lines tone_lines[k] of the spectrum of the buffer
+// played repeatedly. The third order products are the lines a + b - c and the fifth order ones 3a - 2b, of
+// tones a, b and c, that do not fall on a tone. Levels relative to the strongest tone.
+const int max_imd_tones = 4;
+
+typedef struct {
+  double tone_amplitude[max_imd_tones]; // Relative to a full scale sine
+  double im3_dbc;           // Strongest third order product
+  int im3_line;
+  double im5_dbc;           // Strongest fifth order product
+  int im5_line;
+  int n_products;           // Number of products calculated
+} imd_t;
+
+imd_t analyze_imd(const uint32_t *buffer, int n_words, const int *tone_lines, int n_tones);
+
+// Spurs of a plan, predicted without generating the buffer, cheap enough to rank thousands of candidate plans.
+// The buffer of 16*n_words samples with n_periods periods is played repeatedly, so everything is on lines
+// fs/(16*n_words) apart:
+// - Repetition: the quantization noise and the dither (uniform, +-dither_amplitude) of the first order
+//   modulator, shaped by |1 - z^-1|^2 at the carrier, on the lines of the repetition period. With dither the
+//   strongest of M lines is about ln(M) + 0.58 times their mean. Without dither the period is taken as that of
+//   the input, 16*n_words/gcd(n_periods, 16*n_words), which puts the noise on fewer and stronger lines.
+// - Images and harmonics: harmonic k of the carrier (harmonic_dbc for the third, 1/k for the others) and its
+//   images around multiples of fs, attenuated by the sinc of the symbols, land on line m*16*n_words +- k*n_periods.
+// The worst of them within passband_hz (two-sided) around the carrier is returned.
+enum spur_source_t {
+  SPUR_NONE = 0,
+  SPUR_REPETITION,
+  SPUR_IMAGE,
+  SPUR_HARMONIC
+};
+
+typedef struct {
+  double worst_dbc;
+  double offset_hz;
+  int source;               // spur_source_t
+} spur_risk_t;
+
+spur_risk_t predict_spurs(uint32_t n_periods, uint32_t n_words, double fs, double amplitude, bool trinary,
+                          double dither_amplitude, double passband_hz, double harmonic_dbc);
+const char *spur_source_str(int source);
+
+// Close-in spurs of a carrier that alternates between the plans just below and just above its frequency, the
+// upper one chosen for a pass when a 32-bit phase accumulator incremented by step overflows, as the interrupt
+// handler does. Only the phase of the carrier is modelled, the spectrum of each buffer is that of
+// analyze_buffer().
+typedef struct {
+  double worst_spur_dbc;    // Strongest spur within bandwidth_hz of the carrier
+  double worst_spur_offset_hz;
+  double max_phase_deg;     // Largest deviation from the phase of the ideal carrier
+} alternation_t;
+
+alternation_t analyze_alternation(uint32_t step, double lower_slip, double upper_slip, double lower_pass_s,
+                                  double upper_pass_s, double bandwidth_hz);
+
+// Number of pin level changes (both pins) during one pass through 'buffer', when it is played repeatedly
+uint32_t count_transitions(const uint32_t *buffer, int n_words);
+// The same with high impedance zeros, in full swings. A pin that is let go floats to the middle between the
+// levels (the load ties the two pins together), so driving it again is half a swing and letting it go none.
+double count_transitions_hiz(const uint32_t *buffer, int n_words);
+
+
+// Software model of the CRC-32 calculated by the DMA sniffer in CRC-32 mode (IEEE 802.3 polynomial, 
+// bytes in memory order, most significant bit first, no final inversion), starting from crc.
+uint32_t sniff_crc32(uint32_t crc, const uint32_t *words, int n_words);
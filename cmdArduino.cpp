@@ -39,6 +39,7 @@
 */
 /**************************************************************************/
 #include "cmdArduino.h"
+#include "trace.h"
 
 // command line message buffer and pointer
 static uint8_t msg[MAX_MSG_SIZE];
@@ -115,6 +116,10 @@ void Cmd::parse(char *cmd)
     {
         if (!strcmp(argv[0], cmd_entry->cmd))
         {
+            // trace the first four characters of the command name
+            uint32_t name = 0;
+            memcpy(&name, argv[0], min(strlen(argv[0]), (size_t)4));
+            trace_event(TRACE_COMMAND, name);
             cmd_entry->func(argc, argv);
             display_prompt();
             return;
@@ -1,6 +1,11 @@
 #include <pico/stdlib.h>
 #include "commands.h"
 #include "transmitter_PiPico.h"
+#include "analysis.h"
+#include "trace.h"
+#include "loopmon.h"
+#include "energy.h"
+#include "scheduler.h"
 
 void CmdPrintHelp(int argc, char **argv);
 void CmdPrintStatus(int argc, char **argv);
@@ -15,6 +20,34 @@ void CmdPhaseHD3(int argc, char **argv);
 void CmdFreq(int argc, char **argv);
 void CmdMode(int argc, char **argv);
 void CmdBufsize(int argc, char **argv);
+void CmdTaper(int argc, char **argv);
+void CmdPattern(int argc, char **argv);
+void CmdTransitions(int argc, char **argv);
+void CmdAnalyze(int argc, char **argv);
+void CmdCompress(int argc, char **argv);
+void CmdRle(int argc, char **argv);
+void CmdSeed(int argc, char **argv);
+void CmdDitherShape(int argc, char **argv);
+void CmdCache(int argc, char **argv);
+void CmdCrc(int argc, char **argv);
+void CmdSine(int argc, char **argv);
+void CmdKernel(int argc, char **argv);
+void CmdZero(int argc, char **argv);
+void CmdRefresh(int argc, char **argv);
+void CmdPark(int argc, char **argv);
+void CmdBank(int argc, char **argv);
+void CmdLevel(int argc, char **argv);
+void CmdTones(int argc, char **argv);
+void CmdTone(int argc, char **argv);
+void CmdFine(int argc, char **argv);
+void CmdSpurPlan(int argc, char **argv);
+void CmdOutputs(int argc, char **argv);
+void CmdPhase(int argc, char **argv);
+void CmdTrace(int argc, char **argv);
+void CmdLoopmon(int argc, char **argv);
+void CmdEnergy(int argc, char **argv);
+void CmdBattery(int argc, char **argv);
+void CmdSched(int argc, char **argv);
 void CmdDefault(int argc, char **argv);
 void CmdOff(int argc, char **argv);
 
@@ -39,6 +72,34 @@ void RegisterCommands() {
   cmd.add("freq", CmdFreq);
   cmd.add("mode", CmdMode);
   cmd.add("bufsize", CmdBufsize);
+  cmd.add("taper", CmdTaper);
+  cmd.add("pattern", CmdPattern);
+  cmd.add("trans", CmdTransitions);
+  cmd.add("analyze", CmdAnalyze);
+  cmd.add("compress", CmdCompress);
+  cmd.add("rle", CmdRle);
+  cmd.add("seed", CmdSeed);
+  cmd.add("dithershape", CmdDitherShape);
+  cmd.add("cache", CmdCache);
+  cmd.add("crc", CmdCrc);
+  cmd.add("sine", CmdSine);
+  cmd.add("kernel", CmdKernel);
+  cmd.add("zero", CmdZero);
+  cmd.add("refresh", CmdRefresh);
+  cmd.add("park", CmdPark);
+  cmd.add("bank", CmdBank);
+  cmd.add("level", CmdLevel);
+  cmd.add("tones", CmdTones);
+  cmd.add("tone", CmdTone);
+  cmd.add("fine", CmdFine);
+  cmd.add("spurplan", CmdSpurPlan);
+  cmd.add("outputs", CmdOutputs);
+  cmd.add("phase", CmdPhase);
+  cmd.add("trace", CmdTrace);
+  cmd.add("loopmon", CmdLoopmon);
+  cmd.add("energy", CmdEnergy);
+  cmd.add("battery", CmdBattery);
+  cmd.add("sched", CmdSched);
   cmd.add("default", CmdDefault);
   cmd.add("off", CmdOff);
 }
@@ -65,6 +126,8 @@ void CmdPrintHelp(int argc, char **argv) {
   Serial.println("  call str - set str as call sign, e.g. SA5BYZ");
   Serial.println("  call     - send no call sign");
   Serial.println("  dither val - set the amount of dither, 0.0 to 2.0");
+  Serial.println("  seed n - set the seed of the dither random numbers");
+  Serial.println("  dithershape n - dither spectrum, 0 - white, 1 - 1st order HP, 2 - 2nd order HP, 3 - carrier stop");
   Serial.println("  ampl val - set the amplitude, 0.0 to 2.0");
   Serial.println("  ampl3 val - set the amplitude of HD3, -0.5 to 0.5");
   Serial.println("  ph3 val - set the phase of HD3, degrees");
@@ -72,8 +135,45 @@ void CmdPrintHelp(int argc, char **argv) {
   Serial.println("  mode val - set the signal generation mode:");
   Serial.println("             0 - CLKDIV, 1 - comparator, 2 - binary sigma delta,");
   Serial.println("             3 - trinary sigma delta, 4 - click free binary sigma delta,");
-  Serial.println("             5 - click free trinary sigma delta");
+  Serial.println("             5 - click free trinary sigma delta, 6 - fractional-N without DMA");
   Serial.println("  bufsize val - set max number of words in buffer");
+  Serial.println("  taper val - set the keying envelope shape in modes 4 and 5:");
+  Serial.println("              0 - raised cosine, 1 - Blackman-Harris, 2 - error function,");
+  Serial.println("              3 - Hann squared, 4 - user defined");
+  Serial.println("  taper user v1 v2 ... - set a user defined shape from 2 to 16 points, 0 to 1, first 0 and last 1");
+  Serial.println("  taper info - print occupied bandwidth and key clicks for the shapes");
+  Serial.println("  pattern val - experimental fast sigma delta from a pattern table (1, SNR 15-20 dB lower), or off (0)");
+  Serial.println("  trans val - penalty on output transitions in sigma delta modes, 0.0 (off) to 0.5");
+  Serial.println("  analyze [bw] - measure spurs and SNR within bw kHz around the carrier (default 200)");
+  Serial.println("  compress n - play a compressed buffer of up to n words in modes 1-3, 0 for off");
+  Serial.println("  rle val - play the buffer as runs of symbols in modes 1-3 when possible (1) or not (0)");
+  Serial.println("  cache n - keep up to n kB of recently calculated buffers, 0 for off");
+  Serial.println("  sine n - sine for sigma delta, 0 - exact, 1 - table, 2 - table with interpolator");
+  Serial.println("  kernel n - sigma delta arithmetic, 0 - double, 1 - fixed point lanes");
+  Serial.println("  kernel bench - time the calculation of the buffers with each kernel");
+  Serial.println("  zero n - zero level of trinary sigma delta, 0 - both pins low or high alternating,");
+  Serial.println("           1 - both pins low, 2 - both pins high impedance");
+  Serial.println("  refresh val - let core 1 refresh the dither of the main buffer (1) or not (0)");
+  Serial.println("  park val - stop the DMAs and the PIO when silent (1) or not (0), or reset the statistics (reset)");
+  Serial.println("  park delay ms - park when the output has been silent for ms milliseconds");
+  Serial.println("  park clock MHz [ms] - lower the system clock to MHz when parked for ms milliseconds, 0 to keep it");
+  Serial.println("  bank n - number of amplitude levels besides the main one, calculated with it in modes 2-5, 0 to 3");
+  Serial.println("  bank k ampl - set the amplitude of bank level k, at most the main amplitude");
+  Serial.println("  level k - play the main amplitude (0) or bank level k from the next buffer, without recalculation");
+  Serial.println("  tones n - number of tones added to the carrier in modes 2-5, 0 to 3");
+  Serial.println("  tone k freq ampl [phase] - set tone k, frequency in Hz, phase in degrees");
+  Serial.println("  fine 0|1 - alternate between the plans below and above the frequency, for mHz resolution");
+  Serial.println("  spurplan Hz [bw] - plan with the weakest predicted spurs in bw kHz, within Hz of the frequency");
+  Serial.println("  outputs n - number of extra outputs phase locked to the main one in modes 1-3, 0 to 2");
+  Serial.println("  phase k deg - set the phase of extra output k (1 or 2) relative to the main output");
+  Serial.println("  crc val - check the CRC of each played buffer with the DMA sniffer (1) or not (0)");
+  Serial.println("  trace - print the recorded events, convert with trace2json.py");
+  Serial.println("  trace val - record events (1) or not (0), or clear the records (clear)");
+  Serial.println("  loopmon val - measure the period of the main loop (1) or not (0), or reset the statistics (reset)");
+  Serial.println("  loopmon alarm us - warn when a loop (one task or sleep) exceeds us microseconds, 0 for no alarm");
+  Serial.println("  energy - print the estimated current, battery time and how the settings affect them");
+  Serial.println("  battery mAh - set the capacity of a full power bank and restart the energy accounting");
+  Serial.println("  sched [reset] - print the run time and deadline statistics of the main loop tasks, or reset them");
   Serial.println("  default - set all parameters to default values");
   Serial.println("  off val - turn output off");
   Serial.println("            0 - turn output on");
@@ -98,9 +198,13 @@ void PrintStatus()
   }
   Serial.print("CPU_freq: ");
   Serial.println(CPU_freq_actual);
-  if(rf_synth->get_mode() != 0) {
+  if(rf_synth->uses_buffers()) {
     Serial.print("Dither: ");
     Serial.println(rf_synth->get_dither_amplitude());
+    Serial.print("Dither seed: ");
+    Serial.println(rf_synth->get_dither_seed());
+    Serial.print("Dither shape: ");
+    Serial.println(dither_shape_str(rf_synth->get_dither_shape()));
     Serial.print("Amplitude: ");
     Serial.println(rf_synth->get_amplitude());
     Serial.print("HD3 amplitude: ");
@@ -111,6 +215,193 @@ void PrintStatus()
     Serial.println(rf_synth->get_n_words());
     Serial.print("N periods: ");
     Serial.println(rf_synth->get_n_periods());
+    spur_risk_t risk = rf_synth->get_plan_risk();
+    Serial.print("Predicted worst spur (dBc): ");
+    Serial.print(risk.worst_dbc, 1);
+    Serial.print(" at ");
+    Serial.print(risk.offset_hz, 0);
+    Serial.print(" Hz, ");
+    Serial.print(spur_source_str(risk.source));
+    if(rf_synth->get_plan_tolerance() > 0) {
+      Serial.print(", best of ");
+      Serial.print(rf_synth->get_plan_candidates());
+      Serial.print(" plans within ");
+      Serial.print(rf_synth->get_plan_tolerance(), 1);
+      Serial.print(" Hz");
+    }
+    Serial.println();
+    if(rf_synth->get_mode() >= 2) {
+      Serial.print("Pattern synthesis (experimental): ");
+      rf_synth->get_pattern_synthesis() ? Serial.println("On") : Serial.println("Off");
+      Serial.print("Sine: ");
+      Serial.println(sine_method_str(rf_synth->get_sine_method()));
+      Serial.print("Kernel: ");
+      Serial.println(sd_kernel_str(rf_synth->get_sd_kernel()));
+      Serial.print("Transition penalty: ");
+      Serial.println(rf_synth->get_transition_penalty());
+      Serial.print("Zero: ");
+      Serial.print(zero_mode_str(rf_synth->get_zero_mode()));
+      bool trinary = (rf_synth->get_mode() == 3 || rf_synth->get_mode() == 5);
+      if(rf_synth->get_zero_mode() == ZERO_HIZ && !rf_synth->is_hiz() && trinary) {
+        Serial.print(" (not possible with this buffer, both pins low)");
+      }
+      Serial.println();
+    }
+    Serial.print("Calculation time (ms): ");
+    Serial.println(rf_synth->get_calculation_time_us()/1000.0);
+    Serial.print("Stages run (ms):");
+    if(rf_synth->get_stages_run() == 0) {
+      Serial.print(" none");
+    }
+    for(int ii = 0; ii < N_STAGES; ii++) {
+      if(rf_synth->get_stages_run() & (1u << ii)) {
+        Serial.print(" ");
+        Serial.print(calc_stage_str(ii));
+        Serial.print(" ");
+        Serial.print(rf_synth->get_stage_time_us(ii)/1000.0);
+      }
+    }
+    Serial.println();
+    if(rf_synth->get_refresh()) {
+      Serial.print("Refresh (buffers/s): ");
+      Serial.print(rf_synth->get_refresh_rate(), 2);
+      Serial.print(", core 1 load (%): ");
+      Serial.println(rf_synth->get_refresh_load(), 1);
+    }
+    if(rf_synth->get_bank_levels() > 0) {
+      Serial.print("Bank levels:");
+      for(int kk = 0; kk < rf_synth->get_active_bank_levels(); kk++) {
+        Serial.print(" ");
+        Serial.print(rf_synth->get_bank_amplitude(kk), 3);
+      }
+      if(rf_synth->get_active_bank_levels() < rf_synth->get_bank_levels()) {
+        Serial.print(" (");
+        Serial.print(rf_synth->get_bank_levels() - rf_synth->get_active_bank_levels());
+        Serial.print(" not possible)");
+      }
+      Serial.print(", ");
+      Serial.print(rf_synth->get_bank_level_bytes()/1024.0, 1);
+      Serial.print(" kB each, playing level ");
+      Serial.println(rf_synth->get_level());
+    }
+    if(rf_synth->is_fine_tuned()) {
+      Serial.print("Fine tuning: ");
+      Serial.print(rf_synth->get_n_periods());
+      Serial.print("/");
+      Serial.print(rf_synth->get_n_words());
+      Serial.print(" and ");
+      Serial.print(rf_synth->get_fine_periods());
+      Serial.print("/");
+      Serial.print(rf_synth->get_fine_words());
+      Serial.print(", the upper in ");
+      Serial.print(100*rf_synth->get_fine_fraction(), 4);
+      Serial.println(" % of the passes");
+    } else if(rf_synth->get_fine_tuning()) {
+      Serial.println("Fine tuning: not possible with these settings, or not needed");
+    }
+    if(rf_synth->tones_active()) {
+      Serial.print("Tones (Hz/ampl):");
+      for(int kk = 0; kk < rf_synth->get_tones(); kk++) {
+        Serial.print(" ");
+        Serial.print(rf_synth->get_tone_frequency_exact(kk), 3);
+        Serial.print("/");
+        Serial.print(rf_synth->get_tone_amplitude(kk), 3);
+      }
+      Serial.println();
+    }
+    if(rf_synth->get_park()) {
+      Serial.print("Parking: after ");
+      Serial.print(rf_synth->get_park_delay());
+      Serial.print(" ms");
+      if(rf_synth->get_park_clock() > 0) {
+        Serial.print(", ");
+        Serial.print(rf_synth->get_park_clock()/1000.0, 1);
+        Serial.print(" MHz after ");
+        Serial.print(rf_synth->get_park_slow_after());
+        Serial.print(" ms");
+      }
+      Serial.println(rf_synth->is_parked() ? ", parked" : "");
+      Serial.print("Parks: ");
+      Serial.print(rf_synth->get_parks());
+      Serial.print(", wake-up (us): avg ");
+      Serial.print(rf_synth->get_wake_avg_us(), 1);
+      Serial.print(", max ");
+      Serial.println(rf_synth->get_wake_max_us());
+    }
+    if(rf_synth->get_key_edges() > 0) {
+      Serial.print("Key-down to ramp-up (us): avg ");
+      Serial.print(rf_synth->get_key_edge_avg_us(), 1);
+      Serial.print(", max ");
+      Serial.print(rf_synth->get_key_edge_max_us());
+      Serial.print(" over ");
+      Serial.println(rf_synth->get_key_edges());
+    }
+    for(int kk = 0; kk < rf_synth->get_active_extra_outputs(); kk++) {
+      Serial.print("Output ");
+      Serial.print(kk + 1);
+      Serial.print(" phase (deg): ");
+      Serial.print(rf_synth->get_output_phase_actual(kk), 3);
+      Serial.print(", requested ");
+      Serial.print(rf_synth->get_output_phase(kk), 3);
+      Serial.print(", shift ");
+      Serial.print(rf_synth->get_output_shift(kk));
+      Serial.println(" samples");
+    }
+    if(rf_synth->get_active_extra_outputs() < rf_synth->get_extra_outputs()) {
+      Serial.println("Extra outputs not available in this mode");
+    }
+    if(rf_synth->is_crc_checking()) {
+      Serial.print("CRC errors: ");
+      Serial.print(rf_synth->get_crc_errors());
+      Serial.print(" of ");
+      Serial.print(rf_synth->get_crc_checks());
+      Serial.println(" buffers");
+    }
+    if(rf_synth->get_cache_size() > 0) {
+      Serial.print("Cache (kB): ");
+      Serial.print(rf_synth->get_cache_bytes()/1024.0, 1);
+      Serial.print(" of ");
+      Serial.print(rf_synth->get_cache_size()/1024);
+      Serial.print(", hits ");
+      Serial.print(rf_synth->get_cache_hits());
+      Serial.print("/");
+      Serial.println(rf_synth->get_cache_lookups());
+    }
+    if(rf_synth->is_compressed()) {
+      // Each control block takes as much memory as four words
+      int stored_words = rf_synth->get_dictionary_words() + 4*(rf_synth->get_n_blocks() + 1);
+      Serial.print("Compression: ");
+      Serial.print(rf_synth->get_dictionary_words());
+      Serial.print(" words, ");
+      Serial.print(rf_synth->get_n_blocks());
+      Serial.print(" blocks, ratio ");
+      Serial.println((double)rf_synth->get_n_words()/stored_words);
+    }
+    if(rf_synth->is_rle()) {
+      Serial.print("RLE: ");
+      Serial.print(rf_synth->get_rle_words());
+      Serial.print(" words, ratio ");
+      Serial.println((double)rf_synth->get_n_words()/rf_synth->get_rle_words());
+    } else if(rf_synth->get_rle()) {
+      Serial.println("RLE: not possible for this buffer");
+    }
+    if(rf_synth->get_mode() >= 4) {
+      Serial.print("Taper: ");
+      Serial.println(taper_shape_str(rf_synth->get_taper_shape()));
+    }
+  } else if(rf_synth->get_mode() == 6) {
+    Serial.print("Half period (clocks): ");
+    Serial.print(rf_synth->get_fracn_half());
+    Serial.print(" + ");
+    Serial.print(rf_synth->get_fracn_long());
+    Serial.print("/");
+    Serial.println(rf_synth->get_fracn_len());
+    Serial.print("Pattern: 0x");
+    Serial.println(rf_synth->get_fracn_pattern(), HEX);
+    Serial.print("Edge jitter p-p (ns): ");
+    Serial.println(rf_synth->get_fracn_jitter()*1e9/CPU_freq_actual, 2);
+    Serial.print("Frequency error (Hz): ");
+    Serial.println(rf_synth->get_frequency_exact() - rf_synth->get_frequency());
   } else {
     Serial.print("Divider: ");
     float clkdiv = round(256.0*CPU_freq_actual/(2.0*rf_synth->get_frequency_exact()))/256.0;
@@ -136,6 +427,9 @@ void CmdPrintStatus(int argc, char **argv) {
     return;
   }
   PrintStatus();
+  if(loopmon_on) {
+    loopmon_print();
+  }
 }
 
 
@@ -387,8 +681,8 @@ void CmdMode(int argc, char **argv) {
     return;
   }
   int m = Str2Num(argv[1], 10);
-  if(m > 5 || m < 0) {
-    Serial.print("Mode must be between 0 and 5");
+  if(m > 6 || m < 0) {
+    Serial.print("Mode must be between 0 and 6");
     return;
   }
   rf_synth->set_mode(m);
@@ -416,11 +710,757 @@ void CmdBufsize(int argc, char **argv) {
 }
 
 
+// Print the occupied bandwidth and key click energy of a dot at the current morse rate 
+// for all taper shapes and a few rise times.
+void PrintTaperInfo()
+{
+  static float table[taper_table_len+1];
+  double rise_times[] = {0, 0.5e-3, 1e-3, 2e-3, 5e-3};
+  const int n_rise_times = sizeof(rise_times)/sizeof(rise_times[0]);
+  double dot_time = 1.2/morse_rate;
+  key_click_t kc;
+
+  // The first rise time is the current one, the length of a ramp buffer
+  rise_times[0] = 16.0*rf_synth->get_n_words()/CPU_freq_actual;
+  Serial.print("Dot length (ms): ");
+  Serial.println(dot_time*1000);
+  Serial.print("Click energy is outside +-");
+  Serial.print(click_offset_hz, 0);
+  Serial.println(" Hz relative to hard keying");
+  for(int shape = 0; shape < TAPER_N_SHAPES; shape++) {
+    fill_taper_table(shape, table);
+    Serial.println(taper_shape_str(shape));
+    for(int ii = 0; ii < n_rise_times; ii++) {
+      kc = analyze_key_click(table, taper_table_len, rise_times[ii], dot_time);
+      Serial.printf("  rise %6.3f ms: bandwidth %7.1f Hz, click energy %6.1f dB\n", 
+                    rise_times[ii]*1000, kc.occupied_bw_hz, kc.click_db);
+    }
+  }
+}
+
+
+void CmdTaper(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(taper_shape_str(rf_synth->get_taper_shape()));
+    return;
+  }
+  if(!strcmp(argv[1], "info")) {
+    PrintTaperInfo();
+    return;
+  }
+  if(!strcmp(argv[1], "user")) {
+    float points[max_user_taper_points];
+    int n_points = argc - 2;
+    if(n_points > max_user_taper_points) {
+      n_points = max_user_taper_points + 1; // Let set_user_taper() reject it
+    }
+    for(int ii = 0; ii < n_points && ii < max_user_taper_points; ii++) {
+      points[ii] = Str2Double(argv[ii+2]);
+    }
+    if(!rf_synth->set_user_taper(points, n_points)) {
+      Serial.print("A user taper needs 2 to ");
+      Serial.print(max_user_taper_points);
+      Serial.println(" points from 0 to 1, the first one 0 and the last one 1");
+      return;
+    }
+    rf_synth->apply_settings();
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  int v = Str2Num(argv[1], 10);
+  if(v < 0 || v >= TAPER_N_SHAPES) {
+    Serial.println("Invalid taper shape");
+    return;
+  }
+  rf_synth->set_taper_shape(v);
+  rf_synth->apply_settings();
+}
+
+
+// Experimental, never on by default. The pattern table makes the buffers of the sigma-delta modes about 5x
+// faster, but the SNR is 15-20 dB lower without dither and about 7 dB lower with it than with the true
+// modulators. The dither is white whatever the dither shape, and the 80 kB table is recalculated for every
+// frequency.
+void CmdPattern(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_pattern_synthesis());
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  rf_synth->set_pattern_synthesis(argv[1][0] == '1');
+  if(rf_synth->get_pattern_synthesis()) {
+    Serial.println("Experimental: about 5x faster, but the SNR is 15-20 dB lower, white dither only");
+  }
+  rf_synth->apply_settings();
+}
+
+
+void CmdTransitions(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_transition_penalty());
+    return;
+  }
+  if(argc > 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  double v = Str2Double(argv[1]);
+  if(v >= 0 && v <= 0.5) {
+    rf_synth->set_transition_penalty(v);
+    rf_synth->apply_settings();
+  } else {
+    Serial.println("Invalid transition penalty");
+  }
+}
+
+
+void CmdAnalyze(int argc, char **argv) {
+  double bw = 200e3;
+  spectrum_t sp;
+
+  if(argc > 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  if(argc == 2) {
+    bw = Str2Double(argv[1])*1e3;
+  }
+  if(!rf_synth->uses_buffers()) {
+    Serial.println("Nothing to analyze in this mode");
+    return;
+  }
+  if(rf_synth->is_compressed()) {
+    Serial.println("Can not analyze a compressed buffer");
+    return;
+  }
+  sp = rf_synth->analyze(bw);
+  if(!sp.valid) {
+    Serial.println("Not enough memory for the analysis");
+    return;
+  }
+  Serial.print("Lines in band: ");
+  Serial.println(sp.n_bins);
+  Serial.print("Carrier amplitude: ");
+  Serial.println(sp.carrier_amplitude, 4);
+  Serial.print("Worst spur (dBc): ");
+  Serial.print(sp.worst_spur_dbc, 1);
+  Serial.print(" at ");
+  Serial.print(sp.worst_spur_offset_hz, 0);
+  Serial.println(" Hz");
+  Serial.print("SNR in band (dB): ");
+  Serial.println(sp.snr_db, 1);
+  Serial.print("Pin transitions (M/s): ");
+  Serial.println(sp.transitions_per_s/1e6, 2);
+  Serial.print("Common mode in band (dBc): ");
+  Serial.println(sp.common_mode_dbc, 1);
+  if(rf_synth->is_fine_tuned()) {
+    alternation_t alt = rf_synth->analyze_alternation(bw);
+    Serial.print("Worst fine tuning spur (dBc): ");
+    Serial.print(alt.worst_spur_dbc, 1);
+    Serial.print(" at ");
+    Serial.print(alt.worst_spur_offset_hz, 0);
+    Serial.print(" Hz, max phase error (deg): ");
+    Serial.println(alt.max_phase_deg, 0);
+  }
+  if(rf_synth->tones_active()) {
+    imd_t imd = rf_synth->analyze_imd();
+    double line_hz = CPU_freq_actual/(16.0*rf_synth->get_n_words());
+    Serial.print("Tone amplitudes:");
+    for(int kk = 0; kk <= rf_synth->get_tones(); kk++) {
+      Serial.print(" ");
+      Serial.print(imd.tone_amplitude[kk], 4);
+    }
+    Serial.println();
+    Serial.print("Worst IM3 (dBc): ");
+    Serial.print(imd.im3_dbc, 1);
+    Serial.print(" at ");
+    Serial.print(imd.im3_line*line_hz, 0);
+    Serial.println(" Hz");
+    Serial.print("Worst IM5 (dBc): ");
+    Serial.print(imd.im5_dbc, 1);
+    Serial.print(" at ");
+    Serial.print(imd.im5_line*line_hz, 0);
+    Serial.println(" Hz");
+  }
+}
+
+
+void CmdCompress(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_compression());
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  int n = Str2Num(argv[1], 10);
+  if(n < 0 || n > 1000000) {
+    Serial.println("Parameter must be between 0 and 1000000");
+    return;
+  }
+  rf_synth->set_compression(n);
+  rf_synth->apply_settings();
+}
+
+
+void CmdRle(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_rle());
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  rf_synth->set_rle(argv[1][0] == '1');
+  rf_synth->apply_settings();
+}
+
+
+void CmdSeed(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_dither_seed());
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  rf_synth->set_dither_seed(Str2Num(argv[1], 10));
+  rf_synth->apply_settings();
+}
+
+
+void CmdDitherShape(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(dither_shape_str(rf_synth->get_dither_shape()));
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  int v = Str2Num(argv[1], 10);
+  if(v < 0 || v >= DITHER_N_SHAPES) {
+    Serial.println("Invalid dither shape");
+    return;
+  }
+  rf_synth->set_dither_shape(v);
+  rf_synth->apply_settings();
+}
+
+
+void CmdCache(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_cache_size()/1024);
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  int kb = Str2Num(argv[1], 10);
+  if(kb < 0 || kb > 512) {
+    Serial.println("Parameter must be between 0 and 512");
+    return;
+  }
+  rf_synth->set_cache_size(kb*1024);
+}
+
+
+void CmdCrc(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_crc_check());
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  rf_synth->set_crc_check(argv[1][0] == '1');
+  rf_synth->apply_settings();
+}
+
+
+void CmdSine(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(sine_method_str(rf_synth->get_sine_method()));
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  int v = Str2Num(argv[1], 10);
+  if(v < 0 || v >= SINE_N_METHODS) {
+    Serial.println("Invalid sine method");
+    return;
+  }
+  rf_synth->set_sine_method(v);
+  rf_synth->apply_settings();
+}
+
+
+void CmdKernel(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(sd_kernel_str(rf_synth->get_sd_kernel()));
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  if(strcmp(argv[1], "bench") == 0) {
+    // Recalculate the main buffer with each kernel, then go back to the one in use
+    int kernel = rf_synth->get_sd_kernel();
+    uint32_t time_us[SD_N_KERNELS];
+    if(rf_synth->get_mode() < 2 || !rf_synth->uses_buffers() || rf_synth->get_pattern_synthesis()) {
+      Serial.println("The kernels are only used in modes 2-5 without pattern synthesis");
+      return;
+    }
+    if(rf_synth->get_cache_size() > 0) {
+      Serial.println("Note: cached buffers are not recalculated, turn the cache off for the benchmark");
+    }
+    for(int k = 0; k < SD_N_KERNELS; k++) {
+      rf_synth->set_sd_kernel(k);
+      rf_synth->apply_settings();
+      time_us[k] = rf_synth->get_stage_time_us(STAGE_MAIN);
+    }
+    rf_synth->set_sd_kernel(kernel);
+    rf_synth->apply_settings();
+    for(int k = 0; k < SD_N_KERNELS; k++) {
+      Serial.print(sd_kernel_str(k));
+      Serial.print(" (ms): ");
+      Serial.print(time_us[k]/1000.0);
+      Serial.print(", ");
+      Serial.print((double)time_us[0]/time_us[k], 2);
+      Serial.println(" times the speed of the double kernel");
+    }
+    return;
+  }
+  int v = Str2Num(argv[1], 10);
+  if(v < 0 || v >= SD_N_KERNELS) {
+    Serial.println("Invalid kernel");
+    return;
+  }
+  rf_synth->set_sd_kernel(v);
+  rf_synth->apply_settings();
+}
+
+
+void CmdZero(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(zero_mode_str(rf_synth->get_zero_mode()));
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  int v = Str2Num(argv[1], 10);
+  if(v < 0 || v >= ZERO_N_MODES) {
+    Serial.println("Invalid zero mode");
+    return;
+  }
+  rf_synth->set_zero_mode(v);
+  rf_synth->apply_settings();
+}
+
+
+void CmdRefresh(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_refresh());
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  rf_synth->set_refresh(argv[1][0] == '1');
+}
+
+
+void CmdPark(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_park());
+    return;
+  }
+  if(argc == 3 && strcmp(argv[1], "delay") == 0) {
+    int ms = Str2Num(argv[2], 10);
+    if(ms < 0) {
+      Serial.println("Invalid delay");
+      return;
+    }
+    rf_synth->set_park_delay(ms);
+    return;
+  }
+  if((argc == 3 || argc == 4) && strcmp(argv[1], "clock") == 0) {
+    double MHz = Str2Double(argv[2]);
+    int ms = (argc == 4) ? Str2Num(argv[3], 10) : rf_synth->get_park_slow_after();
+    if(MHz < 0 || MHz*1e6 > CPU_freq_actual || ms < 0) {
+      Serial.println("Invalid clock or delay");
+      return;
+    }
+    rf_synth->set_park_clock(llround(MHz*1000), ms);
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  if(strcmp(argv[1], "reset") == 0) {
+    rf_synth->reset_park_stats();
+  } else {
+    rf_synth->set_park(argv[1][0] == '1');
+  }
+}
+
+
+void CmdBank(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_bank_levels());
+    return;
+  }
+  if(argc == 3) {
+    int k = Str2Num(argv[1], 10);
+    double a = Str2Double(argv[2]);
+    if(k < 1 || k > max_bank_levels) {
+      Serial.print("Level must be between 1 and ");
+      Serial.println(max_bank_levels);
+      return;
+    }
+    if(a < 0 || a > rf_synth->get_amplitude()) {
+      Serial.println("The amplitude must be between 0 and the main amplitude");
+      return;
+    }
+    rf_synth->set_bank_amplitude(k - 1, a);
+    rf_synth->apply_settings();
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  int n = Str2Num(argv[1], 10);
+  if(n < 0 || n > max_bank_levels) {
+    Serial.print("Number of levels must be between 0 and ");
+    Serial.println(max_bank_levels);
+    return;
+  }
+  rf_synth->set_bank_levels(n);
+  rf_synth->apply_settings();
+}
+
+
+void CmdLevel(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_level());
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  int k = Str2Num(argv[1], 10);
+  if(k < 0 || k > rf_synth->get_active_bank_levels()) {
+    Serial.print("Level must be between 0 and ");
+    Serial.println(rf_synth->get_active_bank_levels());
+    return;
+  }
+  rf_synth->set_level(k);
+}
+
+
+void CmdTones(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_tones());
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  int n = Str2Num(argv[1], 10);
+  if(n < 0 || n > max_tones) {
+    Serial.print("Number of tones must be between 0 and ");
+    Serial.println(max_tones);
+    return;
+  }
+  rf_synth->set_tones(n);
+  rf_synth->apply_settings();
+}
+
+
+void CmdTone(int argc, char **argv) {
+  if(argc == 2) {
+    int k = Str2Num(argv[1], 10);
+    if(k >= 1 && k <= max_tones) {
+      Serial.print(rf_synth->get_tone_frequency(k - 1), 3);
+      Serial.print(" Hz, ampl ");
+      Serial.print(rf_synth->get_tone_amplitude(k - 1), 3);
+      Serial.print(", phase ");
+      Serial.println(rf_synth->get_tone_phase(k - 1)*180/M_PI, 1);
+      return;
+    }
+  }
+  if(argc < 4 || argc > 5) {
+    PrintNumArgError(argc, argv, 4);
+    return;
+  }
+  int k = Str2Num(argv[1], 10);
+  double f = Str2Double(argv[2]);
+  double a = Str2Double(argv[3]);
+  double phase = (argc == 5) ? Str2Double(argv[4]) : 0;
+  if(k < 1 || k > max_tones) {
+    Serial.print("Tone must be between 1 and ");
+    Serial.println(max_tones);
+    return;
+  }
+  if(f <= 0 || f >= CPU_freq_actual/32 || a < 0 || a > 1) {
+    Serial.println("Invalid frequency or amplitude");
+    return;
+  }
+  rf_synth->set_tone(k - 1, f, a, phase*M_PI/180);
+  double sum = rf_synth->get_amplitude() + rf_synth->get_hd3_amplitude();
+  for(int kk = 0; kk < rf_synth->get_tones(); kk++) {
+    sum += rf_synth->get_tone_amplitude(kk);
+  }
+  if(sum > 1) {
+    Serial.println("Warning: the sum of the amplitudes is above 1, the modulator may overload");
+  }
+  rf_synth->apply_settings();
+}
+
+
+void CmdFine(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_fine_tuning());
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  rf_synth->set_fine_tuning(argv[1][0] == '1');
+  rf_synth->apply_settings();
+}
+
+
+void CmdSpurPlan(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.print(rf_synth->get_plan_tolerance(), 3);
+    Serial.print(" Hz, ");
+    Serial.print(rf_synth->get_plan_passband()/1e3, 1);
+    Serial.println(" kHz");
+    return;
+  }
+  if(argc > 3) {
+    PrintNumArgError(argc, argv, 3);
+    return;
+  }
+  double tol = Str2Double(argv[1]);
+  double bw = (argc == 3) ? Str2Double(argv[2])*1e3 : rf_synth->get_plan_passband();
+  if(tol < 0 || bw <= 0) {
+    Serial.println("Invalid tolerance or bandwidth");
+    return;
+  }
+  rf_synth->set_plan_tolerance(tol, bw);
+  rf_synth->apply_settings();
+}
+
+
+void CmdOutputs(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(rf_synth->get_extra_outputs());
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  int n = Str2Num(argv[1], 10);
+  if(n < 0 || n > max_extra_outputs) {
+    Serial.print("Parameter must be between 0 and ");
+    Serial.println(max_extra_outputs);
+    return;
+  }
+  rf_synth->set_extra_outputs(n);
+  rf_synth->apply_settings();
+}
+
+
+void CmdPhase(int argc, char **argv) {
+  if(argc != 3) {
+    PrintNumArgError(argc, argv, 3);
+    return;
+  }
+  int k = Str2Num(argv[1], 10);
+  if(k < 1 || k > max_extra_outputs) {
+    Serial.print("Output must be between 1 and ");
+    Serial.println(max_extra_outputs);
+    return;
+  }
+  rf_synth->set_output_phase(k - 1, Str2Double(argv[2]));
+  rf_synth->apply_settings();
+}
+
+
+void CmdTrace(int argc, char **argv) {
+  if(argc == 1) {
+    trace_print();
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  if(strcmp(argv[1], "clear") == 0) {
+    trace_clear();
+  } else {
+    trace_enable(argv[1][0] == '1');
+  }
+}
+
+
+void CmdLoopmon(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(loopmon_on);
+    return;
+  }
+  if(argc == 3 && strcmp(argv[1], "alarm") == 0) {
+    int us = Str2Num(argv[2], 10);
+    if(us < 0) {
+      Serial.println("Invalid alarm threshold");
+      return;
+    }
+    loopmon_set_alarm(us);
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  if(strcmp(argv[1], "reset") == 0) {
+    loopmon_reset();
+  } else {
+    loopmon_enable(argv[1][0] == '1');
+  }
+}
+
+
+void CmdEnergy(int argc, char **argv) {
+  const int num_args = 1;
+
+  if(argc != num_args) {
+    PrintNumArgError(argc, argv, num_args);
+    return;
+  }
+  energy_print();
+}
+
+
+void CmdBattery(int argc, char **argv) {
+  if(argc == 1) {
+    // No argument, print current value
+    Serial.println(energy_get_battery(), 0);
+    return;
+  }
+  if(argc != 2) {
+    PrintNumArgError(argc, argv, 2);
+    return;
+  }
+  double v = Str2Double(argv[1]);
+  if(v > 0) {
+    energy_set_battery(v);
+  } else {
+    Serial.println("Invalid capacity");
+  }
+}
+
+
+void CmdSched(int argc, char **argv) {
+  if(argc == 2 && strcmp(argv[1], "reset") == 0) {
+    sched_reset_stats();
+    return;
+  }
+  if(argc != 1) {
+    PrintNumArgError(argc, argv, 1);
+    return;
+  }
+  uint64_t sleep_us;
+  uint32_t elapsed = sched_get_elapsed(&sleep_us);
+  sched_stats_t st;
+  char line[100];
+
+  Serial.println("Task        prio period_us   runs  avg_us  max_us late_us missed skipped  load%");
+  for(int ii = 0; sched_get_stats(ii, &st); ii++) {
+    snprintf(line, sizeof(line), "%-11s %4d %9lu %6lu %7.1f %7lu %7lu %6lu %7lu %6.2f", st.name, st.priority,
+             (unsigned long)st.period_us, (unsigned long)st.runs, st.runs ? (double)st.total_us/st.runs : 0.0,
+             (unsigned long)st.max_us, (unsigned long)st.max_late_us, (unsigned long)st.missed,
+             (unsigned long)st.skipped, elapsed ? 100.0*st.total_us/elapsed : 0.0);
+    Serial.println(line);
+  }
+  Serial.print("Sleeping (%): ");
+  Serial.println(elapsed ? 100.0*sleep_us/elapsed : 0.0, 1);
+}
+
+
 void CmdDefault(int argc, char **argv) {
   rf_synth->set_dither_amplitude(1.0);
+  rf_synth->set_dither_seed(1);
+  rf_synth->set_dither_shape(DITHER_WHITE);
   rf_synth->set_amplitude(1.0);
   rf_synth->set_frequency(3579900.0);
   rf_synth->set_mode(5);
+  rf_synth->set_taper_shape(TAPER_RAISED_COSINE);
+  rf_synth->set_pattern_synthesis(false);
+  rf_synth->set_transition_penalty(0);
+  rf_synth->set_compression(0);
+  rf_synth->set_rle(false);
+  rf_synth->set_sine_method(SINE_EXACT);
+  rf_synth->set_sd_kernel(SD_KERNEL_DOUBLE);
+  rf_synth->set_zero_mode(ZERO_TOGGLE);
+  rf_synth->set_refresh(false);
+  rf_synth->set_bank_levels(0);
+  for(int kk = 0; kk < max_bank_levels; kk++) {
+    rf_synth->set_bank_amplitude(kk, 0.5/(kk + 1));
+  }
+  rf_synth->set_level(0);
+  rf_synth->set_tones(0);
+  rf_synth->set_fine_tuning(false);
+  rf_synth->set_plan_tolerance(0, 200e3);
+  rf_synth->set_park(false);
+  rf_synth->set_park_delay(20);
+  rf_synth->set_park_clock(0, 1000);
+  rf_synth->set_extra_outputs(0);
   rf_synth->set_max_words(max_words);
   rf_synth->apply_settings();
 }
@@ -0,0 +1,97 @@
+#include <arduino.h>
+#include "display.h"
+
+// Time needed by the HD44780 for each character or command other than clear and home, with some margin
+static const uint32_t write_interval_us = 50;
+static const int display_cells = display_rows*display_cols;
+static const uint8_t row_addr[display_rows] = {0x00, 0x40, 0x14, 0x54};
+
+static uint8_t rs, en, data_pins[4];
+static char wanted[display_cells];  // Shadow framebuffer
+static char shown[display_cells];   // What the LCD shows
+static bool dirty = false;
+static bool started = false;
+static int scan_cell = 0;           // Where to look for changed cells next
+static int lcd_addr = -1;           // Address counter of the LCD, -1 if not known
+static uint32_t last_write_us;
+
+
+// The LiquidCrystal library must have initialized the LCD (4-bit mode, increment) and cleared it
+void display_begin(uint8_t rs_pin, uint8_t en_pin, uint8_t d4_pin, uint8_t d5_pin, uint8_t d6_pin, uint8_t d7_pin)
+{
+  rs = rs_pin;
+  en = en_pin;
+  data_pins[0] = d4_pin;
+  data_pins[1] = d5_pin;
+  data_pins[2] = d6_pin;
+  data_pins[3] = d7_pin;
+  memset(wanted, ' ', display_cells);
+  memset(shown, ' ', display_cells);
+  lcd_addr = 0;
+  last_write_us = time_us_32();
+  started = true;
+}
+
+
+// Put text in the framebuffer, clipped at the end of the row
+void display_write(int row, int col, const char *text)
+{
+  if(row < 0 || row >= display_rows) {
+    return;
+  }
+  for(int ii = 0; text[ii] != 0 && col + ii < display_cols; ii++) {
+    if(col + ii >= 0 && wanted[row*display_cols + col + ii] != text[ii]) {
+      wanted[row*display_cols + col + ii] = text[ii];
+      dirty = true;
+    }
+  }
+}
+
+
+static void write_nibble(uint8_t nibble)
+{
+  for(int ii = 0; ii < 4; ii++) {
+    gpio_put(data_pins[ii], (nibble >> ii) & 1);
+  }
+  gpio_put(en, 1);
+  busy_wait_us_32(1);
+  gpio_put(en, 0);
+  busy_wait_us_32(1);
+}
+
+
+static void write_byte(bool is_data, uint8_t value)
+{
+  gpio_put(rs, is_data);
+  write_nibble(value >> 4);
+  write_nibble(value & 0x0f);
+  last_write_us = time_us_32();
+}
+
+
+// Send the next changed character, or the command that moves the address counter to it.
+// Takes a few microseconds when there is something to send, and returns at once otherwise.
+void display_poll()
+{
+  if(!started || !dirty || time_us_32() - last_write_us < write_interval_us) {
+    return;
+  }
+  for(int n = 0; n < display_cells; n++) {
+    int cell = (scan_cell + n) % display_cells;
+    if(wanted[cell] == shown[cell]) {
+      continue;
+    }
+    int addr = row_addr[cell/display_cols] + cell % display_cols;
+    if(addr != lcd_addr) {
+      write_byte(false, 0x80 | addr); // Set DDRAM address
+      lcd_addr = addr;
+    } else {
+      write_byte(true, wanted[cell]);
+      shown[cell] = wanted[cell];
+      lcd_addr = addr + 1;  // Rows are not contiguous, a jump to the next row sets the address first
+    }
+    scan_cell = cell;
+    return;
+  }
+  dirty = false;
+}
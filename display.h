@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+// Driver for the 20x4 HD44780 LCD that does not block the main loop. Text is written to a shadow
+// framebuffer, and display_poll() sends at most one byte to the LCD per call, only for the characters
+// that have changed. The LCD is initialized by the LiquidCrystal library, which is not used after that.
+
+const int display_rows = 4;
+const int display_cols = 20;
+
+void display_begin(uint8_t rs_pin, uint8_t en_pin, uint8_t d4_pin, uint8_t d5_pin, uint8_t d6_pin, uint8_t d7_pin);
+void display_write(int row, int col, const char *text);
+void display_poll();
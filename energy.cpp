@@ -0,0 +1,222 @@
+#include <arduino.h>
+#include "energy.h"
+#include "transmitter_PiPico.h"
+
+
+// Per-board constants, currents at the USB input. Calibrate by measuring the supply current with
+// the output off in mode 0 (base and CPU), off in mode 2 (DMA), and keyed in modes 1 and 2 (pins and drive).
+#if PICO_RP2350
+static const float base_mA = 5.0;
+static const float core_mA_per_MHz = 0.06;
+#else
+static const float base_mA = 6.0;
+static const float core_mA_per_MHz = 0.09;
+#endif
+static const float dma_mA_per_MHz = 0.02;
+static const float pin_pF = 15.0;          // Pad, trace and filter input, per pin
+static const float supply_V = 3.3;
+static const float drive_mA = 30.0;        // Into the filter and antenna at amplitude 1
+static const float keep_alive_mA = 40.0;   // With Resistor_Pin high
+static const float usb_per_io = 0.7;       // mA at the USB input per mA at 3.3 V, i.e. 3.3 V/5 V over the regulator efficiency
+
+static const char *item_names[ENERGY_N_ITEMS] = {"base", "CPU", "DMA", "pins", "drive", "keep-alive"};
+
+static float battery_mAh = 10000;
+static double used_mAh = 0;
+static uint64_t start_us = 0, last_update_us = 0, last_integration_us = 0;
+static uint64_t keep_alive_us = 0;
+static uint64_t key_down_start_us = 0;     // Key down time of the synth when the measurement started
+static uint64_t parked_start_us = 0;       // Parked time of the synth when the measurement started
+static uint64_t slow_start_us = 0;         // Time at the parking clock when the measurement started
+
+
+// Measure the keep-alive duty cycle and integrate the used charge. To be called from the main loop.
+void energy_update(bool keep_alive_on)
+{
+  uint64_t now = time_us_64();
+  if(keep_alive_on) {
+    keep_alive_us += now - last_update_us;
+  }
+  last_update_us = now;
+  if(now - last_integration_us >= 1000000) {
+    energy_inputs_t in = energy_inputs();
+    energy_budget_t budget = energy_estimate(&in);
+    used_mAh += budget.total_mA*(now - last_integration_us)/3.6e9;
+    last_integration_us = now;
+  }
+}
+
+
+// The inputs to the model for the current settings, with the keyed time and keep-alive duty cycle
+// measured since the battery was set
+energy_inputs_t energy_inputs()
+{
+  energy_inputs_t in;
+  uint64_t elapsed_us = time_us_64() - start_us;
+  int mode = rf_synth->get_mode();
+
+  // Parked, the DMAs and core 1 rest, and part of the time core 0 runs at the parking clock
+  double parked = elapsed_us ? (double)(rf_synth->get_parked_us() - parked_start_us)/elapsed_us : 0;
+  double slow = elapsed_us ? (double)(rf_synth->get_slow_us() - slow_start_us)/elapsed_us : 0;
+  in.cpu_MHz = CPU_freq_actual/1e6;
+  in.busy_cores = (rf_synth->get_refresh() && mode >= 2 && mode <= 5) ? 2 - parked : 1;
+  in.busy_cores -= slow*(1 - rf_synth->get_park_clock()/(1e3*in.cpu_MHz));
+  in.dma_fraction = (mode >= 1 && mode <= 5) ? 1 - parked : 0;
+  in.key_fraction = elapsed_us ? (double)(rf_synth->get_key_down_us() - key_down_start_us)/elapsed_us : 0;
+  in.keyed_transitions_per_s = rf_synth->get_transitions_per_s();
+  in.amplitude = rf_synth->get_amplitude();
+  in.keep_alive_duty = elapsed_us ? (double)keep_alive_us/elapsed_us : 0;
+  return in;
+}
+
+
+energy_budget_t energy_estimate(const energy_inputs_t *in)
+{
+  energy_budget_t b;
+
+  b.mA[ENERGY_BASE] = base_mA;
+  b.mA[ENERGY_CPU] = core_mA_per_MHz*in->cpu_MHz*in->busy_cores;
+  b.mA[ENERGY_DMA] = dma_mA_per_MHz*in->cpu_MHz*in->dma_fraction;
+  // Each transition moves C*V of charge from the supply (charging) or to ground (discharging), on average C*V/2
+  b.mA[ENERGY_PINS] = usb_per_io*1e3*pin_pF*1e-12*supply_V/2*in->keyed_transitions_per_s*in->key_fraction;
+  b.mA[ENERGY_DRIVE] = usb_per_io*drive_mA*in->amplitude*in->key_fraction;
+  b.mA[ENERGY_KEEP_ALIVE] = usb_per_io*keep_alive_mA*in->keep_alive_duty;
+  b.total_mA = 0;
+  for(int ii = 0; ii < ENERGY_N_ITEMS; ii++) {
+    b.total_mA += b.mA[ii];
+  }
+  return b;
+}
+
+
+// Set the usable capacity of the power bank and start measuring from a full battery
+void energy_set_battery(float mAh)
+{
+  battery_mAh = mAh;
+  used_mAh = 0;
+  start_us = time_us_64();
+  last_update_us = start_us;
+  last_integration_us = start_us;
+  keep_alive_us = 0;
+  key_down_start_us = rf_synth->get_key_down_us();
+  parked_start_us = rf_synth->get_parked_us();
+  slow_start_us = rf_synth->get_slow_us();
+}
+
+
+float energy_get_battery()
+{
+  return battery_mAh;
+}
+
+
+static float hours_left(float mA)
+{
+  return max(battery_mAh - used_mAh, 0.0)/mA;
+}
+
+
+static void print_what_if(const char *what, const energy_inputs_t *in)
+{
+  energy_budget_t b = energy_estimate(in);
+  Serial.print("  ");
+  Serial.print(what);
+  Serial.print(": ");
+  Serial.print(b.total_mA, 1);
+  Serial.print(" mA, ");
+  Serial.print(hours_left(b.total_mA), 1);
+  Serial.println(" h");
+}
+
+
+// Pin transitions per second when keyed in a mode, from the main buffer for the current mode and
+// typical values for the others
+static double mode_transitions(int mode, const energy_inputs_t *now)
+{
+  double fs = now->cpu_MHz*1e6;
+  if(mode == rf_synth->get_mode() && now->keyed_transitions_per_s > 0) {
+    return now->keyed_transitions_per_s;
+  }
+  switch(mode) {
+    case 0:
+      return 2*rf_synth->get_frequency();
+    case 6:
+    case 1:
+      return 4*rf_synth->get_frequency();
+    case 2:
+    case 4:
+      return 0.65*fs;
+    default:
+      return 0.64*fs;
+  }
+}
+
+
+void energy_print()
+{
+  energy_inputs_t in = energy_inputs();
+  energy_budget_t b = energy_estimate(&in);
+  energy_inputs_t alt;
+  char what[40];
+
+  Serial.print("Current (mA):");
+  for(int ii = 0; ii < ENERGY_N_ITEMS; ii++) {
+    Serial.print(" ");
+    Serial.print(item_names[ii]);
+    Serial.print(" ");
+    Serial.print(b.mA[ii], 1);
+    Serial.print(",");
+  }
+  Serial.print(" total ");
+  Serial.println(b.total_mA, 1);
+  Serial.print("Keyed (%): ");
+  Serial.print(100*in.key_fraction, 1);
+  Serial.print(", keep-alive (%): ");
+  Serial.print(100*in.keep_alive_duty, 1);
+  Serial.print(", pin transitions when keyed (M/s): ");
+  Serial.println(in.keyed_transitions_per_s/1e6, 1);
+  Serial.print("Battery (mAh): ");
+  Serial.print(used_mAh, 1);
+  Serial.print(" of ");
+  Serial.print(battery_mAh, 0);
+  Serial.print(" used, ");
+  Serial.print(hours_left(b.total_mA), 1);
+  Serial.println(" h left");
+
+  Serial.println("What if:");
+  for(int mode = 0; mode <= 6; mode++) {
+    alt = in;
+    alt.dma_fraction = (mode >= 1 && mode <= 5) ? 1 : 0;
+    alt.busy_cores = (rf_synth->get_refresh() && mode >= 2 && mode <= 5) ? 2 : 1;
+    alt.keyed_transitions_per_s = mode_transitions(mode, &in);
+    sprintf(what, "mode %d", mode);
+    print_what_if(what, &alt);
+  }
+  for(double MHz = 100; MHz <= 200; MHz += 50) {
+    // The sample rate, and with it the transitions of the sigma-delta modes, follow the clock
+    alt = in;
+    alt.cpu_MHz = MHz;
+    if(rf_synth->get_mode() >= 2 && rf_synth->get_mode() <= 5) {
+      alt.keyed_transitions_per_s *= MHz/in.cpu_MHz;
+    }
+    sprintf(what, "CPU clock %.0f MHz", MHz);
+    print_what_if(what, &alt);
+  }
+  if(rf_synth->uses_buffers()) {
+    alt = in;
+    alt.dma_fraction = in.key_fraction;
+    print_what_if("Parked when silent", &alt);
+    alt.dma_fraction = 1;
+    alt.busy_cores = (rf_synth->get_refresh() && rf_synth->get_mode() >= 2) ? 2 : 1;
+    print_what_if("Not parked", &alt);
+  }
+  alt = in;
+  alt.busy_cores = 3 - in.busy_cores;
+  print_what_if(in.busy_cores > 1 ? "No dither refresh" : "Dither refresh", &alt);
+  alt = in;
+  alt.keep_alive_duty = 0;
+  print_what_if("No keep-alive", &alt);
+  alt = in;
+  alt.key_fraction = 1;
+  print_what_if("Key down", &alt);
+}
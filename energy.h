@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+// Model of the current drawn from the power bank, from what the firmware knows about itself: clock
+// frequency, busy cores, DMA streaming, keyed time, pin transitions and the keep-alive load.
+// The currents are calibrated for each board by the constants in energy.cpp.
+
+enum energy_item_t {
+  ENERGY_BASE = 0,    // Regulator, flash and peripherals
+  ENERGY_CPU,         // Busy cores
+  ENERGY_DMA,         // DMA and PIO streaming to the pins
+  ENERGY_PINS,        // Charging the pin and load capacitance at each transition
+  ENERGY_DRIVE,       // Current into the load (filter and antenna) when keyed
+  ENERGY_KEEP_ALIVE,  // Keep-alive resistor
+  ENERGY_N_ITEMS
+};
+
+// What the estimate is based on
+typedef struct {
+  double cpu_MHz;
+  float busy_cores;               // 0 to 2
+  float dma_fraction;             // Fraction of the time that the DMA streams to the PIO
+  float key_fraction;             // Fraction of the time that the output is keyed
+  double keyed_transitions_per_s; // Pin transitions per second while keyed, both pins
+  float amplitude;
+  float keep_alive_duty;          // Fraction of the time that the keep-alive resistor is on
+} energy_inputs_t;
+
+typedef struct {
+  float mA[ENERGY_N_ITEMS];
+  float total_mA;
+} energy_budget_t;
+
+void energy_update(bool keep_alive_on);
+energy_inputs_t energy_inputs();
+energy_budget_t energy_estimate(const energy_inputs_t *in);
+void energy_set_battery(float mAh);
+float energy_get_battery();
+void energy_print();
@@ -30,7 +30,10 @@
 //
 
 #include "farey.h"
+#include <numeric>
+#ifdef ARDUINO
 #include <arduino.h>
+#endif
 
 
 rational_t rational_approximation(double target, uint32_t maxdenom)
@@ -69,9 +72,11 @@ rational_t rational_approximation(double target, uint32_t maxdenom)
     if(bd > maxdenom || ii > maxIter) {
       // The denominator has become too big, or too many iterations.  
     	// Select the best of a/b and c/d.
+#ifdef ARDUINO
       if(ii > maxIter) { // ###################################
         Serial.println("Hit max iterations!");
       }
+#endif
       if(target - a/(double)b < c/(double)d - target) {
         ac = a;
         bd = b;
@@ -155,6 +160,66 @@ rational_t rational_approximation(double target, uint32_t maxdenom)
 }
 
 
+// Inverse of a modulo m by the extended Euclidean algorithm, for a and m without common factors
+int64_t mod_inverse(int64_t a, int64_t m)
+{
+  int64_t r0 = m, r1 = a % m, t0 = 0, t1 = 1;
+  while(r1 != 0) {
+    int64_t q = r0 / r1;
+    int64_t r = r0 - q*r1;
+    r0 = r1;
+    r1 = r;
+    int64_t t = t0 - q*t1;
+    t0 = t1;
+    t1 = t;
+  }
+  return t0 < 0 ? t0 + m : t0;
+}
+
+
+// The two fractions around target in the Farey sequence of order maxdenom, below <= target <= above.
+// One of them is the best approximation p/q, the other one n/d is its neighbour on the other side of the
+// target, which has p*d - n*q = +-1 and the largest d up to maxdenom. If p/q is exact, both are p/q.
+void farey_neighbours(double target, uint32_t maxdenom, rational_t *below, rational_t *above)
+{
+  rational_t best = rational_approximation(target, maxdenom);
+  int64_t p = best.numerator, q = best.denominator;
+
+  *below = best;
+  *above = best;
+  if(target == p/(double)q || maxdenom < 1) {
+    return;
+  }
+  bool up = (target > p/(double)q);
+  int64_t inv = (q > 1) ? mod_inverse(p, q) : 0;
+  int64_t r = up ? (q - inv) % q : inv;  // d is r modulo q
+  int64_t d = r + ((maxdenom - r)/q)*q;
+  if(d == 0) {
+    d = q;
+  }
+  rational_t *other = up ? above : below;
+  other->numerator = up ? (p*d + 1)/q : (p*d - 1)/q;
+  other->denominator = d;
+  other->iterations = best.iterations;
+}
+
+
+// Rotation of a periodic signal with n_periods periods in n_samples samples that gives the phase closest
+// to phase_deg. Rotating by s samples advances the phase by 360*n_periods*s/n_samples degrees, so the
+// phases that can be reached are multiples of 360*gcd(n_periods, n_samples)/n_samples degrees. Returns s,
+// from 0 to n_samples - 1, and the phase that it gives in *actual_deg.
+int64_t phase_rotation(int64_t n_periods, int64_t n_samples, double phase_deg, double *actual_deg)
+{
+  int64_t g = std::gcd(n_periods, n_samples);
+  int64_t m = n_samples/g;
+  int64_t inv = mod_inverse(n_periods/g, m);
+  double turns = phase_deg/360.0;
+  int64_t steps = llround((turns - floor(turns))*m) % m;
+  *actual_deg = 360.0*steps/m;
+  return (steps*inv) % m;
+}
+
+
 typedef struct {
   double target;
   uint32_t maxdenom;
@@ -164,6 +229,7 @@ typedef struct {
 } rational_test_case_t;
 
 
+#ifdef ARDUINO
 void test_rational_approx()
 {
   rational_t result;
@@ -205,3 +271,4 @@ void test_rational_approx()
     }
   }
 }
+#endif
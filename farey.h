@@ -12,4 +12,7 @@ typedef struct {
 
 
 rational_t rational_approximation(double target, uint32_t maxdenom);
+void farey_neighbours(double target, uint32_t maxdenom, rational_t *below, rational_t *above);
+int64_t mod_inverse(int64_t a, int64_t m);
+int64_t phase_rotation(int64_t n_periods, int64_t n_samples, double phase_deg, double *actual_deg);
 void test_rational_approx();
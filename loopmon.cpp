@@ -0,0 +1,194 @@
+#include <arduino.h>
+#include "loopmon.h"
+#include "trace.h"
+#include "synth.h"
+
+
+volatile bool loopmon_on = false;
+
+static const char *section_names[LOOP_N_SECTIONS] = {"commands", "keep-alive", "button", "display", "morse", "park", "idle", "other"};
+static const uint32_t alarm_print_interval_ms = 1000;  // Do not flood the serial port with alarms
+
+static uint32_t alarm_us = 0;          // 0 for no alarm
+static bool started = false;
+static uint32_t last_begin, last_mark; // Cycle counts
+static uint32_t n_loops;
+static uint64_t total_cycles;
+static uint32_t min_cycles, max_cycles;
+static uint32_t histogram[loopmon_bins];
+static uint64_t section_total[LOOP_N_SECTIONS];
+static uint32_t section_max[LOOP_N_SECTIONS];
+static uint32_t section_now[LOOP_N_SECTIONS];  // In the current loop
+static uint32_t n_alarms;
+static uint32_t last_alarm_print_ms;
+
+
+static inline double cycles_to_us(uint64_t cycles)
+{
+  return cycles*1e6/CPU_freq_actual;
+}
+
+
+static void add_section_time(int section, uint32_t cycles)
+{
+  section_now[section] += cycles;
+  section_total[section] += cycles;
+  if(cycles > section_max[section]) {
+    section_max[section] = cycles;
+  }
+}
+
+
+// The section that took most of the time in the loop that just ended
+static int worst_section()
+{
+  int worst = 0;
+  for(int ii = 1; ii < LOOP_N_SECTIONS; ii++) {
+    if(section_now[ii] > section_now[worst]) {
+      worst = ii;
+    }
+  }
+  return worst;
+}
+
+
+void loopmon_begin_sample()
+{
+  uint32_t now = rp2040.getCycleCount();
+
+  if(started) {
+    add_section_time(LOOP_OTHER, now - last_mark);
+    uint32_t period = now - last_begin;
+    n_loops++;
+    total_cycles += period;
+    min_cycles = min(min_cycles, period);
+    max_cycles = max(max_cycles, period);
+    uint32_t period_us = cycles_to_us(period);
+    int bin = 0;
+    while(period_us > 0 && bin < loopmon_bins - 1) {
+      period_us >>= 1;
+      bin++;
+    }
+    histogram[bin]++;
+    if(alarm_us > 0 && cycles_to_us(period) > alarm_us) {
+      n_alarms++;
+      int worst = worst_section();
+      trace_event(TRACE_LOOP_ALARM, cycles_to_us(period));
+      if(millis() - last_alarm_print_ms >= alarm_print_interval_ms) {
+        last_alarm_print_ms = millis();
+        Serial.print("Loop period alarm (us): ");
+        Serial.print(cycles_to_us(period), 0);
+        Serial.print(", mostly ");
+        Serial.print(section_names[worst]);
+        Serial.print(" (");
+        Serial.print(cycles_to_us(section_now[worst]), 0);
+        Serial.println(")");
+      }
+    }
+  }
+  started = true;
+  last_begin = now;
+  last_mark = now;
+  for(int ii = 0; ii < LOOP_N_SECTIONS; ii++) {
+    section_now[ii] = 0;
+  }
+}
+
+
+void loopmon_mark_sample(int section)
+{
+  uint32_t now = rp2040.getCycleCount();
+  add_section_time(section, now - last_mark);
+  last_mark = now;
+}
+
+
+void loopmon_reset()
+{
+  started = false;
+  n_loops = 0;
+  total_cycles = 0;
+  min_cycles = 0xffffffff;
+  max_cycles = 0;
+  for(int ii = 0; ii < loopmon_bins; ii++) {
+    histogram[ii] = 0;
+  }
+  for(int ii = 0; ii < LOOP_N_SECTIONS; ii++) {
+    section_total[ii] = 0;
+    section_max[ii] = 0;
+  }
+  n_alarms = 0;
+}
+
+
+void loopmon_enable(bool on)
+{
+  if(on && !loopmon_on) {
+    loopmon_reset();
+  }
+  loopmon_on = on;
+}
+
+
+void loopmon_set_alarm(uint32_t us)
+{
+  alarm_us = us;
+}
+
+
+uint32_t loopmon_get_alarm()
+{
+  return alarm_us;
+}
+
+
+void loopmon_print()
+{
+  if(n_loops == 0) {
+    Serial.println("Loop period: no loops measured");
+    return;
+  }
+  Serial.print("Loop period (us): min ");
+  Serial.print(cycles_to_us(min_cycles), 2);
+  Serial.print(", avg ");
+  Serial.print(cycles_to_us(total_cycles)/n_loops, 2);
+  Serial.print(", max ");
+  Serial.print(cycles_to_us(max_cycles), 1);
+  Serial.print(" over ");
+  Serial.print(n_loops);
+  Serial.println(" loops");
+  Serial.print("Loop histogram (us):");
+  for(int ii = 0; ii < loopmon_bins; ii++) {
+    if(histogram[ii] == 0) {
+      continue;
+    }
+    if(ii == loopmon_bins - 1) {
+      Serial.print(" >=");
+      Serial.print(1u << (ii - 1));
+    } else {
+      Serial.print(" <");
+      Serial.print(1u << ii);
+    }
+    Serial.print(":");
+    Serial.print(histogram[ii]);
+  }
+  Serial.println();
+  for(int ii = 0; ii < LOOP_N_SECTIONS; ii++) {
+    Serial.print("  ");
+    Serial.print(section_names[ii]);
+    Serial.print(" (us): avg ");
+    Serial.print(cycles_to_us(section_total[ii])/n_loops, 2);
+    Serial.print(", max ");
+    Serial.print(cycles_to_us(section_max[ii]), 1);
+    Serial.print(", ");
+    Serial.print(100.0*section_total[ii]/total_cycles, 1);
+    Serial.println(" %");
+  }
+  if(alarm_us > 0) {
+    Serial.print("Loop alarms: ");
+    Serial.print(n_alarms);
+    Serial.print(" over ");
+    Serial.print(alarm_us);
+    Serial.println(" us");
+  }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+// Monitor of the period of the main loop, which decides how accurately the morse keying is timed.
+// Each loop runs one task of the scheduler, or sleeps until the next one is due, so the period is the
+// time between passes of the scheduler and the alarm catches the slowest single task. loopmon_begin()
+// is called at the start of each loop and loopmon_mark() at the end of the task, so that the time can
+// be attributed to the sections. When disabled, each call only tests a flag.
+
+enum loop_section_t {
+  LOOP_COMMANDS = 0,  // cmd.poll(), including the commands that it runs
+  LOOP_KEEP_ALIVE,    // Pulling power from the power bank
+  LOOP_BUTTON,
+  LOOP_DISPLAY,       // Status on the LCD
+  LOOP_MORSE,         // The morse state machine and keying
+  LOOP_PARK,          // Parking the synthesizer when the output has been silent for a while
+  LOOP_IDLE,          // Sleeping in the scheduler until the next task is due
+  LOOP_OTHER,         // Between the end of one loop and the start of the next
+  LOOP_N_SECTIONS
+};
+
+const int loopmon_bins = 16;  // Histogram bin k counts periods from 2^(k-1) up to 2^k us, the last one all longer
+
+extern volatile bool loopmon_on;
+
+void loopmon_begin_sample();
+void loopmon_mark_sample(int section);
+
+static inline void loopmon_begin()
+{
+  if(loopmon_on) {
+    loopmon_begin_sample();
+  }
+}
+
+static inline void loopmon_mark(int section)
+{
+  if(loopmon_on) {
+    loopmon_mark_sample(section);
+  }
+}
+
+void loopmon_enable(bool on);
+void loopmon_reset();
+void loopmon_set_alarm(uint32_t us);
+uint32_t loopmon_get_alarm();
+void loopmon_print();
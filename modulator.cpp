@@ -0,0 +1,162 @@
+#include "modulator.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+static const int32_t sd_one = 1 << sd_frac_bits;
+static const int32_t sd_third = sd_one/3;  // Thresholds of the trinary quantizer
+
+
+void sd_init(sd_state_t *st, bool trinary, double penalty, int n_lanes, bool zero_low)
+{
+  for(int ll = 0; ll < 4; ll++) {
+    st->delta_dly[ll] = 0;
+    st->prev[ll] = 0;
+    st->last_equal[ll] = zero_low ? 0 : -1;
+  }
+  st->penalty = sd_fixed(penalty);
+  st->trinary = trinary;
+  // Same as in the floating point modulators: with a penalty, runs of zeros do not toggle the pins
+  st->hold_zero = (penalty > 0);
+  st->zero_low = zero_low;
+  st->n_lanes = n_lanes;
+}
+
+
+// One sample of one lane. Returns the bits of the symbol at position jj.
+static inline uint32_t sd_step(sd_state_t *st, int ll, int32_t x, int32_t dither, int jj)
+{
+  int32_t acc = x + st->delta_dly[ll];
+  int32_t v = acc + dither;
+  int32_t prev = st->prev[ll];
+  int32_t p = st->penalty;
+  int out;
+  uint32_t bits;
+
+  if(!st->trinary) {
+    out = (v > (prev == -1 ? p : 0) - (prev == 1 ? p : 0)) ? 1 : -1;
+  } else {
+    int32_t upper = sd_third + (prev == 0 ? p : 0) - (prev == 1 ? p : 0);
+    int32_t lower = -sd_third + (prev == -1 ? p : 0) - (prev == 0 ? p : 0);
+    out = (v > upper) ? 1 : ((v > lower) ? 0 : -1);
+  }
+  if(out == 1) {
+    bits = 1u << (2*jj);
+  } else if(out == -1) {
+    bits = 2u << (2*jj);
+  } else {
+    if(!st->zero_low && !(st->hold_zero && prev == 0)) {
+      st->last_equal[ll] = ~st->last_equal[ll];
+    }
+    bits = st->last_equal[ll] ? 3u << (2*jj) : 0;
+  }
+  st->prev[ll] = out;
+  st->delta_dly[ll] = acc - out*sd_one;
+  return bits;
+}
+
+
+// Reference implementation, one lane at a time
+void sd_word_scalar(sd_state_t *st, const int32_t *samples, const int16_t *gain_up, const int16_t *gain_down,
+                    const int32_t *dither, uint32_t *words)
+{
+  uint32_t w[sd_max_lanes] = {0, 0, 0};
+
+  for(int jj = 0; jj < 16; jj++) {
+    w[SD_MAIN] |= sd_step(st, SD_MAIN, samples[jj], dither[jj], jj);
+    if(st->n_lanes > 1) {
+      w[SD_UP] |= sd_step(st, SD_UP, sd_scale(samples[jj], gain_up[jj]), dither[jj], jj);
+      w[SD_DOWN] |= sd_step(st, SD_DOWN, sd_scale(samples[jj], gain_down[jj]), dither[jj], jj);
+    }
+  }
+  for(int ll = 0; ll < st->n_lanes; ll++) {
+    words[ll] = w[ll];
+  }
+}
+
+
+#if defined(__SSE2__)
+// The lanes in the lanes of SSE2 registers. The quantizer and the symbol encoding are done with masks
+// instead of branches, and the symbols are ORed into the words of all lanes at once.
+void sd_word(sd_state_t *st, const int32_t *samples, const int16_t *gain_up, const int16_t *gain_down,
+             const int32_t *dither, uint32_t *words)
+{
+  const __m128i one = _mm_set1_epi32(sd_one);
+  const __m128i minus_one = _mm_set1_epi32(-sd_one);
+  const __m128i third = _mm_set1_epi32(sd_third);
+  const __m128i pen = _mm_set1_epi32(st->penalty);
+  const __m128i ones = _mm_set1_epi32(-1);
+  const __m128i level_one = _mm_set1_epi32(1);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i dly = _mm_loadu_si128((const __m128i *)st->delta_dly);
+  __m128i prev = _mm_loadu_si128((const __m128i *)st->prev);
+  __m128i last_equal = _mm_loadu_si128((const __m128i *)st->last_equal);
+  __m128i w = zero;
+  bool ramps = (st->n_lanes > 1);
+
+  for(int jj = 0; jj < 16; jj++) {
+    int32_t s = samples[jj];
+    __m128i x = _mm_setr_epi32(s, ramps ? sd_scale(s, gain_up[jj]) : 0, ramps ? sd_scale(s, gain_down[jj]) : 0, 0);
+    __m128i acc = _mm_add_epi32(x, dly);
+    __m128i v = _mm_add_epi32(acc, _mm_set1_epi32(dither[jj]));
+    __m128i prev_pos = _mm_cmpeq_epi32(prev, level_one);
+    __m128i prev_neg = _mm_cmpeq_epi32(prev, ones);
+    __m128i prev_zero = _mm_cmpeq_epi32(prev, zero);
+    __m128i bit1 = _mm_set1_epi32(1u << (2*jj));
+    __m128i bit2 = _mm_set1_epi32(2u << (2*jj));
+    __m128i pos, neg, out_zero;
+
+    if(!st->trinary) {
+      __m128i thr = _mm_sub_epi32(_mm_and_si128(prev_neg, pen), _mm_and_si128(prev_pos, pen));
+      pos = _mm_cmpgt_epi32(v, thr);
+      neg = _mm_andnot_si128(pos, ones);
+      out_zero = zero;
+    } else {
+      __m128i upper = _mm_sub_epi32(_mm_add_epi32(third, _mm_and_si128(prev_zero, pen)), _mm_and_si128(prev_pos, pen));
+      __m128i lower = _mm_sub_epi32(_mm_sub_epi32(_mm_and_si128(prev_neg, pen), third), _mm_and_si128(prev_zero, pen));
+      __m128i above_lower = _mm_cmpgt_epi32(v, lower);
+      pos = _mm_cmpgt_epi32(v, upper);
+      neg = _mm_andnot_si128(above_lower, ones);
+      out_zero = _mm_andnot_si128(pos, above_lower);
+      // A zero flips the zero symbol, unless it is held
+      __m128i hold = st->zero_low ? ones : (st->hold_zero ? _mm_and_si128(out_zero, prev_zero) : zero);
+      last_equal = _mm_xor_si128(last_equal, _mm_andnot_si128(hold, out_zero));
+      w = _mm_or_si128(w, _mm_and_si128(_mm_and_si128(out_zero, last_equal), _mm_or_si128(bit1, bit2)));
+    }
+    w = _mm_or_si128(w, _mm_or_si128(_mm_and_si128(pos, bit1), _mm_and_si128(neg, bit2)));
+    prev = _mm_sub_epi32(_mm_and_si128(pos, level_one), _mm_and_si128(neg, level_one));
+    dly = _mm_sub_epi32(acc, _mm_or_si128(_mm_and_si128(pos, one), _mm_and_si128(neg, minus_one)));
+  }
+  _mm_storeu_si128((__m128i *)st->delta_dly, dly);
+  _mm_storeu_si128((__m128i *)st->prev, prev);
+  _mm_storeu_si128((__m128i *)st->last_equal, last_equal);
+  uint32_t w4[4];
+  _mm_storeu_si128((__m128i *)w4, w);
+  for(int ll = 0; ll < st->n_lanes; ll++) {
+    words[ll] = w4[ll];
+  }
+}
+#else
+void sd_word(sd_state_t *st, const int32_t *samples, const int16_t *gain_up, const int16_t *gain_down,
+             const int32_t *dither, uint32_t *words)
+{
+  sd_word_scalar(st, samples, gain_up, gain_down, dither, words);
+}
+#endif
+
+
+// Rotate a buffer of n_words words of 16 symbols, so that symbol i of out is symbol i + shift of in
+void sd_rotate(const uint32_t *in, uint32_t *out, int n_words, int64_t shift)
+{
+  int q = (shift/16) % n_words;
+  int r = shift % 16;
+  for(int ii = 0; ii < n_words; ii++) {
+    int jj = (ii + q) % n_words;
+    if(r == 0) {
+      out[ii] = in[jj];
+    } else {
+      out[ii] = (in[jj] >> 2*r) | (in[(jj + 1) % n_words] << (32 - 2*r));
+    }
+  }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#if defined(__ARM_FEATURE_DSP)
+#include <arm_acle.h>
+#endif
+
+// Fixed point kernel for the sigma-delta modulators. The modulators of the main buffer and of the ramp-up
+// and ramp-down buffers run in lockstep: they get the same samples and dither, the ramps scaled by the taper
+// gains. sd_word() takes the lanes through the 16 samples of a word and packs the symbols into one word per
+// lane. With SSE2 (on a PC) the lanes are the lanes of vector registers. Otherwise they are run one after
+// the other with 32-bit integer operations, and the gain multiplication uses the DSP extension where there
+// is one (Cortex-M33). All variants give bit-identical results.
+
+const int sd_frac_bits = 26;  // Samples, dither and modulator states are fixed point with 26 fractional bits
+const int sd_gain_bits = 14;  // Taper gains are fixed point with 14 fractional bits, 0 to 1
+const int sd_max_lanes = 3;
+
+enum sd_lane_t {
+  SD_MAIN = 0,
+  SD_UP,
+  SD_DOWN
+};
+
+typedef struct {
+  int32_t delta_dly[4];   // Quantization error of each lane, delayed one sample. 4 to fill a vector register.
+  int32_t prev[4];        // Previous output level, -1, 0 or 1
+  int32_t last_equal[4];  // Which zero symbol was sent last, 0 for both pins low, -1 for both high
+  int32_t penalty;        // Transition penalty
+  bool trinary;
+  bool hold_zero;
+  bool zero_low;          // Every zero is sent as both pins low
+  int n_lanes;            // 1 for only the main buffer, 3 with the ramps
+} sd_state_t;
+
+static inline int32_t sd_fixed(double v)
+{
+  return (int32_t)(v*(1 << sd_frac_bits));
+}
+
+static inline int16_t sd_gain(float g)
+{
+  return (int16_t)(g*(1 << sd_gain_bits) + 0.5f);
+}
+
+// Sample x scaled by the gain g, a taper gain or a bank level
+static inline int32_t sd_scale(int32_t x, int16_t g)
+{
+#if defined(__ARM_FEATURE_DSP)
+  return __smulwb(x, g)*(1 << (16 - sd_gain_bits));
+#else
+  return (int32_t)(((int64_t)x*g) >> 16)*(1 << (16 - sd_gain_bits));
+#endif
+}
+
+void sd_init(sd_state_t *st, bool trinary, double penalty, int n_lanes, bool zero_low);
+void sd_word(sd_state_t *st, const int32_t *samples, const int16_t *gain_up, const int16_t *gain_down,
+             const int32_t *dither, uint32_t *words);
+void sd_word_scalar(sd_state_t *st, const int32_t *samples, const int16_t *gain_up, const int16_t *gain_down,
+                    const int32_t *dither, uint32_t *words);
+void sd_rotate(const uint32_t *in, uint32_t *out, int n_words, int64_t shift);
@@ -0,0 +1,179 @@
+#include <cmath>
+#include "oscillator.h"
+#if !PICO_NO_HARDWARE
+#include "hardware/interp.h"
+#endif
+
+
+// One period of a sine, plus a copy of the first entry for the interpolation
+static float sine_table[(1 << sine_table_bits) + 1];
+static bool sine_table_ready = false;
+
+static const int lane0_shift = 32 - sine_table_bits - 2;  // Byte offset of a float table entry
+static const int lane1_shift = 32 - sine_table_bits - sine_frac_bits;
+
+
+#if PICO_NO_HARDWARE
+// Emulation of the parts of an interpolator that the oscillator uses: lane 0 gives the address
+// of the table entry and lane 1 reads accumulator 0 (cross input) to give the interpolation fraction.
+typedef struct {
+  uint32_t accum0;
+  uintptr_t base0;
+  uint32_t base1;
+} interp_emul_t;
+
+static interp_emul_t interp_emul[2];
+
+static void interp_setup(int n)
+{
+  interp_emul[n].accum0 = 0;
+  interp_emul[n].base0 = (uintptr_t)sine_table;
+  interp_emul[n].base1 = 0;
+}
+
+static inline void interp_set_accum(int n, uint32_t v)
+{
+  interp_emul[n].accum0 = v;
+}
+
+static inline void interp_add_accum(int n, uint32_t v)
+{
+  interp_emul[n].accum0 += v;
+}
+
+static inline uintptr_t interp_peek_lane(int n, int lane)
+{
+  uint32_t a = interp_emul[n].accum0;
+  if(lane == 0) {
+    return interp_emul[n].base0 + ((a >> lane0_shift) & (((1u << sine_table_bits) - 1) << 2));
+  }
+  return interp_emul[n].base1 + ((a >> lane1_shift) & ((1u << sine_frac_bits) - 1));
+}
+
+static bool interp_claim(int)
+{
+  return true;
+}
+
+static void interp_release(int)
+{
+}
+
+#else
+static inline interp_hw_t *interp_hw(int n)
+{
+  return n ? interp1 : interp0;
+}
+
+static void interp_setup(int n)
+{
+  interp_hw_t *hw = interp_hw(n);
+  interp_config cfg = interp_default_config();
+  interp_config_set_shift(&cfg, lane0_shift);
+  interp_config_set_mask(&cfg, 2, sine_table_bits + 1);
+  interp_set_config(hw, 0, &cfg);
+  cfg = interp_default_config();
+  interp_config_set_cross_input(&cfg, true);
+  interp_config_set_shift(&cfg, lane1_shift);
+  interp_config_set_mask(&cfg, 0, sine_frac_bits - 1);
+  interp_set_config(hw, 1, &cfg);
+  hw->accum[0] = 0;
+  hw->base[0] = (uint32_t)(uintptr_t)sine_table;
+  hw->base[1] = 0;
+}
+
+static inline void interp_set_accum(int n, uint32_t v)
+{
+  interp_hw(n)->accum[0] = v;
+}
+
+static inline void interp_add_accum(int n, uint32_t v)
+{
+  interp_hw(n)->add_raw[0] = v;
+}
+
+static inline uintptr_t interp_peek_lane(int n, int lane)
+{
+  return interp_hw(n)->peek[lane];
+}
+
+static bool interp_claim(int n)
+{
+  interp_hw_t *hw = interp_hw(n);
+  if(interp_lane_is_claimed(hw, 0) || interp_lane_is_claimed(hw, 1)) {
+    return false;
+  }
+  interp_claim_lane(hw, 0);
+  interp_claim_lane(hw, 1);
+  return true;
+}
+
+static void interp_release(int n)
+{
+  interp_unclaim_lane(interp_hw(n), 0);
+  interp_unclaim_lane(interp_hw(n), 1);
+}
+#endif
+
+
+// Start an oscillator at phase 0. Falls back to software if the interpolator is busy.
+// Returns false if the software fallback is used although an interpolator was asked for.
+bool osc_start(oscillator_t *osc, uint32_t increment, int interp_num)
+{
+  if(!sine_table_ready) {
+    for(int ii = 0; ii <= (1 << sine_table_bits); ii++) {
+      sine_table[ii] = sin(2*M_PI*ii/(1 << sine_table_bits));
+    }
+    sine_table_ready = true;
+  }
+  osc->phase = 0;
+  osc->increment = increment;
+  osc->interp_num = -1;
+  if(interp_num < 0) {
+    return true;
+  }
+  if(!interp_claim(interp_num)) {
+    return false;
+  }
+  interp_setup(interp_num);
+  osc->interp_num = interp_num;
+  return true;
+}
+
+
+void osc_stop(oscillator_t *osc)
+{
+  if(osc->interp_num >= 0) {
+    interp_release(osc->interp_num);
+  }
+  osc->interp_num = -1;
+}
+
+
+void osc_set_phase(oscillator_t *osc, uint32_t phase)
+{
+  if(osc->interp_num < 0) {
+    osc->phase = phase;
+  } else {
+    interp_set_accum(osc->interp_num, phase);
+  }
+}
+
+
+// The sine at the current phase, then step the phase
+float osc_next(oscillator_t *osc)
+{
+  const float *p;
+  uint32_t frac;
+
+  if(osc->interp_num < 0) {
+    p = &sine_table[osc->phase >> (32 - sine_table_bits)];
+    frac = (osc->phase >> lane1_shift) & ((1u << sine_frac_bits) - 1);
+    osc->phase += osc->increment;
+  } else {
+    p = (const float *)interp_peek_lane(osc->interp_num, 0);
+    frac = interp_peek_lane(osc->interp_num, 1);
+    interp_add_accum(osc->interp_num, osc->increment);
+  }
+  return p[0] + (p[1] - p[0]) * (float)frac * (1.0f / (1 << sine_frac_bits));
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+// Sine oscillator for the sigma-delta generators: a 32-bit phase accumulator and a table with one period
+// of a sine, with linear interpolation between the entries. The table address and the interpolation
+// fraction are calculated by one of the SIO interpolators of the core, or in software, with bit-identical
+// results. Without hardware (PICO_NO_HARDWARE) the interpolators are emulated.
+
+const int sine_table_bits = 10;  // log2 of the number of table entries per period
+const int sine_frac_bits = 12;   // Resolution of the interpolation between table entries
+
+typedef struct {
+  uint32_t phase;      // Fraction of a period
+  uint32_t increment;  // Phase increment per sample
+  int interp_num;      // Interpolator doing the work, -1 for software
+} oscillator_t;
+
+bool osc_start(oscillator_t *osc, uint32_t increment, int interp_num);
+void osc_stop(oscillator_t *osc);
+void osc_set_phase(oscillator_t *osc, uint32_t phase);
+float osc_next(oscillator_t *osc);
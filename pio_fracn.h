@@ -0,0 +1,73 @@
+// Assembled by hand from pio_fracn.pio in the layout that pioasm generates. test/pio_test.cpp checks
+// that the two agree. Keep them in sync, or regenerate this file with pioasm.
+
+#pragma once
+
+#if !PICO_NO_HARDWARE
+#include "hardware/pio.h"
+#endif
+
+// --------- //
+// pio_fracn //
+// --------- //
+
+#define pio_fracn_wrap_target 0
+#define pio_fracn_wrap 15
+
+static const uint16_t pio_fracn_program_instructions[] = {
+            //     .wrap_target
+    0xe001, //  0: set    pins, 1                    
+    0x00e3, //  1: jmp    !osre, 3                   
+    0xa0e2, //  2: mov    osr, y                     
+    0x6021, //  3: out    x, 1                       
+    0x0026, //  4: jmp    !x, 6                      
+    0xa042, //  5: nop                               
+    0xa026, //  6: mov    x, isr                     
+    0x0047, //  7: jmp    x--, 7                     
+    0xe002, //  8: set    pins, 2                    
+    0x00eb, //  9: jmp    !osre, 11                  
+    0xa0e2, // 10: mov    osr, y                     
+    0x6021, // 11: out    x, 1                       
+    0x002e, // 12: jmp    !x, 14                     
+    0xa042, // 13: nop                               
+    0xa026, // 14: mov    x, isr                     
+    0x004f, // 15: jmp    x--, 15                    
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program pio_fracn_program = {
+    .instructions = pio_fracn_program_instructions,
+    .length = 16,
+    .origin = -1,
+};
+
+static inline pio_sm_config pio_fracn_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + pio_fracn_wrap_target, offset + pio_fracn_wrap);
+    return c;
+}
+
+// count is the length of a short half-period minus 6, pattern_len the number of bits in the pattern
+static inline void pio_fracn_program_init(PIO pio, uint sm, uint offset, uint first_data_pin, uint32_t count,
+                                          uint32_t pattern, uint pattern_len) {
+    pio_gpio_init(pio, first_data_pin);
+    pio_gpio_init(pio, first_data_pin+1);
+    pio_sm_set_consecutive_pindirs(pio, sm, first_data_pin, 2, true);
+    pio_sm_config c = pio_fracn_program_get_default_config(offset);
+    sm_config_set_set_pins(&c, first_data_pin, 2); // Pins affected by set
+    sm_config_set_clkdiv(&c, 1.0);
+    sm_config_set_out_shift(&c, true, false, pattern_len);
+    pio_sm_init(pio, sm, offset, &c);
+    // Load the ISR and Y through the FIFO, and empty the OSR so that the pattern is loaded first thing
+    pio_sm_put(pio, sm, count);
+    pio_sm_exec(pio, sm, pio_encode_pull(false, true));
+    pio_sm_exec(pio, sm, pio_encode_mov(pio_isr, pio_osr));
+    pio_sm_put(pio, sm, pattern);
+    pio_sm_exec(pio, sm, pio_encode_pull(false, true));
+    pio_sm_exec(pio, sm, pio_encode_mov(pio_y, pio_osr));
+    pio_sm_exec(pio, sm, pio_encode_out(pio_null, 32));
+    pio_sm_set_enabled(pio, sm, true);
+}
+
+#endif
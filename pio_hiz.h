@@ -0,0 +1,90 @@
+// Assembled by hand from pio_hiz.pio in the layout that pioasm generates. test/pio_test.cpp checks
+// that the two agree. Keep them in sync, or regenerate this file with pioasm.
+
+#pragma once
+
+#if !PICO_NO_HARDWARE
+#include "hardware/pio.h"
+#endif
+
+// ------------ //
+// pio_hiz_dirs //
+// ------------ //
+
+#define pio_hiz_dirs_wrap_target 0
+#define pio_hiz_dirs_wrap 3
+
+static const uint16_t pio_hiz_dirs_program_instructions[] = {
+            //     .wrap_target
+    0x60a2, //  0: out    pc, 2           side 0     
+    0x78a2, //  1: out    pc, 2           side 3     
+    0x78a2, //  2: out    pc, 2           side 3     
+    0x60a2, //  3: out    pc, 2           side 0     
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program pio_hiz_dirs_program = {
+    .instructions = pio_hiz_dirs_program_instructions,
+    .length = 4,
+    .origin = 0,
+};
+
+static inline pio_sm_config pio_hiz_dirs_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + pio_hiz_dirs_wrap_target, offset + pio_hiz_dirs_wrap);
+    sm_config_set_sideset(&c, 2, false, true);
+    return c;
+}
+#endif
+
+// ------------ //
+// pio_hiz_pins //
+// ------------ //
+
+#define pio_hiz_pins_wrap_target 1
+#define pio_hiz_pins_wrap 1
+
+static const uint16_t pio_hiz_pins_program_instructions[] = {
+    0xa042, //  0: nop                               
+            //     .wrap_target
+    0x6002, //  1: out    pins, 2                    
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program pio_hiz_pins_program = {
+    .instructions = pio_hiz_pins_program_instructions,
+    .length = 2,
+    .origin = -1,
+};
+
+static inline pio_sm_config pio_hiz_pins_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + pio_hiz_pins_wrap_target, offset + pio_hiz_pins_wrap);
+    return c;
+}
+
+static inline void pio_hiz_dirs_program_init(PIO pio, uint sm, uint offset, uint first_data_pin) {
+    pio_sm_config c = pio_hiz_dirs_program_get_default_config(offset);
+    sm_config_set_sideset_pins(&c, first_data_pin); // Pins affected by side-set
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+    sm_config_set_clkdiv(&c, 1.0);
+    sm_config_set_out_shift(&c, true, true, 32);
+    pio_sm_init(pio, sm, offset, &c);
+}
+
+// The SM is left disabled, to be started together with the pio_hiz_dirs SM
+static inline void pio_hiz_pins_program_init(PIO pio, uint sm, uint offset, uint first_data_pin) {
+    pio_gpio_init(pio, first_data_pin);
+    pio_gpio_init(pio, first_data_pin+1);
+    pio_sm_set_consecutive_pindirs(pio, sm, first_data_pin, 2, true);
+    pio_sm_config c = pio_hiz_pins_program_get_default_config(offset);
+    sm_config_set_out_pins(&c, first_data_pin, 2); // Pins affected by out
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+    sm_config_set_clkdiv(&c, 1.0);
+    sm_config_set_out_shift(&c, true, true, 32);
+    pio_sm_init(pio, sm, offset, &c);
+}
+
+#endif
@@ -0,0 +1,51 @@
+// Assembled by hand from pio_rle.pio in the layout that pioasm generates. test/pio_test.cpp checks
+// that the two agree. Keep them in sync, or regenerate this file with pioasm.
+
+#pragma once
+
+#if !PICO_NO_HARDWARE
+#include "hardware/pio.h"
+#endif
+
+// ------- //
+// pio_rle //
+// ------- //
+
+#define pio_rle_wrap_target 0
+#define pio_rle_wrap 2
+
+static const uint16_t pio_rle_program_instructions[] = {
+            //     .wrap_target
+    0x6002, //  0: out    pins, 2                    
+    0x602e, //  1: out    x, 14                      
+    0x0042, //  2: jmp    x--, 2                     
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program pio_rle_program = {
+    .instructions = pio_rle_program_instructions,
+    .length = 3,
+    .origin = -1,
+};
+
+static inline pio_sm_config pio_rle_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + pio_rle_wrap_target, offset + pio_rle_wrap);
+    return c;
+}
+
+static inline void pio_rle_program_init(PIO pio, uint sm, uint offset, uint first_data_pin, float clk_div) {
+    pio_gpio_init(pio, first_data_pin);
+    pio_gpio_init(pio, first_data_pin+1);
+    pio_sm_set_consecutive_pindirs(pio, sm, first_data_pin, 2, true);
+    pio_sm_config c = pio_rle_program_get_default_config(offset);
+    sm_config_set_out_pins(&c, first_data_pin, 2); // Pins affected by out
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+    sm_config_set_clkdiv(&c, clk_div);
+    sm_config_set_out_shift(&c, true, true, 32);
+    pio_sm_init(pio, sm, offset, &c);
+    pio_sm_set_enabled(pio, sm, true);
+}
+
+#endif
@@ -0,0 +1,214 @@
+#include <cstring>
+#include "scheduler.h"
+
+
+typedef struct {
+  const char *name;
+  sched_task_fn_t fn;
+  uint32_t period_us;    // 0 for a one-shot task
+  uint32_t deadline_us;  // From the release
+  int priority;          // Higher runs first
+  bool armed;
+  uint32_t release;      // When the task is due next
+  // Statistics
+  uint32_t runs;
+  uint32_t missed;       // Finished after the deadline
+  uint32_t skipped;      // Releases dropped because the task was more than a period late
+  uint64_t total_us;
+  uint32_t max_us;
+  uint32_t max_late_us;  // From the release to the start
+} sched_task_t;
+
+static sched_task_t tasks[sched_max_tasks];
+static int n_tasks = 0;
+
+static sched_clock_fn_t clock_fn = NULL;
+static sched_sleep_fn_t sleep_fn = NULL;
+static uint32_t max_sleep_us = 1000;   // Bounds the sleep in case a task is armed from an interrupt
+static uint32_t stats_start;
+static uint64_t sleep_total_us;
+
+
+// Times wrap around, so compare them by the sign of the difference
+static inline bool before(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+
+
+// Add a task and return its number, or -1 if the table is full. A periodic task is released at once,
+// a one-shot task when armed. A deadline of 0 means the period (or no deadline for a one-shot task).
+int sched_add(const char *name, sched_task_fn_t fn, uint32_t period_us, uint32_t deadline_us, int priority)
+{
+  if(n_tasks >= sched_max_tasks) {
+    return -1;
+  }
+  sched_task_t *t = &tasks[n_tasks];
+  memset(t, 0, sizeof(*t));
+  t->name = name;
+  t->fn = fn;
+  t->period_us = period_us;
+  t->deadline_us = deadline_us ? deadline_us : period_us;
+  t->priority = priority;
+  t->armed = (period_us != 0);
+  t->release = clock_fn();
+  return n_tasks++;
+}
+
+
+// Release a task delay_us from now. A periodic task continues with its period from there.
+void sched_at(int task, uint32_t delay_us)
+{
+  if(task < 0 || task >= n_tasks) {
+    return;
+  }
+  tasks[task].release = clock_fn() + delay_us;
+  tasks[task].armed = true;
+}
+
+
+void sched_cancel(int task)
+{
+  if(task < 0 || task >= n_tasks) {
+    return;
+  }
+  tasks[task].armed = false;
+}
+
+
+// Remove all the tasks
+void sched_clear()
+{
+  n_tasks = 0;
+}
+
+
+static void run_task(sched_task_t *t, uint32_t now)
+{
+  uint32_t release = t->release;
+
+  if(t->period_us == 0) {
+    t->armed = false;
+  } else {
+    t->release += t->period_us;
+    if(before(t->release, now)) {
+      // More than a period late, drop the releases that were missed instead of running them back to back
+      uint32_t n = (now - t->release)/t->period_us + 1;
+      t->skipped += n;
+      t->release += n*t->period_us;
+    }
+  }
+  t->fn();
+  uint32_t end = clock_fn();
+  uint32_t run_us = end - now;
+  t->runs++;
+  t->total_us += run_us;
+  if(run_us > t->max_us) {
+    t->max_us = run_us;
+  }
+  if(now - release > t->max_late_us) {
+    t->max_late_us = now - release;
+  }
+  if(t->deadline_us && before(release + t->deadline_us, end)) {
+    t->missed++;
+  }
+}
+
+
+// Run the most urgent task that is due and return its number. If none is due, sleep until the next
+// release (at most the max sleep time) and return -1.
+int sched_run()
+{
+  uint32_t now = clock_fn();
+  sched_task_t *best = NULL;
+  uint32_t next = now + max_sleep_us;
+
+  for(int ii = 0; ii < n_tasks; ii++) {
+    sched_task_t *t = &tasks[ii];
+    if(!t->armed) {
+      continue;
+    }
+    if(before(now, t->release)) {
+      if(before(t->release, next)) {
+        next = t->release;
+      }
+      continue;
+    }
+    if(!best || t->priority > best->priority ||
+       (t->priority == best->priority && before(t->release + t->deadline_us, best->release + best->deadline_us))) {
+      best = t;
+    }
+  }
+  if(best) {
+    run_task(best, now);
+    return best - tasks;
+  }
+  sleep_fn(next - now);
+  sleep_total_us += next - now;
+  return -1;
+}
+
+
+// Set the clock and the sleep, before adding the tasks. Restarts the periodic tasks and the statistics.
+void sched_set_clock(sched_clock_fn_t clock, sched_sleep_fn_t sleep)
+{
+  clock_fn = clock;
+  sleep_fn = sleep;
+  uint32_t now = clock_fn();
+  for(int ii = 0; ii < n_tasks; ii++) {
+    if(tasks[ii].period_us) {
+      tasks[ii].release = now;
+    }
+  }
+  sched_reset_stats();
+}
+
+
+void sched_set_max_sleep(uint32_t us)
+{
+  max_sleep_us = us;
+}
+
+
+void sched_reset_stats()
+{
+  for(int ii = 0; ii < n_tasks; ii++) {
+    sched_task_t *t = &tasks[ii];
+    t->runs = 0;
+    t->missed = 0;
+    t->skipped = 0;
+    t->total_us = 0;
+    t->max_us = 0;
+    t->max_late_us = 0;
+  }
+  sleep_total_us = 0;
+  stats_start = clock_fn();
+}
+
+
+// Statistics of a task since the last reset, false if there is no such task
+bool sched_get_stats(int task, sched_stats_t *st)
+{
+  if(task < 0 || task >= n_tasks) {
+    return false;
+  }
+  sched_task_t *t = &tasks[task];
+  st->name = t->name;
+  st->priority = t->priority;
+  st->period_us = t->period_us;
+  st->runs = t->runs;
+  st->missed = t->missed;
+  st->skipped = t->skipped;
+  st->total_us = t->total_us;
+  st->max_us = t->max_us;
+  st->max_late_us = t->max_late_us;
+  return true;
+}
+
+
+// Time since the last reset of the statistics, and how much of it was spent sleeping
+uint32_t sched_get_elapsed(uint64_t *sleep_us)
+{
+  *sleep_us = sleep_total_us;
+  return clock_fn() - stats_start;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+// Cooperative scheduler for the main loop. Tasks are functions that return quickly. A periodic task
+// is released every period and should finish within its deadline from the release. A one-shot task
+// (period 0) runs once when armed with sched_at(). Of the tasks that have been released, the one with
+// the highest priority runs first, and of those with the same priority the one with the earliest
+// deadline. When no task is due, sched_run() sleeps until the next release.
+// The clock and the sleep are set by the caller, so that a virtual clock can be used when testing on a
+// PC (test/sched_test.cpp). The statistics are printed by the command handler.
+
+const int sched_max_tasks = 12;
+
+typedef void (*sched_task_fn_t)();
+typedef uint32_t (*sched_clock_fn_t)();            // Microseconds, wraps around
+typedef void (*sched_sleep_fn_t)(uint32_t us);
+
+typedef struct {
+  const char *name;
+  int priority;
+  uint32_t period_us;
+  uint32_t runs;
+  uint32_t missed;       // Finished after the deadline
+  uint32_t skipped;      // Releases dropped because the task was more than a period late
+  uint64_t total_us;
+  uint32_t max_us;
+  uint32_t max_late_us;  // From the release to the start
+} sched_stats_t;
+
+int sched_add(const char *name, sched_task_fn_t fn, uint32_t period_us, uint32_t deadline_us, int priority);
+void sched_at(int task, uint32_t delay_us);
+void sched_cancel(int task);
+void sched_clear();
+int sched_run();
+void sched_set_clock(sched_clock_fn_t clock, sched_sleep_fn_t sleep);
+void sched_set_max_sleep(uint32_t us);
+void sched_reset_stats();
+bool sched_get_stats(int task, sched_stats_t *st);
+uint32_t sched_get_elapsed(uint64_t *sleep_us);
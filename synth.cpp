@@ -1,8 +1,15 @@
 #include <arduino.h>
 #include <cstdlib>
+#include <new>
+#include "hardware/clocks.h"
 #include "synth.h"
+#include "oscillator.h"
 #include "toggle.h"
+#include "pio_rle.h"
+#include "pio_fracn.h"
+#include "pio_hiz.h"
 #include "commands.h"
+#include "trace.h"
 
 double CPU_freq_actual = 200e6;
 
@@ -21,6 +28,132 @@ static uint32_t *synth_buffer_ramp_down_ptr[1];
 static uint32_t *synth_buffer_silent_ptr[1];
 static bool enable_transmit = false;
 
+// Compressed main buffer, played by DMA control blocks
+static dma_block_t *compressed_blocks = NULL;   // Allocated when first used
+static dma_block_t compressed_silent_blocks[2];
+static dma_block_t * volatile compressed_next_seq; // The sequence of blocks to play after the current one
+static bool compressed_active = false;
+static const uint32_t zero_word = 0;
+static bool rle_active = false;        // The buffers are run-length encoded, the ramp buffers hold them
+
+// High impedance zeros, the pin directions set by a second SM that plays the same buffers as the main one
+static bool hiz_active = false;
+static uint32_t hiz_sm;
+static uint32_t hiz_synth_dma;
+static uint32_t hiz_restart_dma;
+
+// Checking of the played buffers with the CRC calculated by the DMA sniffer.
+// After each pass through a buffer the capture DMA copies the CRC to crc_captured and the seed DMA
+// restarts the sniffer, before the restart DMA starts the next pass.
+enum {CRC_SILENT = 0, CRC_RAMP_UP, CRC_MAIN, CRC_RAMP_DOWN, CRC_NONE};
+static uint32_t capture_dma = 999999;
+static uint32_t seed_dma = 999999;
+static const uint32_t crc_seed = 0xffffffff;
+static uint32_t crc_expected[CRC_NONE];
+static volatile uint32_t crc_captured;
+static bool crc_active = false;
+static int sniffer_ok = -1;             // -1 - not tested yet, 0 - does not match sniff_crc32(), 1 - OK
+static int crc_queued = CRC_NONE;       // Buffer that the restart DMA will start next
+static int crc_started = CRC_NONE;      // Buffer being played
+static bool silent_queued = false;      // The restart DMA will start a pass through the silent buffer next
+static volatile bool silent_playing = false; // A pass through the silent buffer is being played, for park_poll()
+static volatile uint32_t crc_checks = 0;
+static volatile uint32_t crc_errors = 0;
+
+// Buffer selection of the interrupt handler, and the delay from each key-down to the start of the
+// ramp-up, measured by the interrupt handler whether the outputs were parked or not
+static int dma_state = 0;              // 0 - silent, 1 - transmitting
+static volatile bool key_edge_pending = false;
+static volatile uint32_t key_edge_at;  // time_us_32() of the key-down
+static volatile uint32_t key_edges = 0;
+static volatile uint64_t key_edge_total_us = 0;
+static volatile uint32_t key_edge_max_us = 0;
+
+// Background refresh of the dither in the main buffer, done by core 1 one segment at a time.
+// The modulator state at the segment boundaries is kept so that each new segment continues from
+// the previous one and ends as close as possible to the state that the next (old) segment started from.
+static const int refresh_segment_words = 256;
+static const int max_refresh_segments = (max_words + refresh_segment_words - 1)/refresh_segment_words;
+static bool refresh_active = false;
+static volatile bool refresh_hold = false;     // Set by core 0 while the buffers are recalculated
+static volatile bool refresh_in_step = false;  // Core 1 is working on a segment
+static volatile bool refresh_restart = true;   // The boundary states must be found again
+static uint32_t refresh_words[refresh_segment_words];
+static double refresh_seg_state[max_refresh_segments]; // Modulator state at the start of each segment
+static int refresh_seg;                        // Next segment to refresh
+static double refresh_state;                   // Modulator state at the end of the last refreshed segment
+static int refresh_last_equal;
+static int refresh_last_out;
+static uint32_t refresh_rng = 1;
+
+// Dither shaping filter, y = gain*(u + b1*u1 + b2*u2) - a1*y1 - a2*y2 on the uniform dither u.
+// One for the buffer calculation on core 0 and one for the refresh on core 1.
+typedef struct {
+  int shape;
+  double gain, b1, b2, a1, a2;
+  double u1, u2, y1, y2;
+} dither_filter_t;
+
+static const double dither_notch_radius = 0.9;  // Pole radius of the band-stop, the stop band is about 1-r rad/sample wide
+static dither_filter_t main_dither = {DITHER_WHITE};
+static dither_filter_t refresh_dither_filter = {DITHER_WHITE};
+static volatile uint32_t refresh_words_done = 0;
+static volatile uint32_t refresh_busy_us = 0;
+static volatile uint32_t refresh_start_us = 0;
+
+// Extra outputs, each played by its own SM and pair of DMAs from a copy of the main buffer rotated
+// by a number of samples. All passes have the same length, so the outputs stay locked to the main one.
+static int n_extra_active = 0;
+static uint32_t extra_synth_dma[max_extra_outputs];
+static uint32_t extra_restart_dma[max_extra_outputs];
+static uint32_t *extra_buffer[max_extra_outputs];     // Allocated when first used
+static uint32_t *extra_buffer_ptr[max_extra_outputs][1];
+
+// The restart DMAs of the extra outputs read the buffer of each pass from a ring of two slots. The interrupt
+// handler fills the slot of the pass after the one that has just started on the main output, while a restart
+// DMA that is a few words behind has yet to read the slot of the current pass, so the handler never waits.
+static uint32_t *extra_ring[max_extra_outputs][2] __attribute__((aligned(8)));
+static uint32_t *hiz_ring[2] __attribute__((aligned(8)));  // The same for the restart DMA of the hiz directions SM
+static int secondary_slot;  // Slot of the next pass
+
+// Amplitude bank. Each level has its own main buffer, followed by its ramps in modes 4 and 5. When the
+// interrupt handler queues the ramp-up or the main buffer, it points the pointer that the restart DMA reads
+// to the buffer of the requested level. The ramp-down stays at the level of the main pass before it.
+static int n_bank_active = 0;
+static uint32_t *bank_buffer[max_bank_levels];        // Allocated when first used
+static int bank_alloc_words[max_bank_levels];
+static uint32_t *level_buffers[max_bank_levels + 1][CRC_NONE] = {
+  {synth_buffer_silent, synth_buffer_ramp_up, synth_buffer, synth_buffer_ramp_down}  // The main amplitude
+};
+static uint32_t bank_crc[max_bank_levels + 1][CRC_NONE];
+static uint32_t **const buffer_ptrs[CRC_NONE] = {synth_buffer_silent_ptr, synth_buffer_ramp_up_ptr,
+                                                 synth_buffer_ptr, synth_buffer_ramp_down_ptr};
+static volatile int level_requested = 0;
+static int level_playing = 0;          // Level of the last queued ramp-up or main pass
+static int level_queued = 0;           // Level of the queued pass and of the one being played, for the CRC
+static int level_started = 0;
+
+// Fine tuning. The main buffer holds the plan just below the frequency, n_periods in n_words, and
+// fine_buffer the one just above it, the neighbours in the Farey sequence (farey_neighbours()), so a pass
+// drifts less than a cycle in n_words from the ideal phase. When the interrupt handler queues a main pass, it
+// takes the upper plan if a phase accumulator incremented by fine_step overflows, which keeps the phase within
+// a pass of the ideal one and makes the average frequency exact to 2^-32 of the drift per pass. Both plans
+// hold a whole number of periods, so the phase is continuous when they are switched. The plans have different
+// lengths, so the restart DMA writes the transfer count as well as the read address, from fine_desc.
+typedef struct {
+  uint32_t transfer_count;
+  const volatile void *read_addr;
+} fine_pass_t;
+
+static bool fine_active = false;
+static uint32_t *fine_buffer = NULL;  // Allocated when first used
+static uint32_t fine_step;
+static uint32_t fine_acc;
+static uint32_t fine_crc;
+static bool fine_queued = false;      // The queued main pass, and the one being played, are from the upper plan
+static bool fine_started = false;
+static fine_pass_t fine_desc[CRC_NONE + 1];  // The buffers of the lower plan, then the upper main buffer
+
 
 void synth::fill_synth_buffer_silent()
 {
@@ -34,38 +167,658 @@ void synth::fill_synth_buffer_silent()
 }
 
 
-// Windowing function that takes a number between 0 and n_max and returns a smooth (raised cosine) taper
-// value based on it. If falling is true, the taper goes from 1 to 0, otherwise from 0 to 1.
+static float taper_table[taper_table_len+1];
+static float user_taper_points[max_user_taper_points] = {0, 1};  // A straight line until set
+static int n_user_taper_points = 2;
+
+
+// Fill 'table' (taper_table_len+1 entries) with the rising edge of the keying envelope of the given shape.
+// The table goes from 0 to 1 and is read by taper(), so the shape can be changed without making the
+// modulator loops any slower.
+void fill_taper_table(int shape, float *table)
+{
+  const double erf_k = 4.0; // Steepness of the error function taper, erf(+-2) = +-0.995
+  double x, k;
+
+  if(shape == TAPER_USER && n_user_taper_points < 2) {
+    shape = TAPER_RAISED_COSINE;
+  }
+  for(int ii = 0; ii <= taper_table_len; ii++) {
+    x = ii/(double)taper_table_len;
+    switch(shape) {
+      case TAPER_BLACKMAN_HARRIS:
+        // Integral of a 4-term Blackman-Harris window spanning the whole ramp
+        k = 0.35875*x - 0.48829*sin(2*M_PI*x)/(2*M_PI) + 0.14128*sin(4*M_PI*x)/(4*M_PI) 
+            - 0.01168*sin(6*M_PI*x)/(6*M_PI);
+        k = k/0.35875;
+        break;
+      case TAPER_ERF:
+        k = 0.5*(1.0 + erf(erf_k*(x - 0.5))/erf(erf_k*0.5));
+        break;
+      case TAPER_HANN_SQUARED:
+        k = 0.5*(1.0 - cos(x * M_PI));
+        k = k*k;
+        break;
+      case TAPER_USER: {
+        // Linear interpolation between evenly spaced points
+        double pos = x*(n_user_taper_points - 1);
+        int n = floor(pos);
+        if(n >= n_user_taper_points - 1) {
+          k = user_taper_points[n_user_taper_points - 1];
+        } else {
+          k = user_taper_points[n] + (pos - n)*(user_taper_points[n+1] - user_taper_points[n]);
+        }
+        break;
+      }
+      default:
+        k = 0.5*(1.0 - cos(x * M_PI));
+        break;
+    }
+    table[ii] = k;
+  }
+}
+
+
+const char *taper_shape_str(int shape)
+{
+  switch(shape) {
+    case TAPER_RAISED_COSINE:
+      return "Raised cosine";
+    case TAPER_BLACKMAN_HARRIS:
+      return "Blackman-Harris";
+    case TAPER_ERF:
+      return "Error function";
+    case TAPER_HANN_SQUARED:
+      return "Hann squared";
+    case TAPER_USER:
+      return "User defined";
+    default:
+      return "???";
+  }
+}
+
+
+// Windowing function that takes a number between 0 and n_max and returns a smooth taper value
+// based on it, read from the precomputed taper table. If falling is true, the taper goes from 1 to 0, 
+// otherwise from 0 to 1.
 double taper(int n, int n_max, bool falling)
 {
-  double k, nf;
+  float x, frac;
+  int idx;
 
-  nf = (double)n/(double)n_max;
+  x = (float)n*taper_table_len/(float)n_max;
   if(falling) {
-    nf = 1.0 - nf;
+    x = taper_table_len - x;
+  }
+  idx = (int)x;
+  if(idx >= taper_table_len) {
+    return taper_table[taper_table_len];
+  }
+  if(idx < 0) {
+    return taper_table[0];
+  }
+  frac = x - idx;
+  return taper_table[idx] + frac*(taper_table[idx+1] - taper_table[idx]);
+}
+
+
+void synth::set_taper_shape(int s)
+{
+  if(s >= 0 && s < TAPER_N_SHAPES) {
+    taper_shape = s;
+    fill_taper_table(taper_shape, taper_table);
+    dirty |= DIRTY_RAMPS;
+  } else {
+    Serial.println("Attempted to set invalid taper shape");
+  }
+}
+
+
+// Set the points of the user defined taper shape, evenly spaced from the start to the end of the ramp.
+// The points must be from 0 to 1, the first one 0 and the last one 1, so that the ramps start from
+// silence and reach the full amplitude. Returns false if the number of points or a point is invalid.
+bool synth::set_user_taper(const float *points, int n_points)
+{
+  if(n_points < 2 || n_points > max_user_taper_points) {
+    return false;
+  }
+  for(int ii = 0; ii < n_points; ii++) {
+    if(!(points[ii] >= 0 && points[ii] <= 1)) {
+      return false;
+    }
+  }
+  if(points[0] != 0 || points[n_points - 1] != 1) {
+    return false;
+  }
+  for(int ii = 0; ii < n_points; ii++) {
+    user_taper_points[ii] = points[ii];
+  }
+  n_user_taper_points = n_points;
+  set_taper_shape(TAPER_USER);
+  return true;
+}
+
+
+const char *sine_method_str(int method)
+{
+  switch(method) {
+    case SINE_EXACT:
+      return "Exact";
+    case SINE_TABLE:
+      return "Table";
+    case SINE_INTERP:
+      return "Table, interpolator";
+    default:
+      return "???";
+  }
+}
+
+
+const char *sd_kernel_str(int kernel)
+{
+  switch(kernel) {
+    case SD_KERNEL_DOUBLE:
+      return "Double";
+    case SD_KERNEL_FIXED:
+      return "Fixed point lanes";
+    default:
+      return "???";
+  }
+}
+
+
+const char *zero_mode_str(int zero)
+{
+  switch(zero) {
+    case ZERO_TOGGLE:
+      return "Toggle";
+    case ZERO_LOW:
+      return "Low";
+    case ZERO_HIZ:
+      return "High impedance";
+    default:
+      return "???";
+  }
+}
+
+
+const char *dither_shape_str(int shape)
+{
+  switch(shape) {
+    case DITHER_WHITE:
+      return "White";
+    case DITHER_HP1:
+      return "High-pass, 1st order";
+    case DITHER_HP2:
+      return "High-pass, 2nd order";
+    case DITHER_NOTCH:
+      return "Band-stop at the carrier";
+    default:
+      return "???";
+  }
+}
+
+
+// Set up the shaping filter for the carrier at w0 rad/sample. The gain is set from the energy of the
+// impulse response, so that the shaped dither has the same RMS as the white dither.
+static void dither_filter_init(dither_filter_t *f, int shape, double w0)
+{
+  f->shape = shape;
+  f->b1 = f->b2 = f->a1 = f->a2 = 0;
+  f->u1 = f->u2 = f->y1 = f->y2 = 0;
+  switch(shape) {
+    case DITHER_HP1:
+      f->b1 = -1;
+      break;
+    case DITHER_HP2:
+      f->b1 = -2;
+      f->b2 = 1;
+      break;
+    case DITHER_NOTCH:
+      // Zeros on the unit circle at the carrier, poles just inside them
+      f->b1 = -2*cos(w0);
+      f->b2 = 1;
+      f->a1 = -2*dither_notch_radius*cos(w0);
+      f->a2 = dither_notch_radius*dither_notch_radius;
+      break;
+    default:
+      f->shape = DITHER_WHITE;
+      return;
+  }
+  double energy = 0, y1 = 0, y2 = 0;
+  for(int ii = 0; ii < 1000; ii++) {
+    double y = (ii == 0 ? 1 : 0) + (ii == 1 ? f->b1 : 0) + (ii == 2 ? f->b2 : 0) - f->a1*y1 - f->a2*y2;
+    energy += y*y;
+    y2 = y1;
+    y1 = y;
+  }
+  f->gain = 1/sqrt(energy);
+}
+
+
+static inline double dither_filter_next(dither_filter_t *f, double u)
+{
+  if(f->shape == DITHER_WHITE) {
+    return u;
+  }
+  double y = f->gain*(u + f->b1*f->u1 + f->b2*f->u2) - f->a1*f->y1 - f->a2*f->y2;
+  f->u2 = f->u1;
+  f->u1 = u;
+  f->y2 = f->y1;
+  f->y1 = y;
+  return y;
+}
+
+
+const char *calc_stage_str(int stage)
+{
+  switch(stage) {
+    case STAGE_PLAN:
+      return "plan";
+    case STAGE_SILENT:
+      return "silent";
+    case STAGE_MAIN:
+      return "main";
+    case STAGE_RAMPS:
+      return "ramps";
+    case STAGE_CRC:
+      return "crc";
+    case STAGE_EXTRA:
+      return "extra";
+    default:
+      return "???";
+  }
+}
+
+
+// Prepare the sine oscillators for the fundamental and the third harmonic, using interpolator 0 and 1
+void synth::start_oscillators()
+{
+  if(sine_method == SINE_EXACT) {
+    return;
+  }
+  uint32_t increment = llround(4294967296.0 * n_periods / (n_words * 16.0));
+  bool use_interp = (sine_method == SINE_INTERP);
+  bool ok = osc_start(&osc_fund, increment, use_interp ? 0 : -1);
+  ok = osc_start(&osc_hd3, 3*increment, use_interp ? 1 : -1) && ok;
+  if(!ok) {
+    Serial.println("Interpolator busy, using software table lookup");
+  }
+  // The two interpolators are taken, so the tones use the software lookup
+  for(int kk = 0; tones_active() && kk < n_tones; kk++) {
+    osc_start(&osc_tone[kk], llround(4294967296.0 * tone_periods[kk] / (n_words * 16.0)), -1);
+  }
+}
+
+
+// Restart the dither shaping filter for the carrier of the buffers being calculated
+void synth::start_dither()
+{
+  dither_filter_init(&main_dither, dither_shape, 2*M_PI*n_periods/(n_words*16.0));
+}
+
+
+void synth::stop_oscillators()
+{
+  if(sine_method == SINE_EXACT) {
+    return;
+  }
+  osc_stop(&osc_fund);
+  osc_stop(&osc_hd3);
+  for(int kk = 0; tones_active() && kk < n_tones; kk++) {
+    osc_stop(&osc_tone[kk]);
+  }
+}
+
+
+// The 16 samples of the signal (fundamental and third harmonic) in word ii, for the sigma-delta generators.
+// With the table methods they come from the oscillators fund and hd3.
+void synth::word_samples(int ii, oscillator_t *fund, oscillator_t *hd3, double *samples)
+{
+  double epsilon = 1e-5; // To get a little bit away from the zero crossings
+
+  if(sine_method == SINE_EXACT) {
+    double phase_increment = 2 * M_PI * n_periods / ((double)n_words * 16.0);
+    for(int jj=0; jj < 16; jj++) {
+      double phase = (ii*16 + jj)*phase_increment + epsilon;
+      samples[jj] = amplitude * sin(phase) + hd3_amplitude*sin(3*phase + hd3_phase_rad);
+    }
+  } else {
+    table_word_samples(ii, fund, hd3, samples);
+  }
+  if(tones_active()) {
+    add_tone_samples(ii, samples);
+  }
+}
+
+
+// Add the tones to the 16 samples of word ii. Each tone has its own phase accumulator, set to the exact
+// phase at the start of every word like the fundamental.
+void synth::add_tone_samples(int ii, double *samples)
+{
+  for(int kk = 0; kk < n_tones; kk++) {
+    uint32_t p = tone_periods[kk];
+    if(sine_method == SINE_EXACT) {
+      for(int jj = 0; jj < 16; jj++) {
+        double phase = 2*M_PI*fmod((double)p*(ii*16 + jj), n_words*16.0)/(n_words*16.0);
+        samples[jj] += tone_amplitude[kk]*sin(phase + tone_phase_rad[kk]);
+      }
+    } else {
+      uint32_t phase = ((((uint64_t)ii*p) % n_words) << 32)/n_words;
+      osc_set_phase(&osc_tone[kk], phase + (uint32_t)llround(tone_phase_rad[kk]/(2*M_PI) * 4294967296.0));
+      for(int jj = 0; jj < 16; jj++) {
+        samples[jj] += tone_amplitude[kk]*osc_next(&osc_tone[kk]);
+      }
+    }
+  }
+}
+
+
+// The 16 samples of word ii from the sine oscillators fund and hd3
+void synth::table_word_samples(int ii, oscillator_t *fund, oscillator_t *hd3, double *samples)
+{
+  double epsilon = 1e-5; // To get a little bit away from the zero crossings
+
+  // Exact phase at the start of the word, so that the rounding of the phase increment does not add up
+  uint32_t phase = ((((uint64_t)ii*n_periods) % n_words) << 32)/n_words;
+  phase += (uint32_t)llround(epsilon/(2*M_PI) * 4294967296.0);
+  osc_set_phase(fund, phase);
+  osc_set_phase(hd3, 3*phase + (uint32_t)llround(hd3_phase_rad/(2*M_PI) * 4294967296.0));
+  for(int jj=0; jj < 16; jj++) {
+    samples[jj] = amplitude * osc_next(fund) + hd3_amplitude * osc_next(hd3);
+  }
+}
+
+
+// Output level of symbol jj in a word, -1, 0 or 1
+static inline int symbol_value(uint32_t word, int jj)
+{
+  uint32_t bits = (word >> (2*jj)) & 3;
+  return (bits == 1) ? 1 : ((bits == 2) ? -1 : 0);
+}
+
+
+// Quantizer of the sigma-delta modulators, binary (-1, 1) or trinary (-1, 0, 1).
+// With a transition penalty the thresholds move away from the previous output, so that it is kept
+// more often. This costs some extra quantization noise, which the noise shaping moves out of band.
+static inline int quantize(double v, bool trinary, int prev, double penalty)
+{
+  if(!trinary) {
+    return (v > -penalty*prev) ? 1 : -1;
+  }
+  double upper = 1.0/3.0 + (prev == 0 ? penalty : (prev == 1 ? -penalty : 0));
+  double lower = -1.0/3.0 + (prev == -1 ? penalty : (prev == 0 ? -penalty : 0));
+  return (v > upper) ? 1 : ((v > lower) ? 0 : -1);
+}
+
+
+// Bits of symbol jj for the output level out. A zero is sent as both pins low or both pins high, alternating
+// between the two (last_equal tells which one was used last). With hold_zero set, a zero that follows
+// a zero is sent in the same way as that one, so that the pins do not toggle during a run of zeros.
+// With zero_low set, every zero is sent as both pins low.
+static inline uint32_t encode_symbol(int out, int jj, int prev, int *last_equal, bool hold_zero, bool zero_low)
+{
+  if(out == 1) {
+    return 1u<<(2*jj);
+  } else if(out == -1) {
+    return 1u<<(2*jj+1);
+  }
+  if(zero_low) {
+    *last_equal = 0;
+    return 0;
+  }
+  if(hold_zero && prev == 0) {
+    return *last_equal ? 3u<<(2*jj) : 0;
+  }
+  if(*last_equal == 0) {
+    *last_equal = 1;
+    return 3u<<(2*jj);
+  }
+  *last_equal = 0;
+  return 0;
+}
+
+
+// Xorshift random numbers for the refresh, as rand() is used by core 0
+static inline double refresh_dither(double dither_amplitude)
+{
+  refresh_rng ^= refresh_rng << 13;
+  refresh_rng ^= refresh_rng >> 17;
+  refresh_rng ^= refresh_rng << 5;
+  return dither_filter_next(&refresh_dither_filter, (refresh_rng/4294967296.0 - 0.5)*2*dither_amplitude);
+}
+
+
+// Handshake between core 0, which holds the refresh off while it changes the buffers or the DMAs, and core 1,
+// which refreshes a segment. Each core sets its own flag and then reads the other one. The barrier between
+// the store and the load keeps them in that order, so that at least one of the cores sees the flag of the other.
+static void hold_refresh()
+{
+  refresh_hold = true;
+  __dmb();
+  while(refresh_in_step) {
+    // Wait for core 1 to finish the segment
+  }
+  __dmb();
+}
+
+
+static void release_refresh()
+{
+  __dmb();  // The buffers are complete before core 1 may use them
+  refresh_hold = false;
+}
+
+
+static bool enter_refresh_step()
+{
+  refresh_in_step = true;
+  __dmb();
+  if(refresh_hold) {
+    refresh_in_step = false;
+    return false;
+  }
+  return true;
+}
+
+
+static void leave_refresh_step()
+{
+  __dmb();  // The copy to the buffer is complete before core 0 may change it
+  refresh_in_step = false;
+}
+
+
+void synth::set_refresh(bool r)
+{
+  hold_refresh();
+  refresh = r;
+  refresh_active = r;
+  refresh_restart = true;
+  release_refresh();
+}
+
+
+// The samples of word ii for the refresh, rounded to the grid of the fixed point kernel if it is used
+void synth::refresh_samples(int ii, oscillator_t *fund, oscillator_t *hd3, bool fixed, double *samples)
+{
+  word_samples(ii, fund, hd3, samples);
+  if(fixed) {
+    for(int jj = 0; jj < 16; jj++) {
+      samples[jj] = sd_fixed(samples[jj])/(double)(1 << sd_frac_bits);
+    }
+  }
+}
+
+
+// Recalculate one segment of the main buffer with new dither and copy it to the buffer when the DMA is
+// not reading that part. To be called repeatedly by core 1. The samples are those that the buffer was
+// calculated from, with the same sine method, and on the fixed point grid when that kernel made the buffer,
+// so that the modulator states found from the buffer are exact. The oscillators run in software, which
+// gives the same samples as the interpolators.
+void synth::refresh_step()
+{
+  // Not with high impedance zeros either, as the two SMs read the buffer at different times. Nor when the
+  // pattern table made the buffer, as the refresh would replace it with the output of the true modulator.
+  if(!refresh || mode < 2 || !uses_buffers() || compressed_active || rle_active || tones_active() || fine_active ||
+     hiz_active || pattern_kernel()) {
+    return;
+  }
+  if(!enter_refresh_step()) {
+    return;
+  }
+  uint32_t start_time = micros();
+  bool trinary = (mode == 3 || mode == 5);
+  bool fixed = (sd_kernel == SD_KERNEL_FIXED || n_bank_active > 0);
+  int n_segs = (n_words + refresh_segment_words - 1)/refresh_segment_words;
+  double samples[16];
+  oscillator_t fund, hd3;
+  uint32_t increment = llround(4294967296.0 * n_periods / (n_words * 16.0));
+  osc_start(&fund, increment, -1);
+  osc_start(&hd3, 3*increment, -1);
+
+  if(refresh_restart) {
+    // The state of the modulator is the sum of its input minus its output
+    double state = 0;
+    for(int ii = 0; ii < n_words; ii++) {
+      if(ii % refresh_segment_words == 0) {
+        refresh_seg_state[ii/refresh_segment_words] = state;
+      }
+      refresh_samples(ii, &fund, &hd3, fixed, samples);
+      for(int jj = 0; jj < 16; jj++) {
+        state += samples[jj] - symbol_value(synth_buffer[ii], jj);
+      }
+    }
+    refresh_state = state;
+    dither_filter_init(&refresh_dither_filter, dither_shape, 2*M_PI*n_periods/(n_words*16.0));
+    refresh_seg = 0;
+    refresh_last_equal = 1;
+    refresh_last_out = 0;
+    refresh_words_done = 0;
+    refresh_busy_us = 0;
+    refresh_start_us = start_time;
+    refresh_restart = false;
+  }
+
+  int seg_start = refresh_seg*refresh_segment_words;
+  int len = min(refresh_segment_words, n_words - seg_start);
+
+  // The state at the end of the old segment, which the following segment continues from
+  double target = refresh_seg_state[refresh_seg];
+  for(int ii = seg_start; ii < seg_start + len; ii++) {
+    refresh_samples(ii, &fund, &hd3, fixed, samples);
+    for(int jj = 0; jj < 16; jj++) {
+      target += samples[jj] - symbol_value(synth_buffer[ii], jj);
+    }
+  }
+
+  // New segment, with the last output chosen to end up as close to the old end state as possible
+  double state = refresh_state;
+  for(int ii = seg_start; ii < seg_start + len; ii++) {
+    uint32_t word = 0;
+    refresh_samples(ii, &fund, &hd3, fixed, samples);
+    for(int jj = 0; jj < 16; jj++) {
+      double acc = samples[jj] + state;
+      int out;
+      if(ii == seg_start + len - 1 && jj == 15) {
+        double d = acc - target;
+        if(trinary) {
+          out = (d > 0.5) ? 1 : ((d < -0.5) ? -1 : 0);
+        } else {
+          out = (d > 0) ? 1 : -1;
+        }
+      } else {
+        out = quantize(acc + refresh_dither(dither_amplitude), trinary, refresh_last_out, transition_penalty);
+      }
+      word |= encode_symbol(out, jj, refresh_last_out, &refresh_last_equal, transition_penalty > 0,
+                            zero_mode != ZERO_TOGGLE);
+      refresh_last_out = out;
+      state = acc - out;
+    }
+    refresh_words[ii - seg_start] = word;
+  }
+  uint32_t busy_us = micros() - start_time;
+
+  // Wait until the DMA is neither in the segment nor will get there during the copy.
+  // When another buffer is played, the main buffer can start when its remaining words have been sent.
+  const int guard = refresh_segment_words;
+  while(true) {
+    if(refresh_hold) {
+      leave_refresh_step();
+      return;
+    }
+    // In the main buffer the position follows from the read address alone. In another buffer the remaining
+    // count is only used if the read address shows that the DMA did not move to the main buffer meanwhile.
+    uintptr_t addr = dma_hw->ch[synth_dma].read_addr;
+    int pos;
+    if(addr >= (uintptr_t)synth_buffer && addr < (uintptr_t)(synth_buffer + n_words)) {
+      pos = (addr - (uintptr_t)synth_buffer)/sizeof(uint32_t);
+    } else {
+      int remaining = dma_hw->ch[synth_dma].transfer_count;
+      addr = dma_hw->ch[synth_dma].read_addr;
+      if(addr >= (uintptr_t)synth_buffer && addr < (uintptr_t)(synth_buffer + n_words)) {
+        continue;
+      }
+      pos = -remaining;
+    }
+    bool conflict = (pos < seg_start + len && pos + guard > seg_start) || (pos + guard - n_words > seg_start);
+    if(!conflict) {
+      break;
+    }
+  }
+  uint32_t copy_start = micros();
+  memcpy(&synth_buffer[seg_start], refresh_words, len*sizeof(uint32_t));
+  busy_us += micros() - copy_start;
+
+  refresh_seg_state[refresh_seg] = refresh_state;
+  refresh_state = state;
+  refresh_seg = (refresh_seg + 1) % n_segs;
+  refresh_words_done += len;
+  if(refresh_seg == 0) {
+    trace_event(TRACE_REFRESH, refresh_words_done);
   }
-  k = 0.5*(1.0 - cos(nf * M_PI));
-  return k;
+  refresh_busy_us += busy_us;
+  leave_refresh_step();
+}
+
+
+// Number of times per second that the whole main buffer is refreshed
+float synth::get_refresh_rate()
+{
+  uint32_t elapsed_us = micros() - refresh_start_us;
+  if(!refresh_active || elapsed_us == 0) {
+    return 0;
+  }
+  return refresh_words_done/(double)n_words/(elapsed_us*1e-6);
+}
+
+
+// Percentage of the time of core 1 spent on the refresh, excluding waiting for the DMA
+float synth::get_refresh_load()
+{
+  uint32_t elapsed_us = micros() - refresh_start_us;
+  if(!refresh_active || elapsed_us == 0) {
+    return 0;
+  }
+  return 100.0*refresh_busy_us/elapsed_us;
 }
 
 
 // Use sigma-delta modulation to do 1-bit quantization of a sinusoid into the synth buffer
 // based on the parameters already stored in the object.
-// Also fill the ramp-up and ramp-down buffers.
-void synth::fill_synth_buffer_sigma_delta()
+// Also fill the ramp-up and ramp-down buffers. With ramps_only, the main buffer is left as it is
+// and only the ramps of modes 4 and 5 are calculated, with the same dither as before.
+void synth::fill_synth_buffer_sigma_delta(bool ramps_only)
 {
-  double phase, phase_increment;
   double sample, sample_up, sample_down;
   double acc, acc_up, acc_down;
   double out, out_up, out_down;
   double delta_dly, delta_dly_up, delta_dly_down;
   double dither;
-  double epsilon = 1e-5; // To get a little bit away from the zero crossings
   uint32_t word, word_up, word_down;
+  double samples[16];
+  bool ramps = (mode >= 4);
 
-  fill_synth_buffer_silent();
-  phase_increment = 2 * M_PI * n_periods / ((double)n_words * 16.0);
-  phase = 0;
   acc = 0;
   out = 0;
   delta_dly = 0;
@@ -77,32 +830,40 @@ void synth::fill_synth_buffer_sigma_delta()
   delta_dly_down = 0;
   dither = 0;
 
+  start_oscillators();
+  start_dither();
   // Iterate over 32-bit words in the buffer
   for(int ii=0; ii < n_words; ii++) {
+    word_samples(ii, &osc_fund, &osc_hd3, samples);
     word = 0;
     word_up = 0;
     word_down = 0;
     // Iterate over pairs of bits in the word.
     // Each bit is written first normally and then inverted in the neighboring bit to form a differential signal
     for(int jj=0; jj < 16; jj++) {
-      phase = (ii*16 + jj)*phase_increment + epsilon;
-      sample = amplitude * sin(phase) + hd3_amplitude*sin(3*phase + hd3_phase_rad);
+      sample = samples[jj];
+      dither = rand()/(double)RAND_MAX; // 0 - 1
+      dither = dither_filter_next(&main_dither, (dither - 0.5)*2*dither_amplitude);
+      if(!ramps_only) {
+        acc = sample + delta_dly;
+        if(acc + dither > -transition_penalty*out) { // out is still the previous output
+          out = 1;
+          word |= 1<<(2*jj);
+        } else {
+          out = -1;
+          word |= 1<<(2*jj+1);
+        }
+        delta_dly = acc - out;
+      }
+      if(!ramps) {
+        continue;
+      }
+
       sample_up = sample * taper(ii*16 + jj, n_words*16, false);
       sample_down = sample * taper(ii*16 + jj, n_words*16, true);
-      acc = sample + delta_dly;
       acc_up = sample_up + delta_dly_up;
       acc_down = sample_down + delta_dly_down;
-      dither = rand()/(double)RAND_MAX; // 0 - 1
-      dither = (dither - 0.5)*2*dither_amplitude;
-      if(acc + dither > 0) {
-        out = 1;
-        word |= 1<<(2*jj);
-      } else {
-        out = -1;
-        word |= 1<<(2*jj+1);
-      }
-
-      if(acc_up + dither > 0) {
+      if(acc_up + dither > -transition_penalty*out_up) { // out_up is still the previous output
         out_up = 1;
         word_up |= 1<<(2*jj);
       } else {
@@ -110,20 +871,21 @@ void synth::fill_synth_buffer_sigma_delta()
         word_up |= 1<<(2*jj+1);
       }
 
-      if(acc_down + dither > 0) {
+      if(acc_down + dither > -transition_penalty*out_down) { // out_down is still the previous output
         out_down = 1;
         word_down |= 1<<(2*jj);
       } else {
         out_down = -1;
         word_down |= 1<<(2*jj+1);
       }           
-      delta_dly = acc - out;
       delta_dly_up = acc_up - out_up;
       delta_dly_down = acc_down - out_down;
     }
     if(ii < max_words) {
-      synth_buffer[ii] = word;
-      if(mode >= 4) {
+      if(!ramps_only) {
+        synth_buffer[ii] = word;
+      }
+      if(ramps) {
         synth_buffer_ramp_up[ii] = word_up;
         synth_buffer_ramp_down[ii] = word_down;
       } else {
@@ -132,26 +894,28 @@ void synth::fill_synth_buffer_sigma_delta()
       }
     }
   }
+  stop_oscillators();
 }
 
 
 // Use sigma-delta modulation to do 1.5-bit quantization (3 levels) of a sinusoid into the synth buffer.
 // based on the parameters already stored in the object.
-// Also fill the ramp-up and ramp-down buffers.
-void synth::fill_synth_buffer_sigma_delta_3s()
+// Also fill the ramp-up and ramp-down buffers, or only them with ramps_only, as for the binary modes.
+void synth::fill_synth_buffer_sigma_delta_3s(bool ramps_only)
 {
-  double phase, phase_increment, dither;
+  double dither;
   double sample, sample_up, sample_down;
   double acc, acc_up, acc_down;
   double out, out_up, out_down;
   double delta_dly, delta_dly_up, delta_dly_down;
-  double epsilon = 1e-5; // To get a little bit away from the zero crossings
   uint32_t word, word_up, word_down;
+  double samples[16];
   int last_equal, last_equal_up, last_equal_down; // Switch between keeping both high and both low when they shall be equal
+  int prev, prev_up, prev_down;
+  bool hold_zero = (transition_penalty > 0);
+  bool zero_low = (zero_mode != ZERO_TOGGLE);
+  bool ramps = (mode >= 4);
 
-  fill_synth_buffer_silent();
-  phase_increment = 2 * M_PI * n_periods / ((double)n_words * 16.0);
-  phase = 0;
   acc = 0;
   out = 0;
   delta_dly = 0;
@@ -165,79 +929,51 @@ void synth::fill_synth_buffer_sigma_delta_3s()
   last_equal = 1;
   last_equal_up = 1;
   last_equal_down = 1;
+  start_oscillators();
+  start_dither();
   // Iterate over 32-bit words in the buffer
   for(int ii=0; ii < n_words; ii++) {
+    word_samples(ii, &osc_fund, &osc_hd3, samples);
     word = 0;
     word_up = 0;
     word_down = 0;
     // Iterate over pairs of bits in the word.
     // Each bit is written first normally and then inverted in the neighboring bit to form a differential signal
     for(int jj=0; jj < 16; jj++) {
-      phase = (ii*16 + jj)*phase_increment + epsilon;
-      sample = amplitude * sin(phase) + hd3_amplitude*sin(3*phase + hd3_phase_rad);
+      sample = samples[jj];
+      dither = rand()/(double)RAND_MAX; // 0 - 1
+      dither = dither_filter_next(&main_dither, (dither - 0.5)*2*dither_amplitude);
+      if(!ramps_only) {
+        acc = sample + delta_dly;
+        prev = out;
+        out = quantize(acc + dither, true, prev, transition_penalty);
+        word |= encode_symbol(out, jj, prev, &last_equal, hold_zero, zero_low);
+        delta_dly = acc - out;
+      }
+      if(!ramps) {
+        continue;
+      }
+
       sample_up = sample * taper(ii*16 + jj, n_words*16, false);
       sample_down = sample * taper(ii*16 + jj, n_words*16, true);
-      acc = sample + delta_dly;
       acc_up = sample_up + delta_dly_up;
       acc_down = sample_down + delta_dly_down;
-      dither = rand()/(double)RAND_MAX; // 0 - 1
-      dither = (dither - 0.5)*2*dither_amplitude;
+      prev_up = out_up;
+      out_up = quantize(acc_up + dither, true, prev_up, transition_penalty);
+      word_up |= encode_symbol(out_up, jj, prev_up, &last_equal_up, hold_zero, zero_low);
 
-      if(acc + dither > 1.0/3.0) {
-        out = 1;
-        word |= 1<<(2*jj);
-      } else if(acc + dither > -1.0/3.0) {
-        out = 0;
-        if(last_equal == 0) {
-          word |= 3<<(2*jj);
-          last_equal = 1;
-        } else {
-          last_equal = 0;
-        }
-      } else {
-        out = -1;
-        word |= 1<<(2*jj+1);
-      } 
+      prev_down = out_down;
+      out_down = quantize(acc_down + dither, true, prev_down, transition_penalty);
+      word_down |= encode_symbol(out_down, jj, prev_down, &last_equal_down, hold_zero, zero_low);
 
-      if(acc_up + dither > 1.0/3.0) {
-        out_up = 1;
-        word_up |= 1<<(2*jj);
-      } else if(acc_up + dither > -1.0/3.0) {
-        out_up = 0;
-        if(last_equal_up == 0) {
-          word_up |= 3<<(2*jj);
-          last_equal_up = 1;
-        } else {
-          last_equal_up = 0;
-        }
-      } else {
-        out_up = -1;
-        word_up |= 1<<(2*jj+1);
-      } 
-
-      if(acc_down + dither > 1.0/3.0) {
-        out_down = 1;
-        word_down |= 1<<(2*jj);
-      } else if(acc_down + dither > -1.0/3.0) {
-        out_down = 0;
-        if(last_equal_down == 0) {
-          word_down |= 3<<(2*jj);
-          last_equal_down = 1;
-        } else {
-          last_equal_down = 0;
-        }
-      } else {
-        out_down = -1;
-        word_down |= 1<<(2*jj+1);
-      } 
-
-      delta_dly = acc - out;
       delta_dly_up = acc_up - out_up;
       delta_dly_down = acc_down - out_down;
     }
     if(ii < max_words) {
-      synth_buffer[ii] = word;
-      if(mode >= 4) {
+      if(!ramps_only) {
+        synth_buffer[ii] = word;
+      }
+      if(ramps) {
         synth_buffer_ramp_up[ii] = word_up;
         synth_buffer_ramp_down[ii] = word_down;
       } else {
@@ -246,6 +982,78 @@ void synth::fill_synth_buffer_sigma_delta_3s()
       }
     }
   }
+  stop_oscillators();
+}
+
+
+// Sigma-delta modulation, binary or trinary, in fixed point. The modulators of the main buffer and the ramps
+// run in lockstep in the lanes of the modulator kernel, otherwise as in fill_synth_buffer_sigma_delta().
+void synth::fill_synth_buffer_sigma_delta_fixed(bool trinary, bool ramps_only)
+{
+  double samples[16];
+  int32_t x[16], dither[16];
+  int16_t gain_up[16], gain_down[16];
+  uint32_t words[sd_max_lanes];
+  bool ramps = (mode >= 4);
+  sd_state_t st;
+  // Dither from rand() in the same way as the floating point modulators, (2*rand()/RAND_MAX - 1)*dither_amplitude
+  int64_t dither_scale = llround(dither_amplitude*(1 << sd_frac_bits)*4294967296.0/RAND_MAX);
+
+  // The bank levels run modulators of their own on the samples scaled by the level
+  sd_state_t bank_st[max_bank_levels];
+  int16_t level_gain[max_bank_levels];
+  int32_t xk[16];
+
+  sd_init(&st, trinary, transition_penalty, ramps ? 3 : 1, zero_mode != ZERO_TOGGLE);
+  for(int kk = 0; kk < n_bank_active; kk++) {
+    sd_init(&bank_st[kk], trinary, transition_penalty, ramps ? 3 : 1, zero_mode != ZERO_TOGGLE);
+    level_gain[kk] = sd_gain(amplitude > 0 ? fmin(fmax(bank_amplitude[kk]/amplitude, 0.0), 1.0) : 0);
+  }
+  start_oscillators();
+  start_dither();
+  for(int ii=0; ii < n_words; ii++) {
+    word_samples(ii, &osc_fund, &osc_hd3, samples);
+    for(int jj=0; jj < 16; jj++) {
+      x[jj] = sd_fixed(samples[jj]);
+      if(dither_shape == DITHER_WHITE) {
+        dither[jj] = ((2*(int64_t)rand() - RAND_MAX)*dither_scale) >> 32;
+      } else {
+        dither[jj] = sd_fixed(dither_filter_next(&main_dither, (2.0*rand()/RAND_MAX - 1)*dither_amplitude));
+      }
+      if(ramps) {
+        gain_up[jj] = sd_gain(taper(ii*16 + jj, n_words*16, false));
+        gain_down[jj] = sd_gain(taper(ii*16 + jj, n_words*16, true));
+      }
+    }
+    sd_word(&st, x, gain_up, gain_down, dither, words);
+    if(ii < max_words) {
+      if(!ramps_only) {
+        synth_buffer[ii] = words[SD_MAIN];
+      }
+      if(ramps) {
+        synth_buffer_ramp_up[ii] = words[SD_UP];
+        synth_buffer_ramp_down[ii] = words[SD_DOWN];
+      } else {
+        synth_buffer_ramp_up[ii] = words[SD_MAIN];
+        synth_buffer_ramp_down[ii] = 0;
+      }
+    }
+    for(int kk = 0; kk < n_bank_active; kk++) {
+      uint32_t *b = bank_buffer[kk];
+      for(int jj=0; jj < 16; jj++) {
+        xk[jj] = sd_scale(x[jj], level_gain[kk]);
+      }
+      sd_word(&bank_st[kk], xk, gain_up, gain_down, dither, words);
+      if(!ramps_only) {
+        b[ii] = words[SD_MAIN];
+      }
+      if(ramps) {
+        b[n_words + ii] = words[SD_UP];
+        b[2*n_words + ii] = words[SD_DOWN];
+      }
+    }
+  }
+  stop_oscillators();
 }
 
 
@@ -256,8 +1064,8 @@ void synth::fill_synth_buffer_compare()
   uint32_t word;
   double epsilon = 1e-5; // To get a little bit away from the zero crossings
 
-  fill_synth_buffer_silent();
   phase_increment = 2 * M_PI * n_periods / ((double)n_words * 16.0);
+  start_dither();
   // Iterate over 32-bit words in the buffer
   for(int ii=0; ii < n_words; ii++) {
     word = 0;
@@ -267,7 +1075,7 @@ void synth::fill_synth_buffer_compare()
       phase = (ii*16 + jj)*phase_increment;
       sample = amplitude * sin(phase + epsilon);
       dither = rand()/(double)RAND_MAX; // 0 - 1
-      dither = (dither - 0.5)*2*dither_amplitude;      
+      dither = dither_filter_next(&main_dither, (dither - 0.5)*2*dither_amplitude);
       if(sample + dither > 0) {
         word |= 1<<(2*jj);
       } else {
@@ -283,250 +1091,1540 @@ void synth::fill_synth_buffer_compare()
 }
 
 
-// Inspired by:
-// https://101-things.readthedocs.io/en/latest/ham_transmitter.html
-// https://github.com/dawsonjon/101Things/blob/master/18_transmitter/nco.cpp
-// and
-// https://gregchadwick.co.uk/blog/playing-with-the-pico-pt2/
-// https://github.com/GregAC/pico-stuff/blob/main/pwm_dma/pwm_dma_interrupt_sequence.c
-// and
-// https://github.com/raspberrypi/pico-examples/blob/master/dma/channel_irq/channel_irq.c
+// Modulator states covered by the pattern table
+static const double pattern_state_min = -1.5;
+static const double pattern_state_max = 1.5;
 
 
-void dma_irq_handler()
+// Calculate the pattern table for the current amplitude and HD3 settings and the given phase increment 
+// per sample. For every amplitude level, quantized phase at the start of a word, quantized modulator state
+// and zero toggle state, the table holds the 16 symbols that the modulator would output without dither
+// and the sum of the output levels. The table is only recalculated when the parameters have changed.
+// The patterns depend on the phase increment within a word, so every retune recalculates the table.
+// Returns false if there is not enough memory for the table.
+bool synth::build_pattern_table(double phase_increment, bool trinary)
 {
-  static int dma_state = 0;
-  // 0 - silent
-  // 1 - transmitting
-  /*
-  digitalWrite(26, HIGH);
-  digitalWrite(26, LOW);
-  digitalWrite(26, HIGH);
-*/
-  if(dma_channel_get_irq0_status(restart_dma)) {
-    dma_hw->ints0 = 1u << restart_dma; // Acknowledge interrupt
-    if(!dma_channel_is_busy(restart_dma)) {
-      if(enable_transmit) {
-        if(dma_state == 1) {
-          dma_channel_set_read_addr(restart_dma, synth_buffer_ptr, false);
-        } else if(dma_state == 0){
-          dma_channel_set_read_addr(restart_dma, synth_buffer_ramp_up_ptr, false);
-          digitalWrite(26, HIGH);
-          dma_state = 1;
-        }
-      } else {
-        if(dma_state == 0) {
-          dma_channel_set_read_addr(restart_dma, synth_buffer_silent_ptr, false);
-        } else if(dma_state == 1){
-          dma_channel_set_read_addr(restart_dma, synth_buffer_ramp_down_ptr, false);
-          digitalWrite(26, LOW);
-          dma_state = 0;
+  bool zero_low = (zero_mode != ZERO_TOGGLE);
+  double key[6] = {phase_increment, amplitude, hd3_amplitude, hd3_phase_rad, (double)trinary, (double)zero_low};
+  double (*x)[16];
+  double epsilon = 1e-5; // To get a little bit away from the zero crossings
+
+  if(pattern_words == NULL) {
+    pattern_words = new (std::nothrow) uint32_t[pattern_entries];
+    pattern_info = new (std::nothrow) uint8_t[pattern_entries];
+    if(pattern_words == NULL || pattern_info == NULL) {
+      delete [] pattern_words;
+      delete [] pattern_info;
+      pattern_words = NULL;
+      pattern_info = NULL;
+      return false;
+    }
+    pattern_key[0] = 0;  // No phase increment, the table is not calculated yet
+  } else if(memcmp(key, pattern_key, sizeof(key)) == 0) {
+    return true;
+  }
+  // The samples of each phase, 32 kB, only needed while the table is calculated
+  x = new (std::nothrow) double[pattern_phases][16];
+  if(x == NULL) {
+    return false;
+  }
+  memcpy(pattern_key, key, sizeof(key));
+
+  for(int pp = 0; pp < pattern_phases; pp++) {
+    for(int jj = 0; jj < 16; jj++) {
+      double phase = 2*M_PI*pp/pattern_phases + jj*phase_increment + epsilon;
+      x[pp][jj] = amplitude * sin(phase) + hd3_amplitude*sin(3*phase + hd3_phase_rad);
+    }
+  }
+
+  int idx = 0;
+  for(int aa = 0; aa < pattern_levels; aa++) {
+    double gain = aa/(double)(pattern_levels - 1);
+    for(int pp = 0; pp < pattern_phases; pp++) {
+      for(int qq = 0; qq < pattern_states; qq++) {
+        for(int le = 0; le < 2; le++) {
+          double delta_dly = pattern_state_min + (qq + 0.5)*(pattern_state_max - pattern_state_min)/pattern_states;
+          double acc, out;
+          int last_equal = le;
+          int sum = 0;
+          uint32_t word = 0;
+          for(int jj = 0; jj < 16; jj++) {
+            acc = gain*x[pp][jj] + delta_dly;
+            if(!trinary) {
+              if(acc > 0) {
+                out = 1;
+                word |= 1<<(2*jj);
+              } else {
+                out = -1;
+                word |= 1<<(2*jj+1);
+              }
+            } else {
+              if(acc > 1.0/3.0) {
+                out = 1;
+                word |= 1<<(2*jj);
+              } else if(acc > -1.0/3.0) {
+                out = 0;
+                if(last_equal == 0 && !zero_low) {
+                  word |= 3<<(2*jj);
+                  last_equal = 1;
+                } else {
+                  last_equal = 0;
+                }
+              } else {
+                out = -1;
+                word |= 1<<(2*jj+1);
+              }
+            }
+            sum += out;
+            delta_dly = acc - out;
+          }
+          pattern_words[idx] = word;
+          pattern_info[idx] = (sum + 16) | (last_equal << 6);
+          idx++;
         }
       }
     }
   }
+  delete [] x;
+  return true;
 }
 
 
-void synth::disable_output()
+// Look up the output word for one modulator in the pattern table and update the state of the modulator.
+// The modulator state is tracked exactly, using the sum of the input samples over the word and the sum
+// of the output levels of the selected word. So errors from the quantization of the table index are 
+// noise shaped just like the quantization noise of the modulator itself.
+static inline uint32_t pattern_step(const uint32_t *words, const uint8_t *info, int level, int phase_idx,
+                                    double sample_sum, double dither, double *delta_dly, int *last_equal)
 {
-  if(enable_transmit && mode == 0) {
-    pio_sm_set_consecutive_pindirs(pio, sm, m_first_rf_pin, 2, false);
+  int qq = floor((*delta_dly + dither - pattern_state_min)*pattern_states/(pattern_state_max - pattern_state_min));
+  if(qq < 0) {
+    qq = 0;
+  } else if(qq >= pattern_states) {
+    qq = pattern_states - 1;
   }
-  enable_transmit = false;
+  int idx = (((level*pattern_phases + phase_idx)*pattern_states + qq) << 1) + *last_equal;
+  *delta_dly += sample_sum - ((info[idx] & 0x3f) - 16);
+  *last_equal = info[idx] >> 6;
+  return words[idx];
 }
 
 
-void synth::enable_output()
+// Pick a table level for a gain between 0 and 1, randomly rounded up or down so that the average is right
+static inline int pattern_level(double gain)
 {
-  if(!enable_transmit && mode == 0) {
-    pio_sm_set_consecutive_pindirs(pio, sm, m_first_rf_pin, 2, true);
+  int level = floor(gain*(pattern_levels - 1) + rand()/((double)RAND_MAX + 1));
+  if(level < 0) {
+    return 0;
+  } else if(level >= pattern_levels) {
+    return pattern_levels - 1;
   }
-  enable_transmit = true;
+  return level;
 }
 
 
-double synth::get_frequency_exact()
+// Fill the synth buffers for the sigma-delta modes by looking up precalculated words in the pattern table 
+// instead of running the modulators sample by sample. Only two sin() calls per word are needed to 
+// track the modulator states exactly. Dither is applied to the modulator state used to select 
+// the table entry, the phase index is randomly rounded. With ramps_only, only the ramps of modes 4 and 5
+// are calculated. Experimental: the SNR is 15-20 dB below that of the true modulators, and the dither is
+// white, one value per word, whatever the dither shape.
+void synth::fill_synth_buffer_pattern(bool ramps_only)
 {
-  if(mode != 0) {
-    return CPU_freq_actual * (double) n_periods / (16 * (double) n_words);
-  } else {
-    float clkdiv = round(256.0*CPU_freq_actual/(2.0*frequency))/256.0;
-    return CPU_freq_actual/(2*clkdiv);
+  double phase_increment, phase, sample_sum, dither;
+  double k1, k3;
+  double delta_dly = 0, delta_dly_up = 0, delta_dly_down = 0;
+  int last_equal = 1, last_equal_up = 1, last_equal_down = 1;
+  double epsilon = 1e-5; // To get a little bit away from the zero crossings
+  bool trinary = (mode == 3 || mode == 5);
+  uint32_t word = 0;
+  int phase_idx;
+
+  phase_increment = 2 * M_PI * n_periods / ((double)n_words * 16.0);
+  if(!build_pattern_table(phase_increment, trinary)) {
+    Serial.println("Not enough memory for the pattern table");
+    if(trinary) {
+      fill_synth_buffer_sigma_delta_3s(ramps_only);
+    } else {
+      fill_synth_buffer_sigma_delta(ramps_only);
+    }
+    return;
+  }
+
+  // Sum of sin(phase + jj*phase_increment) over the 16 samples of a word is 
+  // k1*sin(phase + 7.5*phase_increment), and similarly for the third harmonic.
+  k1 = sin(8*phase_increment)/sin(phase_increment/2);
+  k3 = sin(24*phase_increment)/sin(1.5*phase_increment);
+
+  for(int ii=0; ii < n_words && ii < max_words; ii++) {
+    // Phase at the start of the word, in the range 0 to 2*pi
+    phase = 2*M_PI*fmod((double)n_periods*ii, n_words)/n_words;
+    sample_sum = amplitude*k1*sin(phase + 7.5*phase_increment + epsilon) + 
+                 hd3_amplitude*k3*sin(3*(phase + epsilon) + 22.5*phase_increment + hd3_phase_rad);
+    phase_idx = floor(phase*pattern_phases/(2*M_PI) + rand()/((double)RAND_MAX + 1));
+    if(phase_idx >= pattern_phases) {
+      phase_idx -= pattern_phases;
+    }
+    dither = rand()/(double)RAND_MAX; // 0 - 1
+    dither = (dither - 0.5)*2*dither_amplitude;
+
+    if(!ramps_only) {
+      word = pattern_step(pattern_words, pattern_info, pattern_levels - 1, phase_idx, sample_sum, dither, 
+                          &delta_dly, &last_equal);
+      synth_buffer[ii] = word;
+    }
+    if(mode >= 4) {
+      // The taper is almost constant during a word, use the value in the middle of it
+      double gain_up = taper(ii*16 + 8, n_words*16, false);
+      double gain_down = taper(ii*16 + 8, n_words*16, true);
+      synth_buffer_ramp_up[ii] = pattern_step(pattern_words, pattern_info, pattern_level(gain_up), phase_idx, 
+                                              gain_up*sample_sum, dither, &delta_dly_up, &last_equal_up);
+      synth_buffer_ramp_down[ii] = pattern_step(pattern_words, pattern_info, pattern_level(gain_down), phase_idx, 
+                                                gain_down*sample_sum, dither, &delta_dly_down, &last_equal_down);
+    } else {
+      synth_buffer_ramp_up[ii] = word;
+      synth_buffer_ramp_down[ii] = 0;
+    }
   }
 }
 
 
-void synth::set_mode(int m)
+void synth::main_stream_init(main_stream_t *st)
 {
-  if(m >= 0 && m <= 5) {
-    mode = m;
-    needs_recalculation = true;
-  } else {
-    Serial.println("Attempted to set invalid mode");
+  st->phase_increment = 2 * M_PI * n_periods / ((double)n_words * 16.0);
+  st->word_index = 0;
+  st->delta_dly = 0;
+  st->last_equal = 1;
+  st->last_out = 0;
+  start_dither();
+}
+
+
+// Generate the next word of the main buffer for modes 1-3, i.e. the same thing as 
+// fill_synth_buffer_compare(), fill_synth_buffer_sigma_delta() and fill_synth_buffer_sigma_delta_3s(),
+// but without the ramps and one word at a time, so that the buffer does not have to fit in memory.
+uint32_t synth::main_stream_word(main_stream_t *st)
+{
+  double phase, sample, acc, dither;
+  double epsilon = 1e-5; // To get a little bit away from the zero crossings
+  uint32_t word = 0;
+  int out;
+
+  for(int jj=0; jj < 16; jj++) {
+    phase = ((double)st->word_index*16 + jj)*st->phase_increment + epsilon;
+    dither = rand()/(double)RAND_MAX; // 0 - 1
+    dither = dither_filter_next(&main_dither, (dither - 0.5)*2*dither_amplitude);
+    if(mode == 1) {
+      sample = amplitude * sin(phase);
+      if(sample + dither > 0) {
+        word |= 1<<(2*jj);
+      } else {
+        word |= 1<<(2*jj+1);
+      }
+      continue;
+    }
+    sample = amplitude * sin(phase) + hd3_amplitude*sin(3*phase + hd3_phase_rad);
+    acc = sample + st->delta_dly;
+    out = quantize(acc + dither, mode == 3, st->last_out, transition_penalty);
+    word |= encode_symbol(out, jj, st->last_out, &st->last_equal, transition_penalty > 0, zero_mode != ZERO_TOGGLE);
+    st->last_out = out;
+    st->delta_dly = acc - out;
   }
+  st->word_index++;
+  return word;
 }
 
 
-const char *synth::get_mode_str()
+// Add a run of 'count' dictionary words starting at 'addr' to the list of blocks of the compressed buffer.
+// Runs that continue where the previous block ended are merged with it.
+static bool add_compressed_block(int *n_blocks, const uint32_t *addr, int count)
 {
-  switch(mode) {
-    case 0:
-      return "CLKDIV";
-    case 1:
-      return "Comparator";
-    case 2:
-      return "Binary sigma delta";
-    case 3:
-      return "Trinary sigma delta";
-    case 4:
-      return "Click-free binary sigma delta";
-    case 5:
-      return "Click-free trinary sigma delta";
-    default:
-      return "???";
+  if(*n_blocks > 0) {
+    dma_block_t *prev = &compressed_blocks[*n_blocks - 1];
+    if((const uint32_t *)prev->read_addr + prev->transfer_count == addr) {
+      prev->transfer_count += count;
+      return true;
+    }
+  }
+  if(*n_blocks >= max_compressed_blocks) {
+    return false;
   }
+  compressed_blocks[*n_blocks].read_addr = addr;
+  compressed_blocks[*n_blocks].transfer_count = count;
+  (*n_blocks)++;
+  return true;
 }
 
 
-// (Re)calculate the buffers
-void synth::calculate_buffers()
+static inline uint32_t pair_hash(uint32_t w0, uint32_t w1, int bits)
 {
-  rational_t PperW; // Periods per 32-bit word as a rational number
-  uint32_t n_mult;
+  return ((w0 * 2654435761u) ^ (w1 * 40503u + (w1 >> 16))) >> (32 - bits);
+}
 
-  Serial.println("Calculating buffers...");
 
-  PperW = rational_approximation(frequency * 16.0 / (double)CPU_freq_actual, min(max_words, max_words_limit));
-  n_periods = PperW.numerator;
-  n_words = PperW.denominator;
+// Generate the main buffer one word at a time and compress it into a dictionary of unique runs of words,
+// stored in synth_buffer, and a list of DMA control blocks that each play one run from the dictionary.
+// Earlier occurrences of the coming words are found with a hash table of pairs of words. Runs shorter than
+// min_match are stored as new words in the dictionary, as a control block costs as much memory as four words.
+// The ramp buffers are used as scratch memory, so this only works in modes 1-3, where the ramp-up buffer 
+// is the same as the main buffer and the ramp-down buffer is silent.
+// Returns false if the dictionary or the list of blocks becomes full.
+bool synth::compress_main_buffer()
+{
+  const int hash_bits = 12;
+  const int min_match = 8;
+  int32_t *hash_head = (int32_t *)synth_buffer_ramp_down;
+  uint32_t *chunk = synth_buffer_ramp_up;
+  main_stream_t st;
+
+  if(compressed_blocks == NULL) {
+    // One extra block to point the restart DMA back to the start
+    compressed_blocks = new (std::nothrow) dma_block_t[max_compressed_blocks + 1];
+    if(compressed_blocks == NULL) {
+      return false;
+    }
+  }
+  for(int ii = 0; ii < (1 << hash_bits); ii++) {
+    hash_head[ii] = -1;
+  }
+  dict_words = 0;
+  n_blocks = 0;
+  main_stream_init(&st);
+
+  // Generate and compress one chunk at a time
+  for(int start = 0; start < n_words; start += max_words) {
+    int len = min(max_words, n_words - start);
+    for(int ii = 0; ii < len; ii++) {
+      chunk[ii] = main_stream_word(&st);
+    }
+    int ii = 0;
+    while(ii < len) {
+      int match_len = 0, match_pos = -1;
+      if(ii + 1 < len) {
+        match_pos = hash_head[pair_hash(chunk[ii], chunk[ii+1], hash_bits)];
+        if(match_pos >= 0 && synth_buffer[match_pos] == chunk[ii] && synth_buffer[match_pos+1] == chunk[ii+1]) {
+          match_len = 2;
+          while(match_pos + match_len < dict_words && ii + match_len < len && 
+                synth_buffer[match_pos + match_len] == chunk[ii + match_len]) {
+            match_len++;
+          }
+        }
+      }
+      if(match_len >= min_match) {
+        if(!add_compressed_block(&n_blocks, &synth_buffer[match_pos], match_len)) {
+          return false;
+        }
+        ii += match_len;
+      } else {
+        if(dict_words >= max_words) {
+          return false;
+        }
+        synth_buffer[dict_words] = chunk[ii];
+        if(dict_words > 0) {
+          hash_head[pair_hash(synth_buffer[dict_words-1], synth_buffer[dict_words], hash_bits)] = dict_words - 1;
+        }
+        if(!add_compressed_block(&n_blocks, &synth_buffer[dict_words], 1)) {
+          return false;
+        }
+        dict_words++;
+        ii++;
+      }
+    }
+  }
+  return true;
+}
 
-  Serial.print("n_words = ");
-  Serial.println(get_n_words());
-  Serial.print("n_periods = ");
-  Serial.println(get_n_periods());
 
-  n_mult = floor(max_words/n_words);
-  // Make the buffer at least half of max_words so that the interrupt has plenty of time to do its job. 
-  n_periods *= n_mult;
-  n_words *= n_mult;
+bool synth::is_compressed()
+{
+  return compressed_active;
+}
 
-  
-  Serial.print("n_words = ");
-  Serial.println(get_n_words());
-  Serial.print("n_periods = ");
-  Serial.println(get_n_periods());
 
-  if(mode == 1) {
-    fill_synth_buffer_compare();
-  } else if(mode == 2 or mode == 4) {
-    fill_synth_buffer_sigma_delta();
+// Symbol n of the main buffer, 0 to 3
+static inline uint32_t main_symbol(int n)
+{
+  return (synth_buffer[n >> 4] >> (2*(n & 15))) & 3;
+}
+
+
+// Run number np of length len (rle_min_run to rle_max_run) of symbol sym, two runs per word
+static inline void put_run(uint32_t *words, int np, uint32_t sym, int len)
+{
+  uint32_t run = sym | (uint32_t)(len - rle_min_run) << 2;
+  if(np & 1) {
+    words[np >> 1] |= run << 16;
   } else {
-    fill_synth_buffer_sigma_delta_3s();
+    words[np >> 1] = run;
   }
-  needs_recalculation = false;
 }
 
 
-// Apply the frequency, mode etc settings, i.e. calculate new waveforms based on the settings.
-// But only if necessary;
-void synth::apply_settings()
+// Encode the main buffer as runs for the RLE serialiser into the ramp-up buffer, which is the same as the
+// main buffer in modes 1-3, and silence of the same length into the ramp-down buffer. Runs longer than
+// rle_max_run are split, and one run is split in two if needed to get an even number of them.
+// Returns false, leaving the ramp buffers as they were, if the buffer can not be played in this way:
+// a run is shorter than rle_min_run, the encoded buffer is not shorter, or the FIFO could run empty.
+bool synth::encode_rle()
 {
-  if(!needs_recalculation) {
-    return;
+  int n_samples = 16*n_words;
+  int n_runs = 0;
+  int split = -1;     // Start of the run that is split to get an even number of runs
+  int start, len, pieces, np;
+
+  for(start = 0; start < n_samples; start += len) {
+    uint32_t sym = main_symbol(start);
+    for(len = 1; start + len < n_samples && main_symbol(start + len) == sym; len++) {
+    }
+    if(len < rle_min_run) {
+      return false;
+    }
+    pieces = (len + rle_max_run - 1)/rle_max_run;
+    if(split < 0 && len >= 2*rle_min_run*pieces) {
+      split = start;
+    }
+    n_runs += pieces;
   }
-  if(synth_dma < 1000) {
-    // dma_channel_abort does not seem to work for chained DMAs
-    // Write zeros to the control registers as recommended here:
-    // (https://forums.raspberrypi.com/viewtopic.php?t=330119)
-    // https://forums.raspberrypi.com/viewtopic.php?t=337439
-    Serial.println("Waiting for DMAs to stop...");
-    hw_clear_bits(&dma_hw->ch[synth_dma].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
-    hw_clear_bits(&dma_hw->ch[restart_dma].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
-    do {
-      // This loop might not be necessary
-      dma_channel_abort(synth_dma);
-      dma_channel_abort(restart_dma);
-    } while(dma_channel_is_busy(synth_dma) || dma_channel_is_busy(restart_dma));
-   unclaim_dma(); 
+  if(n_runs & 1) {
+    if(split < 0) {
+      return false;
+    }
+    n_runs++;
+  } else {
+    split = -1;
+  }
+  int words = n_runs/2;
+  if(words >= n_words || (n_samples + n_runs - 1)/n_runs > rle_max_run) {
+    return false;
   }
 
-  remove_pio_program();
-  if(mode == 0) {
-    add_pio_program(&toggle_program);
-    float clkdiv = CPU_freq_actual/(2.0*frequency);
-    toggle_program_init(pio, sm, pio_prog_offset, m_first_rf_pin, clkdiv);
-  } else {
-    Serial.println("Adding PIO program...");
-    add_pio_program(&pio_serialiser_program);
-    pio_serialiser_program_init(pio, sm, pio_prog_offset, m_first_rf_pin, 1.0); 
-    calculate_buffers();
-    // Restart the DMAs
-    Serial.println("Restarting DMAs");
-    setup_dma();
+  np = 0;
+  for(start = 0; start < n_samples; start += len) {
+    uint32_t sym = main_symbol(start);
+    for(len = 1; start + len < n_samples && main_symbol(start + len) == sym; len++) {
+    }
+    pieces = (len + rle_max_run - 1)/rle_max_run + (start == split ? 1 : 0);
+    for(int pp = 0; pp < pieces; pp++) {
+      put_run(synth_buffer_ramp_up, np++, sym, (len*(pp + 1))/pieces - (len*pp)/pieces);
+    }
   }
-  PrintStatus();
+  // The FIFO must not run empty while the restart DMA starts the next pass, wherever the pass ends
+  for(int ww = 0; ww < words; ww++) {
+    int clocks = 0;
+    for(int kk = 0; kk < rle_fifo_words; kk++) {
+      uint32_t w = synth_buffer_ramp_up[(ww + kk) % words];
+      clocks += ((w >> 2) & 0x3fff) + ((w >> 18) & 0x3fff) + 2*rle_min_run;
+    }
+    if(clocks < rle_min_fifo_clocks) {
+      Serial.println("RLE buffer too fast for the FIFO");
+      memcpy(synth_buffer_ramp_up, synth_buffer, n_words*sizeof(uint32_t));
+      return false;
+    }
+  }
+  for(np = 0; np < n_runs; np++) {
+    put_run(synth_buffer_ramp_down, np, 0, ((int64_t)n_samples*(np + 1))/n_runs - ((int64_t)n_samples*np)/n_runs);
+  }
+  rle_words = words;
+  return true;
 }
 
 
-void synth::remove_pio_program()
+bool synth::is_rle()
 {
-  if(pio_program != NULL) {
-    pio_remove_program(pio, pio_program, pio_prog_offset);
-    pio_sm_unclaim(pio, sm);
-  }
-  pio_program = NULL;
+  return rle_active;
 }
 
 
-void synth::add_pio_program(const pio_program_t *prog)
+// FNV-1a hash of a block of memory, continuing from hash h
+static uint64_t fnv1a(uint64_t h, const void *data, int len)
 {
-  pio_program = prog;
-  pio_prog_offset = pio_add_program(pio, pio_program);
-  sm = pio_claim_unused_sm(pio, true);
-  // Need to call the correct PIO init function after this function has been called.
+  const uint8_t *p = (const uint8_t *)data;
+  for(int ii = 0; ii < len; ii++) {
+    h ^= p[ii];
+    h *= 0x100000001b3ull;
+  }
+  return h;
 }
 
 
-synth::synth(const uint8_t first_rf_pin, double frequency_a)
+// Collect the settings that affect the contents of the buffers
+void synth::get_buffer_settings(buffer_settings_t *s)
 {
-  m_first_rf_pin = first_rf_pin;
-  frequency = frequency_a;
-  dither_amplitude = 1.0;
-  max_words_limit = max_words;
-  amplitude = 1.0;
-  hd3_amplitude = 0.045;
-  hd3_phase_rad = -35.0 * M_PI/180.0;
-  mode = 5;
-  n_words = max_words; // Dummy value for now
-  needs_recalculation = true;
+  memset(s, 0, sizeof(*s));  // Also the padding, the settings are compared as memory
+  s->cpu_freq = CPU_freq_actual;
+  s->frequency = frequency;
+  s->mode = mode;
+  s->amplitude = amplitude;
+  s->hd3_amplitude = hd3_amplitude;
+  s->hd3_phase_rad = hd3_phase_rad;
+  s->dither_amplitude = dither_amplitude;
+  s->dither_seed = dither_seed;
+  s->dither_shape = dither_shape;
+  s->max_words_limit = max_words_limit;
+  s->pattern_synthesis = pattern_synthesis;
+  s->zero_low = (zero_mode != ZERO_TOGGLE);
+  s->sine_method = sine_method;
+  s->sd_kernel = sd_kernel;
+  s->transition_penalty = transition_penalty;
+  s->plan_tolerance_hz = plan_tolerance_hz;
+  s->plan_passband_hz = plan_passband_hz;
+  if(mode >= 2 && mode <= 5) {
+    // Even if the bank could not be allocated, the plan was made for it
+    s->n_bank = n_bank;
+  }
+  if(mode >= 4) {
+    s->taper_shape = taper_shape;
+    if(taper_shape == TAPER_USER) {
+      s->n_user_taper_points = n_user_taper_points;
+      memcpy(s->user_taper_points, user_taper_points, n_user_taper_points*sizeof(float));
+    }
+  }
+  if(tones_active()) {
+    s->n_tones = n_tones;
+    memcpy(s->tone_frequency, tone_frequency, sizeof(tone_frequency));
+    memcpy(s->tone_amplitude, tone_amplitude, sizeof(tone_amplitude));
+    memcpy(s->tone_phase_rad, tone_phase_rad, sizeof(tone_phase_rad));
+  }
+}
 
-  calculate_buffers();
 
-  // The PIO contains a very simple program that waits for a pin to go high
-  // then repeatedly reads a 32-bit word from the FIFO and sends 2 bits per 
-  // clock to two IO pins.
-  add_pio_program(&pio_serialiser_program);
-  pio_serialiser_program_init(pio, sm, pio_prog_offset, first_rf_pin, 1.0); 
-  setup_dma();
+// Hash of the settings, for finding the cached buffer sets quickly
+uint64_t synth::buffer_key(const buffer_settings_t *s)
+{
+  return fnv1a(0xcbf29ce484222325ull, s, sizeof(*s));
 }
 
 
-void synth::setup_dma()
+// Copy the buffers calculated for the settings s from the cache, if they are there
+bool synth::load_cached_buffers(uint64_t key, const buffer_settings_t *s)
 {
-  // Configure DMA from memory to PIO SM TX FIFO
-  synth_dma = dma_claim_unused_channel(true);
-  restart_dma = dma_claim_unused_channel(true);
-  synth_dma_cfg = dma_channel_get_default_config(synth_dma);
-  channel_config_set_transfer_data_size(&synth_dma_cfg, DMA_SIZE_32);
-  channel_config_set_read_increment(&synth_dma_cfg, true);
-  channel_config_set_write_increment(&synth_dma_cfg, false);
-  channel_config_set_dreq(&synth_dma_cfg, pio_get_dreq(pio, sm, true)); // Do a DMA transfer each time the PIO FIFO requests it
-  channel_config_set_chain_to(&synth_dma_cfg, restart_dma);
-  // Write to the SM TX FIFO, provide the buffer address, n_words x 32 bit transfers, do not yet start
-  dma_channel_configure(synth_dma, &synth_dma_cfg, &pio->txf[sm], synth_buffer, n_words, false);
+  cache_lookups++;
+  for(int ii = 0; ii < max_cached_sets; ii++) {
+    buffer_set_t *set = &cache[ii];
+    if(set->words == NULL || set->key != key || memcmp(&set->settings, s, sizeof(*s)) != 0) {
+      continue;
+    }
+    n_words = set->n_words;
+    n_periods = set->n_periods;
+    memcpy(synth_buffer, set->words, n_words*sizeof(uint32_t));
+    if(set->has_ramps) {
+      memcpy(synth_buffer_ramp_up, set->words + n_words, n_words*sizeof(uint32_t));
+      memcpy(synth_buffer_ramp_down, set->words + 2*n_words, n_words*sizeof(uint32_t));
+    } else {
+      memcpy(synth_buffer_ramp_up, set->words, n_words*sizeof(uint32_t));
+      memset(synth_buffer_ramp_down, 0, n_words*sizeof(uint32_t));
+    }
+    set->last_used = ++cache_clock;
+    cache_hits++;
+    return true;
+  }
+  return false;
+}
 
-  // Use a second DMA to reconfigure the first
+
+// Free the least recently used buffer sets until needed_bytes more fit in the cache and there is a free entry
+void synth::evict_cached_buffers(int needed_bytes)
+{
+  while(true) {
+    int lru = -1, n_used = 0;
+    for(int ii = 0; ii < max_cached_sets; ii++) {
+      if(cache[ii].words != NULL) {
+        n_used++;
+        if(lru < 0 || cache[ii].last_used < cache[lru].last_used) {
+          lru = ii;
+        }
+      }
+    }
+    if(lru < 0 || (cache_bytes + needed_bytes <= cache_size && n_used < max_cached_sets)) {
+      return;
+    }
+    cache_bytes -= cache[lru].n_words*sizeof(uint32_t)*(cache[lru].has_ramps ? 3 : 1);
+    delete [] cache[lru].words;
+    cache[lru].words = NULL;
+  }
+}
+
+
+// Store a copy of the current buffers in the cache, replacing the least recently used ones if it is full
+void synth::store_cached_buffers(uint64_t key, const buffer_settings_t *s)
+{
+  bool has_ramps = (mode >= 4);
+  int n = n_words*(has_ramps ? 3 : 1);
+  int bytes = n*sizeof(uint32_t);
+  buffer_set_t *set = NULL;
+
+  if(bytes > cache_size) {
+    return;
+  }
+  evict_cached_buffers(bytes);
+  for(int ii = 0; ii < max_cached_sets; ii++) {
+    if(cache[ii].words == NULL) {
+      set = &cache[ii];
+      break;
+    }
+  }
+  if(set == NULL) {
+    return;
+  }
+  set->words = new (std::nothrow) uint32_t[n];
+  if(set->words == NULL) {
+    Serial.println("Not enough memory to cache the buffers");
+    return;
+  }
+  memcpy(set->words, synth_buffer, n_words*sizeof(uint32_t));
+  if(has_ramps) {
+    memcpy(set->words + n_words, synth_buffer_ramp_up, n_words*sizeof(uint32_t));
+    memcpy(set->words + 2*n_words, synth_buffer_ramp_down, n_words*sizeof(uint32_t));
+  }
+  set->key = key;
+  set->settings = *s;
+  set->n_words = n_words;
+  set->n_periods = n_periods;
+  set->has_ramps = has_ramps;
+  set->last_used = ++cache_clock;
+  cache_bytes += bytes;
+}
+
+
+// Set the memory budget of the cache. Buffer sets that do not fit are freed.
+void synth::set_cache_size(int bytes)
+{
+  cache_size = bytes;
+  evict_cached_buffers(0);
+  if(cache_size == 0) {
+    cache_hits = 0;
+    cache_lookups = 0;
+  }
+}
+
+
+// Inspired by:
+// https://101-things.readthedocs.io/en/latest/ham_transmitter.html
+// https://github.com/dawsonjon/101Things/blob/master/18_transmitter/nco.cpp
+// and
+// https://gregchadwick.co.uk/blog/playing-with-the-pico-pt2/
+// https://github.com/GregAC/pico-stuff/blob/main/pwm_dma/pwm_dma_interrupt_sequence.c
+// and
+// https://github.com/raspberrypi/pico-examples/blob/master/dma/channel_irq/channel_irq.c
+
+
+// Give the restart DMAs of the extra outputs the buffer for their next pass, the same one as for the main output
+static void queue_extra_outputs(bool on)
+{
+  for(int kk = 0; kk < n_extra_active; kk++) {
+    extra_ring[kk][secondary_slot] = on ? extra_buffer_ptr[kk][0] : synth_buffer_silent_ptr[0];
+  }
+}
+
+
+// Give the restart DMA of the hiz directions SM the same buffer as the main restart DMA
+static void queue_hiz_output(uint32_t *buffer)
+{
+  hiz_ring[secondary_slot] = buffer;
+}
+
+
+void dma_irq_handler()
+{
+  /*
+  digitalWrite(26, HIGH);
+  digitalWrite(26, LOW);
+  digitalWrite(26, HIGH);
+*/
+  if(compressed_active) {
+    // The last block of a compressed sequence has been played, select the sequence after the next one
+    if(dma_channel_get_irq0_status(synth_dma)) {
+      dma_hw->ints0 = 1u << synth_dma; // Acknowledge interrupt
+      dma_block_t *seq = enable_transmit ? compressed_blocks : compressed_silent_blocks;
+      if(seq != compressed_next_seq) {
+        trace_event(TRACE_DMA_BUFFER, enable_transmit ? CRC_MAIN : CRC_SILENT);
+      }
+      compressed_next_seq = seq;
+    }
+    return;
+  }
+  if(dma_channel_get_irq0_status(restart_dma)) {
+    dma_hw->ints0 = 1u << restart_dma; // Acknowledge interrupt
+    // A new pass has started, check the CRC of the previous one
+    int finished = crc_started;
+    int finished_level = level_started;
+    bool finished_fine = fine_started;
+    crc_started = crc_queued;
+    crc_queued = CRC_NONE;
+    silent_playing = silent_queued;
+    silent_queued = false;
+    level_started = level_queued;
+    fine_started = fine_queued;
+    if(crc_started == CRC_RAMP_UP && key_edge_pending) {
+      uint32_t delay = time_us_32() - key_edge_at;
+      key_edge_pending = false;
+      key_edges++;
+      key_edge_total_us += delay;
+      if(delay > key_edge_max_us) {
+        key_edge_max_us = delay;
+      }
+    }
+    if(crc_active && finished != CRC_NONE && !(refresh_active && finished == CRC_MAIN && finished_level == 0)) {
+      crc_checks++;
+      uint32_t expected = finished_level ? bank_crc[finished_level][finished] : crc_expected[finished];
+      if(crc_captured != (finished_fine ? fine_crc : expected)) {
+        crc_errors++;
+      }
+    }
+    if(!dma_channel_is_busy(restart_dma)) {
+      if(enable_transmit) {
+        if(dma_state == 1) {
+          dma_channel_set_read_addr(restart_dma, synth_buffer_ptr, false);
+          crc_queued = CRC_MAIN;
+        } else if(dma_state == 0){
+          dma_channel_set_read_addr(restart_dma, synth_buffer_ramp_up_ptr, false);
+          crc_queued = CRC_RAMP_UP;
+          digitalWrite(26, HIGH);
+          dma_state = 1;
+        }
+      } else {
+        if(dma_state == 0) {
+          dma_channel_set_read_addr(restart_dma, synth_buffer_silent_ptr, false);
+          crc_queued = CRC_SILENT;
+          silent_queued = true;
+        } else if(dma_state == 1){
+          dma_channel_set_read_addr(restart_dma, synth_buffer_ramp_down_ptr, false);
+          crc_queued = CRC_RAMP_DOWN;
+          digitalWrite(26, LOW);
+          dma_state = 0;
+        }
+      }
+      // The level is switched by rewriting the pointer cell of the queued buffer. Only the main restart DMA reads
+      // the cells, and it has taken the one of the current pass. The restart DMA of the hiz directions SM gets
+      // a copy of the pointer in its ring below, so the level it plays follows the pins pass by pass even while
+      // it is still to start the current pass.
+      if(n_bank_active > 0 && crc_queued != CRC_SILENT) {
+        if(crc_queued != CRC_RAMP_DOWN) {
+          level_playing = level_requested;
+        }
+        buffer_ptrs[crc_queued][0] = level_buffers[level_playing][crc_queued];
+      }
+      level_queued = level_playing;
+      fine_queued = false;
+      if(fine_active) {
+        if(crc_queued == CRC_MAIN) {
+          uint32_t acc = fine_acc + fine_step;
+          fine_queued = (acc < fine_acc);
+          fine_acc = acc;
+        }
+        dma_channel_set_read_addr(restart_dma, &fine_desc[fine_queued ? CRC_NONE : crc_queued], false);
+      }
+      queue_extra_outputs(crc_queued == CRC_MAIN || crc_queued == CRC_RAMP_UP);
+      if(hiz_active) {
+        queue_hiz_output(buffer_ptrs[crc_queued][0]);
+      }
+      secondary_slot ^= 1;
+      if(crc_queued != crc_started) {
+        trace_event(TRACE_DMA_BUFFER, crc_queued);
+      }
+    }
+  }
+}
+
+
+void synth::disable_output()
+{
+  if(enable_transmit && !uses_buffers()) {
+    pio_sm_set_consecutive_pindirs(pio, sm, m_first_rf_pin, 2, false);
+  }
+  if(enable_transmit) {
+    trace_event(TRACE_KEY_UP, 0);
+    key_up_since = time_us_64();
+    key_down_us += key_up_since - key_down_since;
+  }
+  enable_transmit = false;
+}
+
+
+void synth::enable_output()
+{
+  if(!enable_transmit && !uses_buffers()) {
+    pio_sm_set_consecutive_pindirs(pio, sm, m_first_rf_pin, 2, true);
+  }
+  if(!enable_transmit) {
+    trace_event(TRACE_KEY_DOWN, 0);
+    key_down_since = time_us_64();
+    key_edge_at = time_us_32();
+    key_edge_pending = true;
+  }
+  // Before the wake-up, so that the interrupt handler goes on from the ramp-up to the main buffer
+  enable_transmit = true;
+  if(parked) {
+    wake_outputs();
+  }
+}
+
+
+bool synth::is_output_enabled()
+{
+  return enable_transmit;
+}
+
+
+// Total time that the output has been enabled
+uint64_t synth::get_key_down_us()
+{
+  if(enable_transmit) {
+    return key_down_us + (time_us_64() - key_down_since);
+  }
+  return key_down_us;
+}
+
+
+// Pin transitions per second while the main buffer is played, both pins counted. 0 if not known,
+// which is the case for a compressed buffer.
+double synth::get_transitions_per_s()
+{
+  if(mode == 0) {
+    return 2*get_frequency_exact(); // One pin
+  }
+  if(mode == 6) {
+    return 4*get_frequency_exact();
+  }
+  return main_transitions*CPU_freq_actual/(16.0*n_words);
+}
+
+
+double synth::get_frequency_exact()
+{
+  if(mode == 6) {
+    return CPU_freq_actual/(2*(fracn_half + fracn_long/(double)fracn_len));
+  } else if(mode != 0) {
+    double b = get_fine_fraction();
+    return CPU_freq_actual * ((1 - b)*n_periods + b*fine_periods) / (16 * ((1 - b)*n_words + b*fine_words));
+  } else {
+    float clkdiv = round(256.0*CPU_freq_actual/(2.0*frequency))/256.0;
+    return CPU_freq_actual/(2*clkdiv);
+  }
+}
+
+
+double synth::get_tone_frequency_exact(int k)
+{
+  return CPU_freq_actual * (double) tone_periods[k] / (16 * (double) n_words);
+}
+
+
+void synth::set_mode(int m)
+{
+  if(m >= 0 && m <= 6) {
+    mode = m;
+    // The bank, the tones and fine tuning are only planned for in some modes
+    dirty |= (n_bank > 0 || n_tones > 0 || fine_tuning) ? DIRTY_PLAN | DIRTY_MAIN : DIRTY_MAIN;
+  } else {
+    Serial.println("Attempted to set invalid mode");
+  }
+}
+
+
+const char *synth::get_mode_str()
+{
+  switch(mode) {
+    case 0:
+      return "CLKDIV";
+    case 1:
+      return "Comparator";
+    case 2:
+      return "Binary sigma delta";
+    case 3:
+      return "Trinary sigma delta";
+    case 4:
+      return "Click-free binary sigma delta";
+    case 5:
+      return "Click-free trinary sigma delta";
+    case 6:
+      return "Fractional-N";
+    default:
+      return "???";
+  }
+}
+
+
+// Find the number of periods and words of the buffers, with at most max_denominator words before 
+// the buffer is repeated to fill up the memory.
+void synth::plan_buffers(uint32_t max_denominator)
+{
+  rational_t PperW; // Periods per 32-bit word as a rational number
+  uint32_t n_mult;
+
+  fine_plan_step = 0;
+  plan_candidates = 0;
+  if(fine_possible()) {
+    plan_fine(max_denominator);
+    return;
+  }
+  // With the amplitude bank, every level costs a copy of the buffers, so only repeat them up to bank_pad_words
+  bool bank = (n_bank > 0 && mode >= 2 && mode <= 5);
+  int pad_words = bank ? min(max_words, bank_pad_words) : max_words;
+  if(tones_active()) {
+    plan_tones(max_denominator);
+  } else if(plan_tolerance_hz > 0 && max_denominator <= (uint32_t)max_words) {
+    // The plans tried for compression are longer than the memory, those are not ranked
+    plan_ranked(max_denominator, pad_words);
+  } else {
+    PperW = rational_approximation(frequency * 16.0 / (double)CPU_freq_actual, max_denominator);
+    n_periods = PperW.numerator;
+    n_words = PperW.denominator;
+    for(int kk = 0; kk < max_tones; kk++) {
+      tone_periods[kk] = 0;
+    }
+  }
+
+  Serial.print("n_words = ");
+  Serial.println(get_n_words());
+  Serial.print("n_periods = ");
+  Serial.println(get_n_periods());
+
+  n_mult = floor(pad_words/n_words);
+  if(n_mult < 1) {
+    n_mult = 1;
+  }
+  // Make the buffer at least half of max_words so that the interrupt has plenty of time to do its job. 
+  n_periods *= n_mult;
+  n_words *= n_mult;
+  for(int kk = 0; kk < max_tones; kk++) {
+    tone_periods[kk] *= n_mult;
+  }
+
+  
+  Serial.print("n_words = ");
+  Serial.println(get_n_words());
+  Serial.print("n_periods = ");
+  Serial.println(get_n_periods());
+}
+
+
+// Rank the plans of at most max_denominator words with a frequency within plan_tolerance_hz by their
+// predicted spurs, after the repetition up to pad_words, and take the best. Of equally good plans (to 0.1 dB)
+// the most accurate is taken.
+void synth::plan_ranked(uint32_t max_denominator, int pad_words)
+{
+  double x = frequency * 16.0 / (double)CPU_freq_actual;  // Periods per word
+  double best_score = INFINITY, best_err = INFINITY;
+  uint32_t best_n = 0, best_p = 0;
+
+  plan_candidates = 0;
+  for(uint32_t n = 1; n <= max_denominator; n++) {
+    uint32_t p = lround(x*n);
+    double err = fabs(p/(double)n - x)*CPU_freq_actual/16;
+    if(p < 1 || err > plan_tolerance_hz) {
+      continue;
+    }
+    uint32_t mult = max(1, pad_words/(int)n);
+    double score = round(10*predict_plan_spurs(p*mult, n*mult).worst_dbc);
+    plan_candidates++;
+    if(score < best_score || (score == best_score && err < best_err)) {
+      best_score = score;
+      best_err = err;
+      best_n = n;
+      best_p = p;
+    }
+  }
+  if(best_n == 0) {
+    // Nothing close enough, take the closest
+    rational_t PperW = rational_approximation(x, max_denominator);
+    best_p = PperW.numerator;
+    best_n = PperW.denominator;
+  }
+  n_periods = best_p;
+  n_words = best_n;
+  for(int kk = 0; kk < max_tones; kk++) {
+    tone_periods[kk] = 0;
+  }
+  Serial.print("Plans ranked: ");
+  Serial.println(plan_candidates);
+}
+
+
+// Spurs of a plan, as predicted from the current settings. The third harmonic at the output is assumed to be
+// of the order of the one added to cancel it.
+spur_risk_t synth::predict_plan_spurs(uint32_t periods, uint32_t words)
+{
+  double harmonic_dbc = (hd3_amplitude > 0 && amplitude > 0) ? 20*log10(hd3_amplitude/amplitude) : -60;
+  return predict_spurs(periods, words, CPU_freq_actual, amplitude, mode == 3 || mode == 5,
+                       (mode >= 2) ? dither_amplitude : 0, plan_passband_hz, harmonic_dbc);
+}
+
+
+// The plans just below and just above the frequency, each repeated up to max_words, and the fraction of the
+// passes from the upper one that makes the phase drift of the passes cancel out
+void synth::plan_fine(uint32_t max_denominator)
+{
+  rational_t below, above;
+  double x = frequency * 16.0 / (double)CPU_freq_actual;  // Periods per word
+
+  farey_neighbours(x, max_denominator, &below, &above);
+  int mult = max(1, max_words/(int)below.denominator);
+  n_words = below.denominator*mult;
+  n_periods = below.numerator*mult;
+  mult = max(1, max_words/(int)above.denominator);
+  fine_words = above.denominator*mult;
+  fine_periods = above.numerator*mult;
+  for(int kk = 0; kk < max_tones; kk++) {
+    tone_periods[kk] = 0;
+  }
+  // Cycles that a pass lags or gains on the ideal carrier
+  double lag = x*n_words - n_periods;
+  double gain = fine_periods - x*fine_words;
+  if(lag + gain > 0) {
+    fine_plan_step = (uint32_t)min(llround(lag/(lag + gain)*4294967296.0), 4294967295ll);
+  }
+  Serial.print("Fine tuning plans: ");
+  Serial.print(n_periods);
+  Serial.print("/");
+  Serial.print(n_words);
+  Serial.print(" and ");
+  Serial.print(fine_periods);
+  Serial.print("/");
+  Serial.print(fine_words);
+  Serial.print(", upper fraction ");
+  Serial.println(fine_plan_step/4294967296.0, 6);
+}
+
+
+// Fine tuning needs the main buffer to be played as it is, not as runs, blocks, bank levels or copies
+bool synth::fine_possible()
+{
+  bool compress = (compressed_max_words > 0 && mode <= 3);
+  return fine_tuning && mode >= 1 && mode <= 5 && !compress && !(rle && mode <= 3) && n_bank == 0 &&
+         !tones_active() && n_extra_outputs == 0 && !hiz_zeros();
+}
+
+
+bool synth::is_fine_tuned()
+{
+  return fine_active;
+}
+
+
+// Fraction of the main passes played from the upper plan
+double synth::get_fine_fraction()
+{
+  return fine_active ? fine_step/4294967296.0 : 0;
+}
+
+
+// Joint plan of the carrier and the tones: the number of words, at most max_denominator, for which the
+// worst of their frequency errors is the smallest, with a whole number of periods of each in the buffer.
+// Of equally good plans the shortest is taken.
+void synth::plan_tones(uint32_t max_denominator)
+{
+  double best_err = INFINITY;
+  uint32_t best_n = 1;
+
+  for(uint32_t n = 1; n <= max_denominator; n++) {
+    double scale = 16.0*n/CPU_freq_actual;
+    double p = round(frequency*scale);
+    double err = (p < 1) ? INFINITY : fabs(frequency - p/scale);
+    for(int kk = 0; kk < n_tones && err < best_err; kk++) {
+      p = round(tone_frequency[kk]*scale);
+      err = fmax(err, (p < 1) ? INFINITY : fabs(tone_frequency[kk] - p/scale));
+    }
+    if(err < best_err*(1 - 1e-9)) {
+      best_err = err;
+      best_n = n;
+    }
+  }
+  n_words = best_n;
+  n_periods = lround(frequency*16.0*best_n/CPU_freq_actual);
+  for(int kk = 0; kk < max_tones; kk++) {
+    tone_periods[kk] = (kk < n_tones) ? lround(tone_frequency[kk]*16.0*best_n/CPU_freq_actual) : 0;
+  }
+  Serial.print("Worst tone frequency error (Hz): ");
+  Serial.println(best_err, 3);
+}
+
+
+// Plan the half-periods of mode 6. The half-period in clocks is approximated by N + p/q with q up to the
+// pattern length, and the p long half-periods are spread evenly over the q in the pattern, which makes the
+// edges deviate less than a clock from the ideal ones. The reload of the pattern lengthens the first
+// half-period, so the pattern starts with a long one and N + p/q is taken with p from 1 to q.
+void synth::plan_fracn()
+{
+  double half = CPU_freq_actual/(2.0*frequency);
+  rational_t frac = rational_approximation(half - floor(half), fracn_max_len);
+  uint32_t q = frac.denominator;
+  uint32_t n = (uint32_t)floor(half) + frac.numerator/q;
+  uint32_t p = frac.numerator % q;
+  uint32_t bit;
+  double err = 0, err_min = 0, err_max = 0;
+
+  if(p == 0) {
+    // A whole number of clocks, the reload still takes one
+    n--;
+    p = q;
+  }
+  if(n < fracn_min_half) {
+    Serial.println("Frequency too high for mode 6");
+    n = fracn_min_half;
+    p = 1;
+    q = 1;
+  }
+  fracn_half = n;
+  fracn_long = p;
+  fracn_len = q;
+  fracn_pattern = 0;
+  for(uint32_t ii = 0; ii < q; ii++) {
+    // Half-period ii of the pattern is the long one that ends position ii-1 of the Bresenham sequence
+    uint32_t jj = (ii + q - 1) % q;
+    bit = ((jj + 1)*p)/q - (jj*p)/q;
+    if(ii > 0 && bit) {
+      fracn_pattern |= 1u << ii;
+    }
+    err += bit - p/(double)q;
+    err_min = min(err_min, err);
+    err_max = max(err_max, err);
+  }
+  fracn_jitter = err_max - err_min;
+}
+
+
+// Whether fill_main_buffers() uses the pattern table in the sigma-delta modes
+bool synth::pattern_kernel()
+{
+  return pattern_synthesis && transition_penalty == 0 && !tones_active() && n_bank_active == 0;
+}
+
+
+// Fill the main buffer, and the ramps in modes 4 and 5, with the generator that fits the settings
+void synth::fill_main_buffers(bool ramps_only)
+{
+  if(mode == 1) {
+    fill_synth_buffer_compare();
+  } else if(n_bank_active > 0) {
+    // The bank levels share the samples, the taper gains and the dither of the fixed point kernel
+    fill_synth_buffer_sigma_delta_fixed(mode == 3 || mode == 5, ramps_only);
+  } else if(pattern_kernel()) {
+    // The pattern table does not know the previous output, which the transition penalty needs,
+    // nor the tones
+    fill_synth_buffer_pattern(ramps_only);
+  } else if(sd_kernel == SD_KERNEL_FIXED) {
+    fill_synth_buffer_sigma_delta_fixed(mode == 3 || mode == 5, ramps_only);
+  } else if(mode == 2 or mode == 4) {
+    fill_synth_buffer_sigma_delta(ramps_only);
+  } else {
+    fill_synth_buffer_sigma_delta_3s(ramps_only);
+  }
+}
+
+
+// Record that a stage of the calculation has run, from start_time until now
+void synth::end_stage(int stage, uint32_t start_time)
+{
+  stage_time_us[stage] = micros() - start_time;
+  stages_run |= 1u << stage;
+}
+
+
+// (Re)calculate the buffers, but only the stages that the changed settings affect
+void synth::calculate_buffers()
+{
+  Serial.println("Calculating buffers...");
+
+  uint32_t start_time = micros();
+  uint32_t stage_start;
+  // The compressed buffer is generated without the tones
+  bool compress = (compressed_max_words > 0 && mode >= 1 && mode <= 3 && !tones_active());
+
+  stages_run = 0;
+  for(int ii = 0; ii < N_STAGES; ii++) {
+    stage_time_us[ii] = 0;
+  }
+  if((compress || compressed_active) && (dirty & (DIRTY_PLAN | DIRTY_MAIN))) {
+    // Compression plans the buffers itself and uses the ramp buffers as scratch memory
+    dirty |= DIRTY_PLAN | DIRTY_MAIN;
+  }
+  if((fine_tuning || plan_tolerance_hz > 0) && (dirty & (DIRTY_MAIN | DIRTY_EXTRA))) {
+    // Several settings decide whether fine tuning is possible, and the ranking of the plans
+    dirty |= DIRTY_PLAN;
+  }
+  if(mode < 4) {
+    // The ramps are derived from the main buffer
+    dirty &= ~DIRTY_RAMPS;
+  } else if(dirty & DIRTY_MAIN) {
+    dirty |= DIRTY_RAMPS;
+  }
+
+  if(dirty & DIRTY_SILENT) {
+    stage_start = micros();
+    fill_synth_buffer_silent();
+    end_stage(STAGE_SILENT, stage_start);
+  }
+  if((dirty & DIRTY_PLAN) && !compress) {
+    int old_words = n_words, old_periods = n_periods;
+    int old_fine_words = fine_words, old_fine_periods = fine_periods;
+    stage_start = micros();
+    plan_buffers(min(max_words, max_words_limit));
+    end_stage(STAGE_PLAN, stage_start);
+    // A retune within the same pair of fine tuning plans only changes the step
+    if(n_words != old_words || n_periods != old_periods || compressed_active || (fine_plan_step != 0) != fine_active ||
+       (fine_active && (fine_words != old_fine_words || fine_periods != old_fine_periods))) {
+      dirty |= (mode >= 4) ? DIRTY_MAIN | DIRTY_RAMPS : DIRTY_MAIN;
+    }
+    fine_step = fine_plan_step;
+  }
+
+  if(dirty & (DIRTY_MAIN | DIRTY_RAMPS)) {
+    // The main buffer and the ramps are calculated in the same pass, as they share the dither
+    bool ramps_only = !(dirty & DIRTY_MAIN);
+    stage_start = micros();
+    srand(dither_seed);
+    compressed_active = false;
+    rle_active = false;
+    alloc_bank();
+    bool fine = (fine_plan_step != 0 && !compress);
+    if(fine && !fine_buffer) {
+      fine_buffer = new (std::nothrow) uint32_t[max_words];
+    }
+    fine_active = (fine && fine_buffer);
+    if(fine && !fine_buffer) {
+      Serial.println("Not enough memory for fine tuning");
+    }
+    if(compress) {
+      // Try a long buffer, compressed. Shorter buffers are more likely to fit.
+      for(int max_len = compressed_max_words; max_len > max_words && !compressed_active; max_len /= 2) {
+        plan_buffers(max_len);
+        compressed_active = compress_main_buffer();
+      }
+      if(compressed_active) {
+        Serial.print("Dictionary words: ");
+        Serial.print(dict_words);
+        Serial.print(", blocks: ");
+        Serial.println(n_blocks);
+      } else {
+        Serial.println("Could not compress the buffer, using a normal buffer");
+      }
+    }
+    if(!compressed_active) {
+      // Compressed buffers are not cached, nor the normal buffers used when compression fails, nor the bank
+      // or the upper fine tuning plan
+      bool cacheable = (cache_size > 0 && !compress && n_bank_active == 0 && !fine_active);
+      buffer_settings_t settings;
+      uint64_t key = 0;
+      if(cacheable) {
+        get_buffer_settings(&settings);
+        key = buffer_key(&settings);
+      }
+      if(compress) {
+        plan_buffers(min(max_words, max_words_limit));
+      }
+      if(cacheable && load_cached_buffers(key, &settings)) {
+        Serial.println("Using cached buffers");
+      } else {
+        if(fine_active && !ramps_only) {
+          // The upper plan first, the ramps are only played from the lower one
+          int lower_words = n_words, lower_periods = n_periods;
+          n_words = fine_words;
+          n_periods = fine_periods;
+          fill_main_buffers(false);
+          memcpy(fine_buffer, synth_buffer, n_words*sizeof(uint32_t));
+          n_words = lower_words;
+          n_periods = lower_periods;
+        }
+        fill_main_buffers(ramps_only);
+        if(cacheable) {
+          store_cached_buffers(key, &settings);
+        }
+      }
+    }
+    if(!ramps_only) {
+      main_transitions = compressed_active ? 0 : count_transitions(synth_buffer, n_words);
+      plan_risk = predict_plan_spurs(n_periods, n_words);
+    }
+    if(rle && !compressed_active && mode >= 1 && mode <= 3) {
+      rle_active = encode_rle();
+      if(rle_active) {
+        Serial.print("RLE words: ");
+        Serial.println(rle_words);
+      } else {
+        Serial.println("Could not run-length encode the buffer, using a normal buffer");
+      }
+    }
+    if(!ramps_only && hiz_zeros() && !compressed_active && !rle_active) {
+      main_transitions = lround(count_transitions_hiz(synth_buffer, n_words));
+    }
+    end_stage(ramps_only ? STAGE_RAMPS : STAGE_MAIN, stage_start);
+    // The extra outputs are rotated copies of the main buffer
+    dirty |= ramps_only ? DIRTY_CRC : DIRTY_CRC | DIRTY_EXTRA;
+  }
+  if((dirty & DIRTY_CRC) && crc_check && !compressed_active) {
+    stage_start = micros();
+    calculate_crcs();
+    end_stage(STAGE_CRC, stage_start);
+  }
+  if(dirty & DIRTY_EXTRA) {
+    stage_start = micros();
+    fill_extra_buffers();
+    end_stage(STAGE_EXTRA, stage_start);
+  }
+  calculation_time_us = micros() - start_time;
+  Serial.print("Calculation time (ms): ");
+  Serial.println(calculation_time_us/1000.0);
+  dirty = 0;
+}
+
+
+// Apply the frequency, mode etc settings, i.e. calculate new waveforms based on the settings.
+// But only if necessary;
+void synth::apply_settings()
+{
+  if(!dirty) {
+    return;
+  }
+  trace_event(TRACE_RECALC_BEGIN, mode);
+  // Keep core 1 away from the buffers while they are recalculated
+  hold_refresh();
+  stop_extra_outputs();
+  stop_hiz();
+  leave_park();
+  if(synth_dma < 1000) {
+    Serial.println("Waiting for DMAs to stop...");
+    stop_dma_chain();
+  }
+
+  remove_pio_program();
+  if(mode == 0) {
+    add_pio_program(&toggle_program);
+    float clkdiv = CPU_freq_actual/(2.0*frequency);
+    toggle_program_init(pio, sm, pio_prog_offset, m_first_rf_pin, clkdiv);
+  } else if(mode == 6) {
+    plan_fracn();
+    add_pio_program(&pio_fracn_program);
+    pio_fracn_program_init(pio, sm, pio_prog_offset, m_first_rf_pin, fracn_half - fracn_min_half, fracn_pattern,
+                           fracn_len);
+    pio_sm_set_consecutive_pindirs(pio, sm, m_first_rf_pin, 2, enable_transmit);
+  } else {
+    calculate_buffers();
+    Serial.println("Adding PIO program...");
+    add_serialiser_program();
+    // Restart the DMAs
+    Serial.println("Restarting DMAs");
+    setup_dma();
+  }
+  refresh_restart = true;
+  release_refresh();
+  trace_event(TRACE_RECALC_END, calculation_time_us);
+  PrintStatus();
+}
+
+
+// Stop the main DMA chain and release its channels
+void synth::stop_dma_chain()
+{
+  // dma_channel_abort does not seem to work for chained DMAs
+  // Write zeros to the control registers as recommended here:
+  // (https://forums.raspberrypi.com/viewtopic.php?t=330119)
+  // https://forums.raspberrypi.com/viewtopic.php?t=337439
+  hw_clear_bits(&dma_hw->ch[synth_dma].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+  hw_clear_bits(&dma_hw->ch[restart_dma].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+  if(capture_dma < 1000) {
+    hw_clear_bits(&dma_hw->ch[capture_dma].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    hw_clear_bits(&dma_hw->ch[seed_dma].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    dma_channel_abort(capture_dma);
+    dma_channel_abort(seed_dma);
+  }
+  do {
+    // This loop might not be necessary
+    dma_channel_abort(synth_dma);
+    dma_channel_abort(restart_dma);
+  } while(dma_channel_is_busy(synth_dma) || dma_channel_is_busy(restart_dma));
+  // Drop an interrupt that came in while stopping, the handler must not see the released channels
+  dma_hw->ints0 = 1u << restart_dma;
+  unclaim_dma();
+}
+
+
+// The serialiser that plays the buffers, decoding runs if they are run-length encoded. With high
+// impedance zeros, the directions program goes first as it must be at address 0.
+void synth::add_serialiser_program()
+{
+  hiz_active = (hiz_zeros() && !compressed_active && !rle_active);
+  if(hiz_active && !pio_can_add_program(pio, &pio_hiz_dirs_program)) {
+    Serial.println("No room for the high impedance zero program at address 0");
+    hiz_active = false;
+  }
+  if(hiz_active) {
+    pio_add_program(pio, &pio_hiz_dirs_program);
+    add_pio_program(&pio_hiz_pins_program);
+    pio_hiz_pins_program_init(pio, sm, pio_prog_offset, m_first_rf_pin);
+  } else if(rle_active) {
+    add_pio_program(&pio_rle_program);
+    pio_rle_program_init(pio, sm, pio_prog_offset, m_first_rf_pin, 1.0);
+  } else {
+    add_pio_program(&pio_serialiser_program);
+    pio_serialiser_program_init(pio, sm, pio_prog_offset, m_first_rf_pin, 1.0);
+  }
+}
+
+
+void synth::remove_pio_program()
+{
+  if(pio_program != NULL) {
+    pio_remove_program(pio, pio_program, pio_prog_offset);
+    pio_sm_unclaim(pio, sm);
+  }
+  pio_program = NULL;
+}
+
+
+void synth::add_pio_program(const pio_program_t *prog)
+{
+  pio_program = prog;
+  pio_prog_offset = pio_add_program(pio, pio_program);
+  sm = pio_claim_unused_sm(pio, true);
+  // Need to call the correct PIO init function after this function has been called.
+}
+
+
+synth::synth(const uint8_t first_rf_pin, double frequency_a)
+{
+  m_first_rf_pin = first_rf_pin;
+  frequency = frequency_a;
+  dither_amplitude = 1.0;
+  dither_seed = 1;
+  dither_shape = DITHER_WHITE;
+  max_words_limit = max_words;
+  amplitude = 1.0;
+  hd3_amplitude = 0.045;
+  hd3_phase_rad = -35.0 * M_PI/180.0;
+  taper_shape = TAPER_RAISED_COSINE;
+  fill_taper_table(taper_shape, taper_table);
+  mode = 5;
+  pattern_synthesis = false;
+  pattern_words = NULL;
+  pattern_info = NULL;
+  calculation_time_us = 0;
+  compressed_max_words = 0;
+  dict_words = 0;
+  n_blocks = 0;
+  rle = false;
+  rle_words = 0;
+  fracn_half = 0;
+  fracn_long = 0;
+  fracn_len = 1;
+  fracn_pattern = 0;
+  fracn_jitter = 0;
+  for(int ii = 0; ii < max_cached_sets; ii++) {
+    cache[ii].words = NULL;
+  }
+  cache_size = 0;
+  cache_bytes = 0;
+  cache_hits = 0;
+  cache_lookups = 0;
+  cache_clock = 0;
+  crc_check = true;
+  sine_method = SINE_EXACT;
+  sd_kernel = SD_KERNEL_DOUBLE;
+  zero_mode = ZERO_TOGGLE;
+  transition_penalty = 0;
+  refresh = false;
+  key_down_us = 0;
+  key_down_since = 0;
+  key_up_since = 0;
+  park = false;
+  park_delay_ms = 20;
+  park_clock_khz = 0;
+  park_slow_after_ms = 1000;
+  parked = false;
+  slowed = false;
+  saved_clock_khz = 0;
+  parked_us = 0;
+  parked_since = 0;
+  slow_us = 0;
+  slow_since = 0;
+  n_parks = 0;
+  n_wakes = 0;
+  wake_total_us = 0;
+  wake_max_us = 0;
+  main_transitions = 0;
+  n_extra_outputs = 0;
+  n_bank = 0;
+  for(int kk = 0; kk < max_bank_levels; kk++) {
+    bank_amplitude[kk] = 0.5/(kk + 1);
+  }
+  fine_tuning = false;
+  fine_plan_step = 0;
+  fine_words = 0;
+  fine_periods = 0;
+  plan_tolerance_hz = 0;
+  plan_passband_hz = 200e3;
+  plan_risk = predict_spurs(0, 1, 1, 0, false, 0, 0, 0);
+  plan_candidates = 0;
+  n_tones = 0;
+  for(int kk = 0; kk < max_tones; kk++) {
+    tone_frequency[kk] = frequency_a + 1000.0*(kk + 1);
+    tone_amplitude[kk] = 0;
+    tone_phase_rad[kk] = 0;
+    tone_periods[kk] = 0;
+  }
+  for(int kk = 0; kk < max_extra_outputs; kk++) {
+    extra_phase_deg[kk] = 90.0*(kk + 1);
+    extra_phase_actual[kk] = 0;
+    extra_shift[kk] = 0;
+  }
+  n_words = max_words; // Dummy value for now
+  n_periods = 0;
+  stages_run = 0;
+  dirty = DIRTY_ALL;
+
+  calculate_buffers();
+
+  // The PIO contains a very simple program that waits for a pin to go high
+  // then repeatedly reads a 32-bit word from the FIFO and sends 2 bits per 
+  // clock to two IO pins.
+  add_serialiser_program();
+  setup_dma();
+}
+
+
+void synth::setup_dma()
+{
+  if(compressed_active) {
+    setup_compressed_dma();
+    return;
+  }
+  // Configure DMA from memory to PIO SM TX FIFO
+  synth_dma = dma_claim_unused_channel(true);
+  restart_dma = dma_claim_unused_channel(true);
+  synth_dma_cfg = dma_channel_get_default_config(synth_dma);
+  channel_config_set_transfer_data_size(&synth_dma_cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&synth_dma_cfg, true);
+  channel_config_set_write_increment(&synth_dma_cfg, false);
+  channel_config_set_dreq(&synth_dma_cfg, pio_get_dreq(pio, sm, true)); // Do a DMA transfer each time the PIO FIFO requests it
+  channel_config_set_chain_to(&synth_dma_cfg, restart_dma);
+  crc_active = false;
+  if(crc_check) {
+    setup_crc_dma();
+  }
+  // The RLE serialiser plays the encoded main buffer and silence, which are in the ramp buffers
+  synth_buffer_ptr[0] = rle_active ? synth_buffer_ramp_up : synth_buffer;
+  synth_buffer_silent_ptr[0] = rle_active ? synth_buffer_ramp_down : synth_buffer_silent;
+  // Start from the ramp-up of the requested level
+  level_playing = (n_bank_active > 0) ? level_requested : 0;
+  level_queued = level_playing;
+  level_started = 0;
+  synth_buffer_ramp_up_ptr[0] = level_buffers[level_playing][CRC_RAMP_UP];
+  synth_buffer_ramp_down_ptr[0] = level_buffers[level_playing][CRC_RAMP_DOWN];
+  fine_acc = 0;
+  fine_queued = false;
+  fine_started = false;
+  if(fine_active) {
+    for(int bb = 0; bb < CRC_NONE; bb++) {
+      fine_desc[bb].transfer_count = n_words;
+      fine_desc[bb].read_addr = buffer_ptrs[bb][0];
+    }
+    fine_desc[CRC_NONE].transfer_count = fine_words;
+    fine_desc[CRC_NONE].read_addr = fine_buffer;
+  }
+  // Write to the SM TX FIFO, provide the buffer address, n_words x 32 bit transfers, do not yet start
+  dma_channel_configure(synth_dma, &synth_dma_cfg, &pio->txf[sm], synth_buffer, rle_active ? rle_words : n_words, false);
+
+  // Use a second DMA to reconfigure the first
   restart_dma_cfg = dma_channel_get_default_config(restart_dma);
   channel_config_set_transfer_data_size(&restart_dma_cfg, DMA_SIZE_32);
   channel_config_set_read_increment(&restart_dma_cfg, true); // increment the read address, needed for the DMA handler to have proper effect
@@ -534,8 +2632,618 @@ void synth::setup_dma()
   dma_channel_set_irq0_enabled(restart_dma, true);
   irq_set_exclusive_handler(DMA_IRQ_0, dma_irq_handler); 
   irq_set_enabled(DMA_IRQ_0, true);
+  crc_queued = CRC_RAMP_UP;
+  crc_started = CRC_NONE;
+  silent_queued = false;
+  silent_playing = false;
+  if(n_extra_active > 0) {
+    // Hold the main SM until all outputs have data
+    pio_sm_set_enabled(pio, sm, false);
+    setup_extra_dma();
+  }
+  if(hiz_active) {
+    setup_hiz_dma();
+  }
+  if(fine_active) {
+    // Write the transfer count and the read pointer, which follow each other, the ring takes the write address
+    // back to the transfer count
+    channel_config_set_write_increment(&restart_dma_cfg, true);
+    channel_config_set_ring(&restart_dma_cfg, true, 3);
+    dma_channel_configure(restart_dma, &restart_dma_cfg, &dma_hw->ch[synth_dma].al3_transfer_count,
+                          &fine_desc[CRC_RAMP_UP], 2, true);
+    return;
+  }
   // Write to the DMA read pointer, provide the buffer address, 2 words x 32 bit, start
   dma_channel_configure(restart_dma, &restart_dma_cfg, &dma_hw->ch[synth_dma].al3_read_addr_trig, synth_buffer_ramp_up_ptr, 1, true);  
+  if(n_extra_active > 0 || hiz_active) {
+    // Start all SMs on the same clock cycle once the DMAs have filled their FIFOs
+    uint32_t sm_mask = 1u << sm;
+    for(int kk = 0; kk < n_extra_active; kk++) {
+      sm_mask |= 1u << extra_sm[kk];
+    }
+    if(hiz_active) {
+      sm_mask |= 1u << hiz_sm;
+    }
+    for(int spin = 0; spin < 1000; spin++) {
+      bool full = pio_sm_is_tx_fifo_full(pio, sm);
+      for(int kk = 0; kk < n_extra_active; kk++) {
+        full = full && pio_sm_is_tx_fifo_full(pio, extra_sm[kk]);
+      }
+      if(hiz_active) {
+        full = full && pio_sm_is_tx_fifo_full(pio, hiz_sm);
+      }
+      if(full) {
+        break;
+      }
+    }
+    pio_enable_sm_mask_in_sync(pio, sm_mask);
+  }
+}
+
+
+// Check once that the DMA sniffer calculates the same CRC as sniff_crc32(), with a memory to memory transfer
+static bool sniffer_matches_model()
+{
+  static const uint32_t test_words[4] = {0x12345678, 0x9abcdef0, 0x55555555, 0x0000ffff};
+  static uint32_t sink;
+  uint32_t ch = dma_claim_unused_channel(true);
+  dma_channel_config cfg = dma_channel_get_default_config(ch);
+  channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg, true);
+  channel_config_set_write_increment(&cfg, false);
+  channel_config_set_sniff_enable(&cfg, true);
+  dma_sniffer_enable(ch, DMA_SNIFF_CTRL_CALC_VALUE_CRC32, true);
+  dma_sniffer_set_data_accumulator(crc_seed);
+  dma_channel_configure(ch, &cfg, &sink, test_words, 4, true);
+  dma_channel_wait_for_finish_blocking(ch);
+  uint32_t crc = dma_sniffer_get_data_accumulator();
+  dma_sniffer_disable();
+  dma_channel_unclaim(ch);
+  return crc == sniff_crc32(crc_seed, test_words, 4);
+}
+
+
+// The CRCs that the sniffer should find for each buffer
+void synth::calculate_crcs()
+{
+  if(rle_active) {
+    crc_expected[CRC_SILENT] = sniff_crc32(crc_seed, synth_buffer_ramp_down, rle_words);
+    crc_expected[CRC_RAMP_UP] = sniff_crc32(crc_seed, synth_buffer_ramp_up, rle_words);
+    crc_expected[CRC_MAIN] = crc_expected[CRC_RAMP_UP];
+    crc_expected[CRC_RAMP_DOWN] = crc_expected[CRC_SILENT];
+    return;
+  }
+  crc_expected[CRC_SILENT] = sniff_crc32(crc_seed, synth_buffer_silent, n_words);
+  crc_expected[CRC_RAMP_UP] = sniff_crc32(crc_seed, synth_buffer_ramp_up, n_words);
+  crc_expected[CRC_MAIN] = sniff_crc32(crc_seed, synth_buffer, n_words);
+  if(fine_active) {
+    fine_crc = sniff_crc32(crc_seed, fine_buffer, fine_words);
+  }
+  crc_expected[CRC_RAMP_DOWN] = sniff_crc32(crc_seed, synth_buffer_ramp_down, n_words);
+  for(int kk = 1; kk <= n_bank_active; kk++) {
+    for(int bb = 0; bb < CRC_NONE; bb++) {
+      bank_crc[kk][bb] = sniff_crc32(crc_seed, level_buffers[kk][bb], n_words);
+    }
+  }
+}
+
+
+// Let the synth DMA feed the sniffer and chain to two more DMAs that copy the CRC of the pass
+// and reset the sniffer before the restart DMA starts the next pass.
+// Must be called after synth_dma_cfg has been set up, but before it is used.
+void synth::setup_crc_dma()
+{
+  dma_channel_config cfg;
+
+  if(sniffer_ok < 0) {
+    sniffer_ok = sniffer_matches_model();
+    if(!sniffer_ok) {
+      Serial.println("The DMA sniffer does not match the CRC model, buffers will not be checked");
+    }
+  }
+  if(!sniffer_ok) {
+    return;
+  }
+  capture_dma = dma_claim_unused_channel(true);
+  seed_dma = dma_claim_unused_channel(true);
+
+  cfg = dma_channel_get_default_config(capture_dma);
+  channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg, false);
+  channel_config_set_write_increment(&cfg, false);
+  channel_config_set_chain_to(&cfg, seed_dma);
+  dma_channel_configure(capture_dma, &cfg, &crc_captured, &dma_hw->sniff_data, 1, false);
+
+  cfg = dma_channel_get_default_config(seed_dma);
+  channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg, false);
+  channel_config_set_write_increment(&cfg, false);
+  channel_config_set_chain_to(&cfg, restart_dma);
+  dma_channel_configure(seed_dma, &cfg, &dma_hw->sniff_data, &crc_seed, 1, false);
+
+  channel_config_set_sniff_enable(&synth_dma_cfg, true);
+  channel_config_set_chain_to(&synth_dma_cfg, capture_dma);
+  dma_sniffer_enable(synth_dma, DMA_SNIFF_CTRL_CALC_VALUE_CRC32, true);
+  dma_sniffer_set_data_accumulator(crc_seed);
+  crc_active = true;
+}
+
+
+bool synth::is_crc_checking()
+{
+  return crc_active;
+}
+
+
+uint32_t synth::get_crc_checks()
+{
+  return crc_checks;
+}
+
+
+uint32_t synth::get_crc_errors()
+{
+  return crc_errors;
+}
+
+
+// Fill the buffers of the extra outputs with the main buffer, rotated to get the requested phases.
+// The phases that can be reached are multiples of 360*gcd(n_periods, 16*n_words)/(16*n_words) degrees.
+// The extra outputs are only available in the modes without ramps, and not with a compressed buffer,
+// high impedance zeros or the amplitude bank.
+void synth::fill_extra_buffers()
+{
+  n_extra_active = 0;
+  if(mode < 1 || mode > 3 || compressed_active || rle_active || hiz_zeros() || n_bank_active > 0) {
+    return;
+  }
+  for(int kk = 0; kk < n_extra_outputs; kk++) {
+    if(extra_buffer[kk] == NULL) {
+      extra_buffer[kk] = new (std::nothrow) uint32_t[max_words];
+      if(extra_buffer[kk] == NULL) {
+        Serial.println("Not enough memory for the extra outputs");
+        return;
+      }
+    }
+    extra_shift[kk] = phase_rotation(n_periods, 16*(int64_t)n_words, extra_phase_deg[kk], &extra_phase_actual[kk]);
+    sd_rotate(synth_buffer, extra_buffer[kk], n_words, extra_shift[kk]);
+    extra_buffer_ptr[kk][0] = extra_buffer[kk];
+    n_extra_active = kk + 1;
+  }
+}
+
+
+int synth::get_active_extra_outputs()
+{
+  return n_extra_active;
+}
+
+
+// Allocate the buffers of the bank levels for the current plan and point the levels to them. The levels
+// that do not fit in memory are dropped, and the memory of the levels no longer requested is freed.
+// Returns false if no level is active.
+bool synth::alloc_bank()
+{
+  int words = (mode >= 4 ? 3 : 1)*n_words;
+
+  // Not with a compressed or run-length encoded main buffer, which the levels could not follow
+  bool possible = (mode >= 2 && mode <= 5 && compressed_max_words == 0 && !(rle && mode <= 3));
+
+  n_bank_active = 0;
+  for(int kk = 0; kk < max_bank_levels; kk++) {
+    bool wanted = (possible && kk < n_bank);
+    if(!wanted || bank_alloc_words[kk] < words) {
+      delete [] bank_buffer[kk];
+      bank_buffer[kk] = NULL;
+      bank_alloc_words[kk] = 0;
+    }
+    if(!wanted) {
+      continue;
+    }
+    if(bank_buffer[kk] == NULL) {
+      bank_buffer[kk] = new (std::nothrow) uint32_t[words];
+      if(bank_buffer[kk] == NULL) {
+        Serial.print("Not enough memory for bank level ");
+        Serial.println(kk + 1);
+        continue;
+      }
+      bank_alloc_words[kk] = words;
+    }
+    if(n_bank_active == kk) {
+      uint32_t *b = bank_buffer[kk];
+      level_buffers[kk + 1][CRC_SILENT] = synth_buffer_silent;
+      level_buffers[kk + 1][CRC_MAIN] = b;
+      level_buffers[kk + 1][CRC_RAMP_UP] = (mode >= 4) ? b + n_words : b;
+      level_buffers[kk + 1][CRC_RAMP_DOWN] = (mode >= 4) ? b + 2*n_words : synth_buffer_ramp_down;
+      n_bank_active = kk + 1;
+    }
+  }
+  if(level_requested > n_bank_active) {
+    level_requested = 0;
+  }
+  return n_bank_active > 0;
+}
+
+
+int synth::get_active_bank_levels()
+{
+  return n_bank_active;
+}
+
+
+// Memory used by each bank level
+int synth::get_bank_level_bytes()
+{
+  return (mode >= 4 ? 3 : 1)*n_words*sizeof(uint32_t);
+}
+
+
+// Play the main amplitude (0) or a bank level (1 and up) from the next pass through the ramp-up or the
+// main buffer
+void synth::set_level(int k)
+{
+  level_requested = (k >= 0 && k <= n_bank_active) ? k : 0;
+}
+
+
+int synth::get_level()
+{
+  return level_requested;
+}
+
+
+// Set up an SM and a pair of DMAs for each extra output, in the same way as for the main output,
+// and start the DMAs. The SMs are left disabled so that they can be started together with the main SM.
+void synth::setup_extra_dma()
+{
+  dma_channel_config cfg;
+
+  for(int kk = 0; kk < n_extra_active; kk++) {
+    extra_sm[kk] = pio_claim_unused_sm(pio, true);
+    pio_serialiser_program_init(pio, extra_sm[kk], pio_prog_offset, extra_output_pins[kk], 1.0);
+    pio_sm_set_enabled(pio, extra_sm[kk], false);
+    extra_synth_dma[kk] = dma_claim_unused_channel(true);
+    extra_restart_dma[kk] = dma_claim_unused_channel(true);
+
+    cfg = dma_channel_get_default_config(extra_synth_dma[kk]);
+    channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+    channel_config_set_read_increment(&cfg, true);
+    channel_config_set_write_increment(&cfg, false);
+    channel_config_set_dreq(&cfg, pio_get_dreq(pio, extra_sm[kk], true));
+    channel_config_set_chain_to(&cfg, extra_restart_dma[kk]);
+    dma_channel_configure(extra_synth_dma[kk], &cfg, &pio->txf[extra_sm[kk]], extra_buffer[kk], n_words, false);
+
+    // The first pass from slot 0, the interrupt handler fills slot 1 when the main output starts
+    cfg = dma_channel_get_default_config(extra_restart_dma[kk]);
+    channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+    channel_config_set_read_increment(&cfg, true);
+    channel_config_set_write_increment(&cfg, false);
+    channel_config_set_ring(&cfg, false, 3);
+    extra_ring[kk][0] = extra_buffer_ptr[kk][0];
+    extra_ring[kk][1] = extra_buffer_ptr[kk][0];
+    dma_channel_configure(extra_restart_dma[kk], &cfg, &dma_hw->ch[extra_synth_dma[kk]].al3_read_addr_trig, 
+                          extra_ring[kk], 1, true);
+  }
+  secondary_slot = 1;
+}
+
+
+// Stop the DMAs and SMs of the extra outputs and let go of their pins
+void synth::stop_extra_outputs()
+{
+  int n = n_extra_active;
+  n_extra_active = 0;   // Keep the interrupt handler away
+  for(int kk = 0; kk < n; kk++) {
+    hw_clear_bits(&dma_hw->ch[extra_synth_dma[kk]].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    hw_clear_bits(&dma_hw->ch[extra_restart_dma[kk]].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    do {
+      dma_channel_abort(extra_synth_dma[kk]);
+      dma_channel_abort(extra_restart_dma[kk]);
+    } while(dma_channel_is_busy(extra_synth_dma[kk]) || dma_channel_is_busy(extra_restart_dma[kk]));
+    dma_channel_cleanup(extra_synth_dma[kk]);
+    dma_channel_cleanup(extra_restart_dma[kk]);
+    dma_channel_unclaim(extra_synth_dma[kk]);
+    dma_channel_unclaim(extra_restart_dma[kk]);
+    pio_sm_set_enabled(pio, extra_sm[kk], false);
+    pio_sm_unclaim(pio, extra_sm[kk]);
+    gpio_init(extra_output_pins[kk]);
+    gpio_init(extra_output_pins[kk] + 1);
+  }
+}
+
+
+// Set up the SM that sets the pin directions for high impedance zeros and its pair of DMAs, which play
+// the same buffers as the main ones. The SM is left disabled, to be started together with the main SM.
+void synth::setup_hiz_dma()
+{
+  dma_channel_config cfg;
+
+  hiz_sm = pio_claim_unused_sm(pio, true);
+  pio_hiz_dirs_program_init(pio, hiz_sm, 0, m_first_rf_pin);
+  hiz_synth_dma = dma_claim_unused_channel(true);
+  hiz_restart_dma = dma_claim_unused_channel(true);
+
+  cfg = dma_channel_get_default_config(hiz_synth_dma);
+  channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg, true);
+  channel_config_set_write_increment(&cfg, false);
+  channel_config_set_dreq(&cfg, pio_get_dreq(pio, hiz_sm, true));
+  channel_config_set_chain_to(&cfg, hiz_restart_dma);
+  dma_channel_configure(hiz_synth_dma, &cfg, &pio->txf[hiz_sm], synth_buffer, n_words, false);
+
+  // The first pass from slot 0, the ramp-up like the main output, and then from the ring like the extra outputs
+  cfg = dma_channel_get_default_config(hiz_restart_dma);
+  channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg, true);
+  channel_config_set_write_increment(&cfg, false);
+  channel_config_set_ring(&cfg, false, 3);
+  hiz_ring[0] = synth_buffer_ramp_up_ptr[0];
+  hiz_ring[1] = synth_buffer_ramp_up_ptr[0];
+  dma_channel_configure(hiz_restart_dma, &cfg, &dma_hw->ch[hiz_synth_dma].al3_read_addr_trig, hiz_ring, 1, true);
+  secondary_slot = 1;
+}
+
+
+// Stop the DMAs and the SM of the high impedance zeros and remove the directions program
+void synth::stop_hiz()
+{
+  if(!hiz_active) {
+    return;
+  }
+  hiz_active = false;   // Keep the interrupt handler away
+  if(!parked) {
+    stop_hiz_dma();
+  }
+  pio_remove_program(pio, &pio_hiz_dirs_program, 0);
+  // Drive the pins again, the next program may not set the directions
+  pio_sm_set_consecutive_pindirs(pio, sm, m_first_rf_pin, 2, true);
+}
+
+
+// Stop the DMAs of the high impedance zeros and release them and the SM. The pins keep the directions
+// that the SM last set.
+void synth::stop_hiz_dma()
+{
+  hw_clear_bits(&dma_hw->ch[hiz_synth_dma].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+  hw_clear_bits(&dma_hw->ch[hiz_restart_dma].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+  do {
+    dma_channel_abort(hiz_synth_dma);
+    dma_channel_abort(hiz_restart_dma);
+  } while(dma_channel_is_busy(hiz_synth_dma) || dma_channel_is_busy(hiz_restart_dma));
+  dma_channel_cleanup(hiz_synth_dma);
+  dma_channel_cleanup(hiz_restart_dma);
+  dma_channel_unclaim(hiz_synth_dma);
+  dma_channel_unclaim(hiz_restart_dma);
+  pio_sm_set_enabled(pio, hiz_sm, false);
+  pio_sm_unclaim(pio, hiz_sm);
+}
+
+
+// Parking. With the key up, the DMAs only stream the silent buffer, which keeps the bus and the PIO busy for
+// nothing. When the silent buffer has played for park_delay_ms, park_poll() stops the DMAs and the SMs and
+// leaves the pins at the zero level: both low, or high impedance with high impedance zeros. enable_output()
+// starts them again the way apply_settings() does, from the ramp-up, so the ramps and the carrier phase
+// are the same as after a recalculation and a key-down starts the ramp-up at once instead of at the end
+// of the pass through the silent buffer. Not with extra outputs or a compressed buffer.
+void synth::park_poll()
+{
+  uint64_t now = time_us_64();
+
+  if(parked) {
+    if(park_clock_khz > 0 && !slowed && now - parked_since >= 1000ull*park_slow_after_ms) {
+      // set_sys_clock_khz() also moves clk_peri to the new clock, put it back on pll_usb so that the
+      // peripherals keep a rate of their own. The timer counts the microsecond tick of clk_ref and USB has
+      // pll_usb, so park_slow_after_ms and the parked and slowed times need no correction. The cycle counts
+      // of the tracer and loopmon are off while slowed.
+      saved_clock_khz = clock_get_hz(clk_sys)/1000;
+      if(set_sys_clock_khz(park_clock_khz, false)) {
+        clock_configure(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB, 48*MHZ, 48*MHZ);
+        slowed = true;
+        slow_since = now;
+      } else {
+        Serial.println("The parking clock can not be reached");
+        park_clock_khz = 0;
+      }
+    }
+    return;
+  }
+  if(!park || enable_transmit || !uses_buffers() || compressed_active || n_extra_active > 0 || synth_dma >= 1000) {
+    return;
+  }
+  if(silent_playing && now - key_up_since >= 1000ull*park_delay_ms) {
+    park_outputs();
+  }
+}
+
+
+void synth::park_outputs()
+{
+  // Keep core 1 away from the DMA registers
+  hold_refresh();
+  stop_dma_chain();
+  if(hiz_active) {
+    stop_hiz_dma();
+  }
+  pio_sm_set_enabled(pio, sm, false);
+  dma_state = 0;
+  silent_queued = false;
+  silent_playing = false;
+  parked = true;
+  parked_since = time_us_64();
+  n_parks++;
+  trace_event(TRACE_PARK, 0);
+}
+
+
+// Restart the SM and the DMAs from the ramp-up. Called with enable_transmit set.
+void synth::wake_outputs()
+{
+  uint32_t start = time_us_32();
+
+  leave_park();
+  // Throw away the silence left in the FIFO and the OSR and start from the top of the program
+  pio_sm_clear_fifos(pio, sm);
+  pio_sm_restart(pio, sm);
+  pio_sm_exec(pio, sm, pio_encode_jmp(pio_prog_offset));
+  if(!hiz_active) {
+    // Otherwise setup_dma() starts the two SMs together
+    pio_sm_set_enabled(pio, sm, true);
+  }
+  dma_state = 1;
+  setup_dma();
+  release_refresh();
+  uint32_t wake_us = time_us_32() - start;
+  n_wakes++;
+  wake_total_us += wake_us;
+  wake_max_us = max(wake_max_us, wake_us);
+  trace_event(TRACE_WAKE, wake_us);
+}
+
+
+// Account for the parked time and go back to the full clock. The DMAs and SMs are left as they are.
+void synth::leave_park()
+{
+  if(!parked) {
+    return;
+  }
+  restore_clock();
+  parked_us += time_us_64() - parked_since;
+  parked = false;
+}
+
+
+void synth::restore_clock()
+{
+  if(!slowed) {
+    return;
+  }
+  // Puts clk_peri back on clk_sys too, where it was before
+  set_sys_clock_khz(saved_clock_khz, true);
+  slow_us += time_us_64() - slow_since;
+  slowed = false;
+}
+
+
+// Total time parked
+uint64_t synth::get_parked_us()
+{
+  if(parked) {
+    return parked_us + (time_us_64() - parked_since);
+  }
+  return parked_us;
+}
+
+
+// Total time at the parking clock
+uint64_t synth::get_slow_us()
+{
+  if(slowed) {
+    return slow_us + (time_us_64() - slow_since);
+  }
+  return slow_us;
+}
+
+
+uint32_t synth::get_key_edges()
+{
+  return key_edges;
+}
+
+
+// Delay from the key-down to the start of the ramp-up, in which the DMAs also fill the FIFO
+double synth::get_key_edge_avg_us()
+{
+  return key_edges ? (double)key_edge_total_us/key_edges : 0;
+}
+
+
+uint32_t synth::get_key_edge_max_us()
+{
+  return key_edge_max_us;
+}
+
+
+void synth::reset_park_stats()
+{
+  n_parks = 0;
+  n_wakes = 0;
+  wake_total_us = 0;
+  wake_max_us = 0;
+  key_edges = 0;
+  key_edge_total_us = 0;
+  key_edge_max_us = 0;
+}
+
+
+bool synth::is_hiz()
+{
+  return hiz_active;
+}
+
+
+// Set up the DMAs to play the compressed main buffer. The restart DMA writes one control block at a time
+// into the registers of the synth DMA (read address, write address, transfer count and control, which 
+// triggers it). The synth DMA then sends a run of words from the dictionary to the PIO and chains back
+// to the restart DMA to load the next block. The last block of a sequence makes the synth DMA copy the
+// address of the next sequence to the read address of the restart DMA and raise an interrupt, so that
+// the interrupt handler has a whole buffer period to decide what to play next.
+void synth::setup_compressed_dma()
+{
+  dma_channel_config cfg;
+  uint32_t data_ctrl, silent_ctrl, restart_ctrl;
+
+  synth_dma = dma_claim_unused_channel(true);
+  restart_dma = dma_claim_unused_channel(true);
+
+  // Control value for blocks that send dictionary words to the PIO, without interrupts
+  synth_dma_cfg = dma_channel_get_default_config(synth_dma);
+  channel_config_set_transfer_data_size(&synth_dma_cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&synth_dma_cfg, true);
+  channel_config_set_write_increment(&synth_dma_cfg, false);
+  channel_config_set_dreq(&synth_dma_cfg, pio_get_dreq(pio, sm, true));
+  channel_config_set_chain_to(&synth_dma_cfg, restart_dma);
+  channel_config_set_irq_quiet(&synth_dma_cfg, true);
+  data_ctrl = channel_config_get_ctrl_value(&synth_dma_cfg);
+
+  // Silence repeats the same zero word
+  cfg = synth_dma_cfg;
+  channel_config_set_read_increment(&cfg, false);
+  silent_ctrl = channel_config_get_ctrl_value(&cfg);
+
+  // The last block of a sequence, not paced by the PIO, raising an interrupt when done
+  cfg = dma_channel_get_default_config(synth_dma);
+  channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg, false);
+  channel_config_set_write_increment(&cfg, false);
+  channel_config_set_chain_to(&cfg, restart_dma);
+  restart_ctrl = channel_config_get_ctrl_value(&cfg);
+
+  for(int ii = 0; ii < n_blocks; ii++) {
+    compressed_blocks[ii].write_addr = &pio->txf[sm];
+    compressed_blocks[ii].ctrl = data_ctrl;
+  }
+  compressed_blocks[n_blocks].read_addr = &compressed_next_seq;
+  compressed_blocks[n_blocks].write_addr = &dma_hw->ch[restart_dma].read_addr;
+  compressed_blocks[n_blocks].transfer_count = 1;
+  compressed_blocks[n_blocks].ctrl = restart_ctrl;
+  compressed_silent_blocks[0].read_addr = &zero_word;
+  compressed_silent_blocks[0].write_addr = &pio->txf[sm];
+  compressed_silent_blocks[0].transfer_count = n_words;
+  compressed_silent_blocks[0].ctrl = silent_ctrl;
+  compressed_silent_blocks[1] = compressed_blocks[n_blocks];
+  compressed_next_seq = enable_transmit ? compressed_blocks : compressed_silent_blocks;
+
+  // The restart DMA writes four words per trigger, wrapping around the four registers of the synth DMA
+  restart_dma_cfg = dma_channel_get_default_config(restart_dma);
+  channel_config_set_transfer_data_size(&restart_dma_cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&restart_dma_cfg, true);
+  channel_config_set_write_increment(&restart_dma_cfg, true);
+  channel_config_set_ring(&restart_dma_cfg, true, 4); // 16 bytes
+  dma_channel_set_irq0_enabled(synth_dma, true);
+  irq_set_exclusive_handler(DMA_IRQ_0, dma_irq_handler); 
+  irq_set_enabled(DMA_IRQ_0, true);
+  dma_channel_configure(restart_dma, &restart_dma_cfg, &dma_hw->ch[synth_dma].read_addr, 
+                        compressed_next_seq, 4, true);
 }
 
 
@@ -547,12 +3255,72 @@ void synth::unclaim_dma()
   dma_channel_unclaim(restart_dma);
   synth_dma = 999999; // Set to some unrealistic value to signal that it is not valid
   restart_dma = 999999;
+  if(capture_dma < 1000) {
+    dma_sniffer_disable();
+    dma_channel_cleanup(capture_dma);
+    dma_channel_cleanup(seed_dma);
+    dma_channel_unclaim(capture_dma);
+    dma_channel_unclaim(seed_dma);
+    capture_dma = 999999;
+    seed_dma = 999999;
+  }
+  crc_active = false;
 }
 
 
 synth::~synth() {
   pio_sm_unclaim(pio, sm);
   unclaim_dma();
+  delete [] pattern_words;
+  delete [] pattern_info;
+  delete [] compressed_blocks;
+  compressed_blocks = NULL;
+  set_cache_size(0);
+  compressed_active = false;
+  stop_extra_outputs();
+  for(int kk = 0; kk < max_extra_outputs; kk++) {
+    delete [] extra_buffer[kk];
+    extra_buffer[kk] = NULL;
+  }
+  n_bank_active = 0;
+  for(int kk = 0; kk < max_bank_levels; kk++) {
+    delete [] bank_buffer[kk];
+    bank_buffer[kk] = NULL;
+    bank_alloc_words[kk] = 0;
+  }
+  fine_active = false;
+  delete [] fine_buffer;
+  fine_buffer = NULL;
+}
+
+
+// Measure the spectrum around the carrier of the main buffer
+spectrum_t synth::analyze(double bandwidth_hz)
+{
+  return analyze_buffer(synth_buffer, n_words, n_periods, CPU_freq_actual, bandwidth_hz, hiz_active);
+}
+
+
+// Close-in spurs from the alternation between the plans
+alternation_t synth::analyze_alternation(double bandwidth_hz)
+{
+  double x = frequency * 16.0 / (double)CPU_freq_actual;
+  return ::analyze_alternation(fine_step, x*n_words - n_periods, fine_periods - x*fine_words,
+                               16.0*n_words/CPU_freq_actual, 16.0*fine_words/CPU_freq_actual, bandwidth_hz);
+}
+
+
+// Intermodulation of the carrier and the tones in the main buffer
+imd_t synth::analyze_imd()
+{
+  int lines[max_imd_tones];
+  int n = 1 + (tones_active() ? n_tones : 0);
+
+  lines[0] = n_periods;
+  for(int kk = 1; kk < n; kk++) {
+    lines[kk] = tone_periods[kk - 1];
+  }
+  return ::analyze_imd(synth_buffer, n_words, lines, n);
 }
 
 
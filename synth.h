@@ -6,13 +6,184 @@
 #include "pico/stdlib.h"
 #include "pio_stream.h"
 #include "farey.h"
+#include "analysis.h"
+#include "oscillator.h"
+#include "modulator.h"
 #include <cmath>
 #include <stdio.h>
 
 extern double CPU_freq_actual;
 extern const int max_words;
 
+// Shapes of the keying envelope used for the ramp-up and ramp-down buffers
+enum taper_shape_t {
+  TAPER_RAISED_COSINE = 0,
+  TAPER_BLACKMAN_HARRIS,
+  TAPER_ERF,
+  TAPER_HANN_SQUARED,
+  TAPER_USER,
+  TAPER_N_SHAPES
+};
+
+// Dimensions of the pattern table used for fast synthesis of the sigma-delta modes.
+// Each entry is the output word for a given amplitude level (for the ramps), phase at the start
+// of the word, modulator state and state of the trinary zero toggle.
+const int pattern_levels = 4;
+const int pattern_phases = 256;
+const int pattern_states = 8;
+const int pattern_entries = pattern_levels * pattern_phases * pattern_states * 2;
+
+// Runs of the RLE serialiser (pio_rle.pio): 3 to 16386 clocks, two runs in each word.
+// When the restart DMA starts the next buffer, the 8 words in the FIFO must last for at least
+// rle_min_fifo_clocks. The plain serialiser has 128 clocks in them.
+const int rle_min_run = 3;
+const int rle_max_run = 16386;
+const int rle_fifo_words = 8;
+const int rle_min_fifo_clocks = 64;
+
+// Half-periods of the fractional-N square wave of mode 6 (pio_fracn.pio): N or N+1 clocks with N of at least
+// fracn_min_half, chosen by a pattern of up to fracn_max_len bits that the PIO keeps in a register.
+const int fracn_min_half = 6;
+const int fracn_max_len = 32;
+
+// Max number of DMA control blocks describing a compressed main buffer
+const int max_compressed_blocks = 4096;
+
+// A DMA control block, written by the restart DMA into the registers of the synth DMA
+typedef struct {
+  const volatile void *read_addr;
+  volatile void *write_addr;
+  uint32_t transfer_count;
+  uint32_t ctrl;
+} dma_block_t;
+
+// State of the modulator when the main buffer is generated one word at a time
+typedef struct {
+  double phase_increment;
+  int word_index;
+  double delta_dly;
+  int last_equal;
+  int last_out;
+} main_stream_t;
+
+// How the sigma-delta generators calculate the sine
+enum sine_method_t {
+  SINE_EXACT = 0,  // Math library
+  SINE_TABLE,      // Table lookup in software
+  SINE_INTERP,     // Table lookup by the SIO interpolators, same result as SINE_TABLE
+  SINE_N_METHODS
+};
+
+// Arithmetic of the sigma-delta modulators
+enum sd_kernel_t {
+  SD_KERNEL_DOUBLE = 0,  // Floating point, one modulator at a time
+  SD_KERNEL_FIXED,       // Fixed point, the main and ramp modulators in lockstep lanes (modulator.h)
+  SD_N_KERNELS
+};
+
+// How the trinary modes send the zero level
+enum zero_mode_t {
+  ZERO_TOGGLE = 0,  // Both pins low or both high, alternating
+  ZERO_LOW,         // Both pins low
+  ZERO_HIZ,         // Both pins high impedance, the directions set by a second SM (pio_hiz.pio)
+  ZERO_N_MODES
+};
+
+// Spectral shape of the dither. The shaped dither is the uniform dither through a short filter, scaled to
+// the same RMS, so that the shapes cost the same in dither power.
+enum dither_shape_t {
+  DITHER_WHITE = 0,  // Flat
+  DITHER_HP1,        // First order high-pass, first difference
+  DITHER_HP2,        // Second order high-pass, second difference
+  DITHER_NOTCH,      // Band-stop around the carrier, recursive
+  DITHER_N_SHAPES
+};
+
+// Stages of the buffer calculation. Each has a bit in the dirty set of the synth, telling that the
+// stage must run the next time the settings are applied.
+enum calc_stage_t {
+  STAGE_PLAN = 0,  // Number of words and periods of the buffers
+  STAGE_SILENT,    // The silent buffer
+  STAGE_MAIN,      // The main buffer, in modes 4 and 5 together with the ramps that share its dither
+  STAGE_RAMPS,     // Only the ramp buffers of modes 4 and 5
+  STAGE_CRC,       // Expected CRCs of the buffers
+  STAGE_EXTRA,     // Buffers of the extra outputs
+  N_STAGES
+};
+
+const uint32_t DIRTY_PLAN = 1u << STAGE_PLAN;
+const uint32_t DIRTY_SILENT = 1u << STAGE_SILENT;
+const uint32_t DIRTY_MAIN = 1u << STAGE_MAIN;
+const uint32_t DIRTY_RAMPS = 1u << STAGE_RAMPS;
+const uint32_t DIRTY_CRC = 1u << STAGE_CRC;
+const uint32_t DIRTY_EXTRA = 1u << STAGE_EXTRA;
+const uint32_t DIRTY_ALL = (1u << N_STAGES) - 1;
+
+// Extra outputs, phase locked to the main output. Each uses two consecutive pins starting at
+// the given pin.
+const int max_extra_outputs = 2;
+const uint8_t extra_output_pins[max_extra_outputs] = {16, 18};
+
+// Amplitude bank: levels besides the main amplitude, calculated in the same pass as the main buffer
+// and switched between at the buffer boundaries
+const int max_bank_levels = 3;
+const int bank_pad_words = 2048;  // The plan is repeated up to this length, still 164 us for the interrupt at 200 MHz
+
+// Extra tones added to the carrier in the sigma-delta modes, each with its own frequency, amplitude and phase.
+// The plan makes the buffer hold a whole number of periods of every tone.
+const int max_tones = 3;
+
+// The taper table has taper_table_len+1 entries, going from 0 to 1 (rising edge)
+const int taper_table_len = 1024;
+const int max_user_taper_points = 16;
+
+// Max number of buffer sets kept in the cache
+const int max_cached_sets = 8;
+
+// All settings that affect the contents of the buffers. Unused fields are zero, so that two sets of settings
+// can be compared and hashed as memory.
+typedef struct {
+  double cpu_freq;
+  double frequency;
+  int mode;
+  float amplitude, hd3_amplitude, hd3_phase_rad;
+  float dither_amplitude;
+  uint32_t dither_seed;
+  int dither_shape;
+  int max_words_limit;
+  bool pattern_synthesis;
+  bool zero_low;
+  int sine_method, sd_kernel;
+  float transition_penalty;
+  double plan_tolerance_hz, plan_passband_hz;
+  int n_bank;                 // Bank levels requested in modes 2-5, which limit the padding of the plan
+  int taper_shape;            // Modes 4 and 5
+  int n_user_taper_points;
+  float user_taper_points[max_user_taper_points];
+  int n_tones;                // When the tones are active
+  double tone_frequency[max_tones];
+  float tone_amplitude[max_tones], tone_phase_rad[max_tones];
+} buffer_settings_t;
+
+// A set of buffers kept in the cache. Found by the hash of its settings in key, and reused only if the
+// settings themselves are equal too.
+typedef struct {
+  uint64_t key;
+  buffer_settings_t settings;
+  int n_words, n_periods;
+  bool has_ramps;      // The ramp buffers follow the main buffer in words, otherwise they are derived from it
+  uint32_t last_used;  // For finding the least recently used set
+  uint32_t *words;     // NULL if the entry is free
+} buffer_set_t;
+
 void dma_handler();
+void fill_taper_table(int shape, float *table);
+const char *taper_shape_str(int shape);
+const char *sine_method_str(int method);
+const char *calc_stage_str(int stage);
+const char *sd_kernel_str(int kernel);
+const char *zero_mode_str(int zero);
+const char *dither_shape_str(int shape);
 
 class synth {
   public:
@@ -20,15 +191,19 @@ class synth {
     ~synth();
     void disable_output();
     void enable_output();
-    void set_dither_amplitude(float a) {dither_amplitude = a; needs_recalculation = true;};
+    void set_dither_amplitude(float a) {dither_amplitude = a; dirty |= DIRTY_MAIN;};
     float get_dither_amplitude() {return dither_amplitude;};
-    void set_amplitude(float a) {amplitude = a; needs_recalculation = true;};
+    void set_dither_seed(uint32_t s) {dither_seed = s; dirty |= DIRTY_MAIN;};
+    uint32_t get_dither_seed() {return dither_seed;};
+    void set_dither_shape(int s) {dither_shape = s; dirty |= DIRTY_MAIN;};
+    int get_dither_shape() {return dither_shape;};
+    void set_amplitude(float a) {amplitude = a; dirty |= DIRTY_MAIN;};
     float get_amplitude() {return amplitude;};
-    void set_hd3_amplitude(float a) {hd3_amplitude = a; needs_recalculation = true;};
+    void set_hd3_amplitude(float a) {hd3_amplitude = a; dirty |= DIRTY_MAIN;};
     float get_hd3_amplitude() {return hd3_amplitude;};
-    void set_hd3_phase(float p) {hd3_phase_rad = p; needs_recalculation = true;};
+    void set_hd3_phase(float p) {hd3_phase_rad = p; dirty |= DIRTY_MAIN;};
     float get_hd3_phase() {return hd3_phase_rad;};
-    void set_frequency(double f) {frequency = f; needs_recalculation = true;};
+    void set_frequency(double f) {frequency = f; dirty |= DIRTY_PLAN;};
     double get_frequency() {return frequency;};
     double get_frequency_exact();
     void set_mode(int m);
@@ -36,8 +211,114 @@ class synth {
     const char *get_mode_str();
     int get_n_words() {return n_words;};
     int get_n_periods() {return n_periods;};
-    void set_max_words(int m) {max_words_limit = m; needs_recalculation = true;};
+    bool uses_buffers() {return mode >= 1 && mode <= 5;};
+    uint32_t get_fracn_half() {return fracn_half;};
+    uint32_t get_fracn_long() {return fracn_long;};
+    uint32_t get_fracn_len() {return fracn_len;};
+    uint32_t get_fracn_pattern() {return fracn_pattern;};
+    double get_fracn_jitter() {return fracn_jitter;};
+    void set_max_words(int m) {max_words_limit = m; dirty |= DIRTY_PLAN;};
     int get_max_words() {return max_words_limit;};
+    void set_taper_shape(int s);
+    int get_taper_shape() {return taper_shape;};
+    bool set_user_taper(const float *points, int n_points);
+    void set_pattern_synthesis(bool p) {pattern_synthesis = p; dirty |= DIRTY_MAIN;};  // Experimental, lower SNR
+    bool get_pattern_synthesis() {return pattern_synthesis;};
+    uint32_t get_calculation_time_us() {return calculation_time_us;};
+    uint32_t get_stages_run() {return stages_run;};
+    uint32_t get_stage_time_us(int stage) {return stage_time_us[stage];};
+    void set_compression(int max_plan_words) {compressed_max_words = max_plan_words; dirty |= DIRTY_PLAN | DIRTY_MAIN;};
+    int get_compression() {return compressed_max_words;};
+    bool is_compressed();
+    int get_dictionary_words() {return dict_words;};
+    int get_n_blocks() {return n_blocks;};
+    void set_rle(bool r) {rle = r; dirty |= DIRTY_MAIN;};
+    bool get_rle() {return rle;};
+    bool is_rle();
+    int get_rle_words() {return rle_words;};
+    void set_cache_size(int bytes);
+    int get_cache_size() {return cache_size;};
+    int get_cache_bytes() {return cache_bytes;};
+    uint32_t get_cache_hits() {return cache_hits;};
+    uint32_t get_cache_lookups() {return cache_lookups;};
+    void set_transition_penalty(float p) {transition_penalty = p; dirty |= DIRTY_MAIN;};
+    float get_transition_penalty() {return transition_penalty;};
+    void set_crc_check(bool c) {crc_check = c; dirty |= DIRTY_CRC;};
+    bool get_crc_check() {return crc_check;};
+    bool is_crc_checking();
+    void set_sine_method(int m) {sine_method = m; dirty |= DIRTY_MAIN;};
+    int get_sine_method() {return sine_method;};
+    void set_sd_kernel(int k) {sd_kernel = k; dirty |= DIRTY_MAIN;};
+    int get_sd_kernel() {return sd_kernel;};
+    void set_zero_mode(int z) {zero_mode = z; dirty |= DIRTY_MAIN;};
+    int get_zero_mode() {return zero_mode;};
+    bool is_hiz();
+    void set_refresh(bool r);
+    bool get_refresh() {return refresh;};
+    float get_refresh_rate();
+    float get_refresh_load();
+    void refresh_step();
+    void set_extra_outputs(int n) {n_extra_outputs = n; dirty |= DIRTY_EXTRA;};
+    int get_extra_outputs() {return n_extra_outputs;};
+    int get_active_extra_outputs();
+    void set_bank_levels(int n) {n_bank = n; dirty |= DIRTY_PLAN | DIRTY_MAIN;};
+    int get_bank_levels() {return n_bank;};
+    void set_bank_amplitude(int k, float a) {bank_amplitude[k] = a; dirty |= DIRTY_MAIN;};
+    float get_bank_amplitude(int k) {return bank_amplitude[k];};
+    int get_active_bank_levels();
+    int get_bank_level_bytes();
+    void set_level(int k);
+    int get_level();
+    void set_tones(int n) {n_tones = n; dirty |= DIRTY_PLAN | DIRTY_MAIN;};
+    int get_tones() {return n_tones;};
+    bool tones_active() {return n_tones > 0 && mode >= 2 && mode <= 5;};
+    void set_tone(int k, double f, float a, float phase) {tone_frequency[k] = f; tone_amplitude[k] = a; tone_phase_rad[k] = phase; dirty |= DIRTY_PLAN | DIRTY_MAIN;};
+    double get_tone_frequency(int k) {return tone_frequency[k];};
+    double get_tone_frequency_exact(int k);
+    float get_tone_amplitude(int k) {return tone_amplitude[k];};
+    float get_tone_phase(int k) {return tone_phase_rad[k];};
+    int get_tone_periods(int k) {return tone_periods[k];};
+    imd_t analyze_imd();
+    void set_fine_tuning(bool f) {fine_tuning = f; dirty |= DIRTY_PLAN | DIRTY_MAIN;};
+    bool get_fine_tuning() {return fine_tuning;};
+    bool is_fine_tuned();
+    double get_fine_fraction();
+    void set_plan_tolerance(double hz, double passband_hz) {plan_tolerance_hz = hz; plan_passband_hz = passband_hz; dirty |= DIRTY_PLAN;};
+    double get_plan_tolerance() {return plan_tolerance_hz;};
+    double get_plan_passband() {return plan_passband_hz;};
+    spur_risk_t get_plan_risk() {return plan_risk;};
+    int get_plan_candidates() {return plan_candidates;};
+    int get_fine_words() {return fine_words;};
+    int get_fine_periods() {return fine_periods;};
+    alternation_t analyze_alternation(double bandwidth_hz);
+    void set_output_phase(int k, float degrees) {extra_phase_deg[k] = degrees; dirty |= DIRTY_EXTRA;};
+    float get_output_phase(int k) {return extra_phase_deg[k];};
+    double get_output_phase_actual(int k) {return extra_phase_actual[k];};
+    int get_output_shift(int k) {return extra_shift[k];};
+    bool is_output_enabled();
+    uint64_t get_key_down_us();
+    void set_park(bool p) {park = p;};
+    bool get_park() {return park;};
+    void set_park_delay(uint32_t ms) {park_delay_ms = ms;};
+    uint32_t get_park_delay() {return park_delay_ms;};
+    void set_park_clock(uint32_t khz, uint32_t after_ms) {park_clock_khz = khz; park_slow_after_ms = after_ms;};
+    uint32_t get_park_clock() {return park_clock_khz;};
+    uint32_t get_park_slow_after() {return park_slow_after_ms;};
+    void park_poll();
+    bool is_parked() {return parked;};
+    uint64_t get_parked_us();
+    uint64_t get_slow_us();
+    uint32_t get_parks() {return n_parks;};
+    uint32_t get_wake_max_us() {return wake_max_us;};
+    double get_wake_avg_us() {return n_wakes ? (double)wake_total_us/n_wakes : 0;};
+    uint32_t get_key_edges();
+    double get_key_edge_avg_us();
+    uint32_t get_key_edge_max_us();
+    void reset_park_stats();
+    double get_transitions_per_s();
+    uint32_t get_crc_checks();
+    uint32_t get_crc_errors();
+    spectrum_t analyze(double bandwidth_hz);
     void calculate_buffers();
     void apply_settings();
     void restore_out_pins();
@@ -52,22 +333,135 @@ class synth {
     const pio_program_t *pio_program;
     dma_channel_config synth_dma_cfg, restart_dma_cfg;
     float dither_amplitude;
+    uint32_t dither_seed;
+    int dither_shape;
     float amplitude;
     float hd3_amplitude;
     float hd3_phase_rad;
     int max_words_limit;
+    int taper_shape;
     double frequency;
     int mode; // 0 - CLKDIV, 1 - comparator, 2 - binary sigma delta, 3 - trinary sigma delta, 
-              // 4 - click free binary sigma delta, 5 - click free trinary sigma delta
+              // 4 - click free binary sigma delta, 5 - click free trinary sigma delta, 6 - fractional-N
     int n_words, n_periods;
-    bool needs_recalculation;
+    uint32_t dirty;           // DIRTY_ bits of the stages that must run when the settings are applied
+    bool pattern_synthesis;
+    uint32_t calculation_time_us;
+    uint32_t stages_run;      // DIRTY_ bits of the stages that ran in the last calculation
+    uint32_t stage_time_us[N_STAGES];
+    uint32_t *pattern_words;  // Pattern table, allocated when first used
+    uint8_t *pattern_info;    // Sum of the output levels + 16 in bits 0-5, next zero toggle state in bit 6
+    double pattern_key[6];    // Parameters that the pattern table was calculated for
+    int compressed_max_words; // Max length of the compressed main buffer, 0 to not compress
+    int dict_words;           // Number of words in the dictionary of the compressed main buffer
+    int n_blocks;             // Number of DMA control blocks of the compressed main buffer
+    bool rle;                 // Play the buffers of modes 1-3 as runs of symbols when possible
+    int rle_words;            // Length of the run-length encoded buffers
+    uint32_t fracn_half;      // Mode 6: half-periods of fracn_half or fracn_half+1 clocks,
+    uint32_t fracn_long;      // fracn_long of them long in every fracn_len
+    uint32_t fracn_len;
+    uint32_t fracn_pattern;   // One bit per half-period, 1 for long. Bit 0 is 0, the reload makes it long.
+    double fracn_jitter;      // Peak-to-peak deviation of the edges from the ideal ones, clocks
+    buffer_set_t cache[max_cached_sets];
+    int cache_size;           // Memory budget of the cache in bytes, 0 to not cache
+    int cache_bytes;          // Memory used by the cache
+    uint32_t cache_hits, cache_lookups, cache_clock;
+    bool crc_check;           // Check the CRC of each played buffer with the DMA sniffer
+    int sine_method;
+    int sd_kernel;
+    int zero_mode;
+    float transition_penalty; // Makes the sigma-delta modulators change their output less often, 0 for off
+    oscillator_t osc_fund, osc_hd3;
+    bool refresh;             // Let core 1 refresh the dither of the main buffer
+    uint64_t key_down_us;     // Total time with the output enabled, up to key_down_since
+    uint64_t key_down_since;
+    uint64_t key_up_since;
+    bool park;                // Stop the DMAs and the SM when the silent buffer has played for park_delay_ms
+    uint32_t park_delay_ms;
+    uint32_t park_clock_khz;  // System clock when parked for park_slow_after_ms, 0 to keep it
+    uint32_t park_slow_after_ms;
+    bool parked;
+    bool slowed;              // The system clock is at park_clock_khz
+    uint32_t saved_clock_khz; // System clock to go back to
+    uint64_t parked_us, parked_since;
+    uint64_t slow_us, slow_since;
+    uint32_t n_parks, n_wakes;
+    uint64_t wake_total_us;   // From enable_output() to the restart of the DMAs
+    uint32_t wake_max_us;
+    uint32_t main_transitions; // Pin transitions during one pass through the main buffer, 0 if unknown
+    int n_extra_outputs;      // Number of extra outputs requested
+    float extra_phase_deg[max_extra_outputs];     // Requested phase relative to the main output
+    double extra_phase_actual[max_extra_outputs]; // Achieved phase
+    int extra_shift[max_extra_outputs];           // Number of samples that the extra buffer is rotated by
+    uint32_t extra_sm[max_extra_outputs];
+    int n_bank;               // Number of bank levels requested
+    float bank_amplitude[max_bank_levels]; // At most the main amplitude
+    int n_tones;              // Number of tones besides the carrier
+    double tone_frequency[max_tones];
+    float tone_amplitude[max_tones];
+    float tone_phase_rad[max_tones];
+    int tone_periods[max_tones];           // Periods of each tone in the buffer
+    oscillator_t osc_tone[max_tones];
+    bool fine_tuning;         // Alternate between the plans below and above the frequency
+    uint32_t fine_plan_step;  // Fraction of the passes from the upper plan, times 2^32, 0 for one plan
+    int fine_words, fine_periods;          // The upper plan
+    double plan_tolerance_hz; // Rank the plans within this of the frequency by their predicted spurs, 0 for off
+    double plan_passband_hz;  // Band around the carrier where the spurs are predicted
+    spur_risk_t plan_risk;    // Predicted spurs of the current plan
+    int plan_candidates;      // Number of plans ranked
 
     void add_pio_program(const pio_program_t *prog);
+    void add_serialiser_program();
     void remove_pio_program();
     void fill_synth_buffer_silent();
-    void fill_synth_buffer_sigma_delta();
-    void fill_synth_buffer_sigma_delta_3s();
+    void start_oscillators();
+    void stop_oscillators();
+    void word_samples(int ii, oscillator_t *fund, oscillator_t *hd3, double *samples);
+    void table_word_samples(int ii, oscillator_t *fund, oscillator_t *hd3, double *samples);
+    void refresh_samples(int ii, oscillator_t *fund, oscillator_t *hd3, bool fixed, double *samples);
+    void fill_synth_buffer_sigma_delta(bool ramps_only);
+    void fill_synth_buffer_sigma_delta_3s(bool ramps_only);
+    void fill_synth_buffer_sigma_delta_fixed(bool trinary, bool ramps_only);
     void fill_synth_buffer_compare();
+    bool build_pattern_table(double phase_increment, bool trinary);
+    void fill_synth_buffer_pattern(bool ramps_only);
+    void plan_buffers(uint32_t max_denominator);
+    void plan_tones(uint32_t max_denominator);
+    void add_tone_samples(int ii, double *samples);
+    bool fine_possible();
+    bool hiz_zeros() {return zero_mode == ZERO_HIZ && (mode == 3 || mode == 5);};  // Only trinary modes have zeros
+    bool pattern_kernel();
+    void plan_fine(uint32_t max_denominator);
+    void plan_ranked(uint32_t max_denominator, int pad_words);
+    spur_risk_t predict_plan_spurs(uint32_t periods, uint32_t words);
+    void fill_main_buffers(bool ramps_only);
+    void plan_fracn();
+    void end_stage(int stage, uint32_t start_time);
+    void start_dither();
+    void main_stream_init(main_stream_t *st);
+    uint32_t main_stream_word(main_stream_t *st);
+    bool compress_main_buffer();
+    bool encode_rle();
+    uint64_t buffer_key(const buffer_settings_t *s);
+    void get_buffer_settings(buffer_settings_t *s);
+    bool load_cached_buffers(uint64_t key, const buffer_settings_t *s);
+    void store_cached_buffers(uint64_t key, const buffer_settings_t *s);
+    void evict_cached_buffers(int needed_bytes);
     void setup_dma();
+    void setup_compressed_dma();
+    void setup_crc_dma();
+    void fill_extra_buffers();
+    bool alloc_bank();
+    void setup_extra_dma();
+    void stop_extra_outputs();
+    void setup_hiz_dma();
+    void stop_hiz();
+    void stop_hiz_dma();
+    void stop_dma_chain();
+    void park_outputs();
+    void wake_outputs();
+    void leave_park();
+    void restore_clock();
+    void calculate_crcs();
     void unclaim_dma();
 };
\ No newline at end of file
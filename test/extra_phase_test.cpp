@@ -0,0 +1,92 @@
+// Test of the phases of the extra outputs on a PC. A buffer with a square wave is rotated as
+// synth::fill_extra_buffers() does, and the phase of the carrier is measured with a DFT.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <complex>
+#include <numeric>
+#include <vector>
+#include "farey.h"
+#include "modulator.h"
+
+static int failures;
+
+static void check(bool ok, const char *what, int n_words, int n_periods, double phase_deg)
+{
+  if(!ok) {
+    printf("FAILED: %s, %d words, %d periods, %.3f degrees\n", what, n_words, n_periods, phase_deg);
+    failures++;
+  }
+}
+
+static int symbol(const uint32_t *buffer, int64_t i)
+{
+  return (buffer[i/16] >> 2*(i%16)) & 3;
+}
+
+// The DFT of the pin difference at the carrier
+static std::complex<double> carrier(const uint32_t *buffer, int n_words, int n_periods)
+{
+  int64_t n = 16*(int64_t)n_words;
+  std::complex<double> acc = 0;
+  for(int64_t ii = 0; ii < n; ii++) {
+    int s = symbol(buffer, ii);
+    double v = (s == 1) ? 1 : (s == 2 ? -1 : 0);
+    acc += v*std::polar(1.0, -2*M_PI*(double)((ii*n_periods) % n)/n);
+  }
+  return acc;
+}
+
+static void test_plan(int n_words, int n_periods)
+{
+  int64_t n = 16*(int64_t)n_words;
+  std::vector<uint32_t> buffer(n_words, 0), rotated(n_words);
+
+  // A trinary square wave: +1, 0, -1, 0 over each period
+  for(int64_t ii = 0; ii < n; ii++) {
+    double c = cos(2*M_PI*(double)((ii*n_periods) % n)/n);
+    uint32_t s = (c > 0.5) ? 1 : (c < -0.5 ? 2 : 0);
+    buffer[ii/16] |= s << 2*(ii%16);
+  }
+  std::complex<double> main = carrier(buffer.data(), n_words, n_periods);
+  double step_deg = 360.0*std::gcd((int64_t)n_periods, n)/n;
+
+  const double phases[] = {0, 45.3, 90, 179.99, 180, 270, 359.99, -90, 720.5};
+  for(double phase : phases) {
+    double actual;
+    int64_t shift = phase_rotation(n_periods, n, phase, &actual);
+    check(shift >= 0 && shift < n, "rotation within the buffer", n_words, n_periods, phase);
+    double error = remainder(actual - phase, 360);
+    check(fabs(error) <= step_deg/2 + 1e-9, "closest phase", n_words, n_periods, phase);
+
+    sd_rotate(buffer.data(), rotated.data(), n_words, shift);
+    bool same = true;
+    for(int64_t ii = 0; ii < n; ii++) {
+      same = same && symbol(rotated.data(), ii) == symbol(buffer.data(), (ii + shift) % n);
+    }
+    check(same, "rotated symbols", n_words, n_periods, phase);
+
+    std::complex<double> extra = carrier(rotated.data(), n_words, n_periods);
+    double measured = std::arg(extra/main)*180/M_PI;
+    check(fabs(remainder(measured - actual, 360)) < 1e-6, "measured phase", n_words, n_periods, phase);
+    check(fabs(std::abs(extra)/std::abs(main) - 1) < 1e-9, "same amplitude", n_words, n_periods, phase);
+  }
+}
+
+
+int main()
+{
+  // Plans of the 80 m band at 3.5799, 3.51 and 3.6 MHz, and plans with large common factors
+  test_plan(12015, 3441);
+  test_plan(15000, 4212);
+  test_plan(15000, 4320);
+  test_plan(1000, 250);
+  test_plan(7, 3);
+  if(failures) {
+    printf("%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("All checks passed\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,604 @@
+// Test of the PIO programs on a PC. The .h files of pio_rle, pio_fracn and pio_hiz were assembled by hand,
+// so each .pio file is assembled here and compared with the instructions and wraps in its .h file, and the
+// instructions in the .h files are run on an emulated state machine to check the output stage. The
+// assembler is also checked on pio_stream and toggle, whose .h files come from pioasm.
+// Takes the sketch directory as argument, by default "..".
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#define PICO_NO_HARDWARE 1
+#include "pio_stream.h"
+#include "toggle.h"
+#include "pio_rle.h"
+#include "pio_fracn.h"
+#include "pio_hiz.h"
+
+static int failures;
+
+static void check(bool ok, const char *what)
+{
+  if(!ok) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+
+// ---------------------------------------------------------------------------------------------------
+// Assembler for the part of the PIO language that the programs use: jmp, out, mov, set and nop, with
+// side-set and delay, labels, .program, .side_set, .origin, .wrap_target and .wrap
+
+typedef struct {
+  std::string name;
+  std::vector<uint16_t> instructions;
+  int wrap_target;
+  int wrap;
+  int origin;
+} pio_asm_t;
+
+static int lookup(const char *const *names, const std::string &s)
+{
+  for(int ii = 0; names[ii]; ii++) {
+    if(s == names[ii]) {
+      return ii;
+    }
+  }
+  return -1;
+}
+
+static const char *const jmp_conds[] = {"", "!x", "x--", "!y", "y--", "x!=y", "pin", "!osre", NULL};
+static const char *const out_dests[] = {"pins", "x", "y", "null", "pindirs", "pc", "isr", "exec", NULL};
+static const char *const mov_dests[] = {"pins", "x", "y", "-", "exec", "pc", "isr", "osr", NULL};
+static const char *const mov_srcs[] = {"pins", "x", "y", "null", "-", "status", "isr", "osr", NULL};
+static const char *const set_dests[] = {"pins", "x", "y", "-", "pindirs", NULL};
+
+static int number(const std::string &s, const char *what, int line)
+{
+  char *end;
+  long v = strtol(s.c_str(), &end, 0);
+  if(s.empty() || *end) {
+    printf("FAILED: line %d: bad %s '%s'\n", line, what, s.c_str());
+    failures++;
+    return 0;
+  }
+  return (int)v;
+}
+
+static int field(const char *const *names, const std::string &s, const char *what, int line)
+{
+  int v = lookup(names, s);
+  if(v < 0) {
+    printf("FAILED: line %d: bad %s '%s'\n", line, what, s.c_str());
+    failures++;
+    return 0;
+  }
+  return v;
+}
+
+// Assemble all the programs of a .pio file
+static std::vector<pio_asm_t> assemble(const std::string &path)
+{
+  std::vector<pio_asm_t> programs;
+  std::ifstream f(path);
+  if(!f) {
+    printf("FAILED: cannot open %s\n", path.c_str());
+    failures++;
+    return programs;
+  }
+
+  // First pass: split into programs, collect the instructions and the labels
+  typedef struct {
+    std::vector<std::string> tokens;
+    int line;
+  } source_line_t;
+  std::vector<std::vector<source_line_t>> code;
+  std::vector<std::map<std::string, int>> labels;
+  std::vector<int> sideset_bits, sideset_opt;
+  std::string text;
+  bool in_sdk = false;
+  for(int line = 1; std::getline(f, text); line++) {
+    if(in_sdk) {
+      in_sdk = (text.find("%}") == std::string::npos);
+      continue;
+    }
+    if(text.compare(0, 1, "%") == 0) {
+      in_sdk = true;
+      continue;
+    }
+    text = text.substr(0, text.find(';'));
+    text = text.substr(0, text.find("//"));
+    for(char &c : text) {
+      if(c == ',' || c == '\r' || c == '\t') {
+        c = ' ';
+      }
+    }
+    std::istringstream ss(text);
+    std::vector<std::string> tokens;
+    for(std::string t; ss >> t;) {
+      tokens.push_back(t);
+    }
+    if(tokens.empty()) {
+      continue;
+    }
+    if(tokens[0] == ".program") {
+      programs.push_back({tokens[1], {}, 0, -1, -1});
+      code.push_back({});
+      labels.push_back({});
+      sideset_bits.push_back(0);
+      sideset_opt.push_back(0);
+      continue;
+    }
+    if(programs.empty()) {
+      continue;
+    }
+    pio_asm_t &p = programs.back();
+    int addr = (int)code.back().size();
+    if(tokens[0] == ".side_set") {
+      sideset_opt.back() = (tokens.size() > 2 && tokens[2] == "opt");
+      sideset_bits.back() = number(tokens[1], "side-set count", line) + sideset_opt.back();
+    } else if(tokens[0] == ".origin") {
+      p.origin = number(tokens[1], "origin", line);
+    } else if(tokens[0] == ".wrap_target") {
+      p.wrap_target = addr;
+    } else if(tokens[0] == ".wrap") {
+      p.wrap = addr - 1;
+    } else if(tokens[0].back() == ':') {
+      labels.back()[tokens[0].substr(0, tokens[0].size() - 1)] = addr;
+    } else {
+      code.back().push_back({tokens, line});
+    }
+  }
+
+  // Second pass: encode
+  for(size_t pp = 0; pp < programs.size(); pp++) {
+    pio_asm_t &p = programs[pp];
+    if(p.wrap < 0) {
+      p.wrap = (int)code[pp].size() - 1;
+    }
+    for(source_line_t &sl : code[pp]) {
+      std::vector<std::string> t = sl.tokens;
+      int delay = 0, side = -1;
+      for(size_t ii = 0; ii < t.size();) {
+        if(t[ii] == "side" && ii + 1 < t.size()) {
+          side = number(t[ii + 1], "side-set value", sl.line);
+          t.erase(t.begin() + ii, t.begin() + ii + 2);
+        } else if(t[ii].front() == '[' && t[ii].back() == ']') {
+          delay = number(t[ii].substr(1, t[ii].size() - 2), "delay", sl.line);
+          t.erase(t.begin() + ii);
+        } else {
+          ii++;
+        }
+      }
+      uint16_t w = 0;
+      if(t[0] == "jmp") {
+        int cond = (t.size() == 3) ? field(jmp_conds, t[1], "condition", sl.line) : 0;
+        const std::string &target = t.back();
+        int addr = labels[pp].count(target) ? labels[pp][target] : number(target, "target", sl.line);
+        w = 0x0000 | cond << 5 | addr;
+      } else if(t[0] == "out") {
+        int n = number(t[2], "bit count", sl.line);
+        w = 0x6000 | field(out_dests, t[1], "destination", sl.line) << 5 | (n & 31);
+      } else if(t[0] == "mov" || t[0] == "nop") {
+        if(t[0] == "nop") {
+          t = {"mov", "y", "y"};
+        }
+        std::string src = t[2];
+        int op = 0;
+        if(src[0] == '!' || src[0] == '~') {
+          op = 1;
+          src = src.substr(1);
+        } else if(src.compare(0, 2, "::") == 0) {
+          op = 2;
+          src = src.substr(2);
+        }
+        w = 0xa000 | field(mov_dests, t[1], "destination", sl.line) << 5 | op << 3 |
+            field(mov_srcs, src, "source", sl.line);
+      } else if(t[0] == "set") {
+        w = 0xe000 | field(set_dests, t[1], "destination", sl.line) << 5 | number(t[2], "value", sl.line);
+      } else {
+        printf("FAILED: line %d: instruction '%s' not supported by the test\n", sl.line, t[0].c_str());
+        failures++;
+      }
+      int delay_bits = 5 - sideset_bits[pp];
+      int ss = 0;
+      if(side >= 0) {
+        ss = (side << delay_bits) | (sideset_opt[pp] ? 0x10 : 0);
+      } else if(sideset_bits[pp] && !sideset_opt[pp]) {
+        printf("FAILED: line %d: side-set missing\n", sl.line);
+        failures++;
+      }
+      w |= (ss | delay) << 8;
+      p.instructions.push_back(w);
+    }
+  }
+  return programs;
+}
+
+
+typedef struct {
+  const char *name;
+  const uint16_t *instructions;
+  int length;
+  int wrap_target;
+  int wrap;
+} header_program_t;
+
+#define HEADER_PROGRAM(n) {#n, n##_program_instructions, \
+  (int)(sizeof(n##_program_instructions)/sizeof(n##_program_instructions[0])), n##_wrap_target, n##_wrap}
+
+static const header_program_t header_programs[] = {
+  HEADER_PROGRAM(pio_serialiser),
+  HEADER_PROGRAM(toggle),
+  HEADER_PROGRAM(pio_rle),
+  HEADER_PROGRAM(pio_fracn),
+  HEADER_PROGRAM(pio_hiz_dirs),
+  HEADER_PROGRAM(pio_hiz_pins),
+};
+
+static void test_encodings(const std::string &dir)
+{
+  const char *files[] = {"pio_stream.pio", "toggle.pio", "pio_rle.pio", "pio_fracn.pio", "pio_hiz.pio"};
+  int found = 0;
+  char what[100];
+
+  for(const char *file : files) {
+    for(pio_asm_t &p : assemble(dir + "/" + file)) {
+      for(const header_program_t &h : header_programs) {
+        if(p.name != h.name) {
+          continue;
+        }
+        found++;
+        snprintf(what, sizeof(what), "%s: length", h.name);
+        check((int)p.instructions.size() == h.length, what);
+        for(int ii = 0; ii < h.length && ii < (int)p.instructions.size(); ii++) {
+          snprintf(what, sizeof(what), "%s: instruction %d is 0x%04x in the .h file, 0x%04x from the .pio file",
+                   h.name, ii, h.instructions[ii], p.instructions[ii]);
+          check(p.instructions[ii] == h.instructions[ii], what);
+        }
+        snprintf(what, sizeof(what), "%s: wrap", h.name);
+        check(p.wrap_target == h.wrap_target && p.wrap == h.wrap, what);
+      }
+    }
+  }
+  check(found == (int)(sizeof(header_programs)/sizeof(header_programs[0])), "all programs found in the .pio files");
+}
+
+
+// ---------------------------------------------------------------------------------------------------
+// Emulator of a state machine, for the instructions that the assembler supports. The OUT, SET and side-set
+// pin groups are the two pins 0 and 1, shifts are to the right.
+
+typedef struct {
+  uint16_t mem[32];
+  int pc, wrap_target, wrap;
+  uint32_t x, y, isr, osr;
+  int osr_count;             // Bits shifted out of the OSR, 32 when empty
+  int pull_threshold;
+  bool autopull;
+  int sideset_bits;          // Including the enable bit of an optional side-set
+  bool sideset_opt;
+  bool sideset_pindirs;
+  int delay;                 // Delay cycles left
+  std::deque<uint32_t> fifo;
+  uint32_t *pins, *pindirs;  // Shared by the SMs
+  bool error;
+} pio_sm_t;
+
+// Load a program at offset and relocate its jumps, as pio_add_program() does
+static void sm_load(pio_sm_t *sm, const header_program_t &h, int offset)
+{
+  for(int ii = 0; ii < h.length; ii++) {
+    uint16_t w = h.instructions[ii];
+    sm->mem[offset + ii] = ((w >> 13) == 0) ? w + offset : w;
+  }
+  sm->pc = offset;
+  sm->wrap_target = offset + h.wrap_target;
+  sm->wrap = offset + h.wrap;
+}
+
+static void sm_init(pio_sm_t *sm, uint32_t *pins, uint32_t *pindirs, bool autopull, int pull_threshold)
+{
+  memset(sm->mem, 0, sizeof(sm->mem));
+  sm->x = sm->y = sm->isr = sm->osr = 0;
+  sm->osr_count = 32;
+  sm->autopull = autopull;
+  sm->pull_threshold = pull_threshold;
+  sm->sideset_bits = 0;
+  sm->sideset_opt = false;
+  sm->sideset_pindirs = false;
+  sm->delay = 0;
+  sm->fifo.clear();
+  sm->pins = pins;
+  sm->pindirs = pindirs;
+  sm->error = false;
+}
+
+// One clock cycle
+static void sm_step(pio_sm_t *sm)
+{
+  if(sm->delay > 0) {
+    sm->delay--;
+    return;
+  }
+  uint16_t in = sm->mem[sm->pc];
+  int ds = (in >> 8) & 31;
+  int delay_bits = 5 - sm->sideset_bits;
+  if(sm->sideset_bits && (!sm->sideset_opt || (ds & 0x10))) {
+    uint32_t v = (ds >> delay_bits) & ((1u << (sm->sideset_bits - sm->sideset_opt)) - 1);
+    *(sm->sideset_pindirs ? sm->pindirs : sm->pins) = v & 3;
+  }
+  int dest = (in >> 5) & 7;
+  bool jumped = false;
+  uint32_t v;
+  switch(in >> 13) {
+    case 0: {  // JMP
+      bool take = false;
+      switch(dest) {
+        case 0: take = true; break;
+        case 1: take = (sm->x == 0); break;
+        case 2: take = (sm->x-- != 0); break;
+        case 3: take = (sm->y == 0); break;
+        case 4: take = (sm->y-- != 0); break;
+        case 5: take = (sm->x != sm->y); break;
+        case 7: take = (sm->osr_count < sm->pull_threshold); break;
+        default: sm->error = true;
+      }
+      if(take) {
+        sm->pc = in & 31;
+        jumped = true;
+      }
+      break;
+    }
+    case 3: {  // OUT
+      int n = (in & 31) ? (in & 31) : 32;
+      if(sm->autopull && sm->osr_count >= sm->pull_threshold) {
+        if(sm->fifo.empty()) {
+          return;  // Stall, the side-set has taken effect
+        }
+        sm->osr = sm->fifo.front();
+        sm->fifo.pop_front();
+        sm->osr_count = 0;
+      }
+      v = (n == 32) ? sm->osr : sm->osr & ((1u << n) - 1);
+      sm->osr = (n == 32) ? 0 : sm->osr >> n;
+      sm->osr_count = (sm->osr_count + n > 32) ? 32 : sm->osr_count + n;
+      switch(dest) {
+        case 0: *sm->pins = v & 3; break;
+        case 1: sm->x = v; break;
+        case 2: sm->y = v; break;
+        case 3: break;
+        case 4: *sm->pindirs = v & 3; break;
+        case 5: sm->pc = v & 31; jumped = true; break;
+        case 6: sm->isr = v; break;
+        default: sm->error = true;
+      }
+      break;
+    }
+    case 5: {  // MOV
+      switch(in & 7) {
+        case 1: v = sm->x; break;
+        case 2: v = sm->y; break;
+        case 3: v = 0; break;
+        case 6: v = sm->isr; break;
+        case 7: v = sm->osr; break;
+        default: v = 0; sm->error = true;
+      }
+      if(((in >> 3) & 3) == 1) {
+        v = ~v;
+      } else if(((in >> 3) & 3) == 2) {
+        uint32_t r = 0;
+        for(int ii = 0; ii < 32; ii++) {
+          r |= ((v >> ii) & 1) << (31 - ii);
+        }
+        v = r;
+      }
+      switch(dest) {
+        case 0: *sm->pins = v & 3; break;
+        case 1: sm->x = v; break;
+        case 2: sm->y = v; break;
+        case 5: sm->pc = v & 31; jumped = true; break;
+        case 6: sm->isr = v; break;
+        case 7: sm->osr = v; sm->osr_count = 0; break;
+        default: sm->error = true;
+      }
+      break;
+    }
+    case 7: {  // SET
+      v = in & 31;
+      switch(dest) {
+        case 0: *sm->pins = v & 3; break;
+        case 1: sm->x = v; break;
+        case 2: sm->y = v; break;
+        case 4: *sm->pindirs = v & 3; break;
+        default: sm->error = true;
+      }
+      break;
+    }
+    default:
+      sm->error = true;
+  }
+  if(!jumped) {
+    sm->pc = (sm->pc == sm->wrap) ? sm->wrap_target : sm->pc + 1;
+  }
+  sm->delay = ds & ((1 << delay_bits) - 1);
+}
+
+
+static const header_program_t *find_program(const char *name)
+{
+  for(const header_program_t &h : header_programs) {
+    if(strcmp(h.name, name) == 0) {
+      return &h;
+    }
+  }
+  return NULL;
+}
+
+static uint32_t random_word()
+{
+  return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+
+// Runs of 3 to 16386 clocks, two per word
+static void test_rle()
+{
+  pio_sm_t sm;
+  uint32_t pins = 0, pindirs = 3;
+  std::vector<int> expected;
+
+  sm_init(&sm, &pins, &pindirs, true, 32);
+  sm_load(&sm, *find_program("pio_rle"), 5);
+  srand(2);
+  for(int ii = 0; ii < 200; ii++) {
+    uint32_t w = 0;
+    for(int rr = 0; rr < 2; rr++) {
+      uint32_t symbol = rand() & 3;
+      uint32_t len = (ii < 2) ? (rr ? 16386 : 3) : 3 + rand() % 40;
+      w |= (symbol | (len - 3) << 2) << 16*rr;
+      expected.insert(expected.end(), len, symbol);
+    }
+    sm.fifo.push_back(w);
+  }
+  bool same = true;
+  sm_step(&sm);
+  for(size_t ii = 0; ii < expected.size(); ii++) {
+    same = same && (pins == (uint32_t)expected[ii]);
+    sm_step(&sm);
+  }
+  check(same && !sm.error, "pio_rle: run lengths and symbols");
+}
+
+
+// Half-periods of N clocks for a 0 bit and N+1 for a 1 bit or a reload, with the pins in antiphase
+static void test_fracn()
+{
+  const struct {
+    uint32_t count, pattern;
+    int len;
+  } cases[] = {{0, 0, 1}, {3, 0x2, 2}, {10, 0x5a5a5a5a, 32}, {100, 0x0000d6b4, 17}, {7, 0xfffffffe, 32}};
+
+  for(auto c : cases) {
+    pio_sm_t sm;
+    uint32_t pins = 0, pindirs = 3;
+    sm_init(&sm, &pins, &pindirs, false, c.len);
+    sm_load(&sm, *find_program("pio_fracn"), 9);
+    // What pio_fracn_program_init() loads through the FIFO
+    sm.isr = c.count;
+    sm.y = c.pattern;
+    sm.osr_count = 32;
+
+    bool ok = true;
+    int n = c.count + 6;
+    uint32_t last = 0;
+    int start = -1;
+    int half = 0;
+    for(int t = 0; t < 200*(n + 1) && half < 150; t++) {
+      sm_step(&sm);
+      if(pins != last) {
+        if(start >= 0) {
+          int bit = half % c.len;
+          int expected = n + (int)((c.pattern >> bit) & 1) + (bit == 0);
+          ok = ok && (t - start == expected) && (last == (half % 2 ? 2u : 1u));
+          half++;
+        }
+        start = t;
+        last = pins;
+      }
+    }
+    check(ok && half == 150 && !sm.error, "pio_fracn: half-periods");
+  }
+}
+
+
+// The output stage with high impedance zeros: the two SMs get the same words, and one clock after each
+// symbol is read the pins drive +1 and -1 and float for a zero
+static void test_hiz()
+{
+  pio_sm_t dirs, pins_sm;
+  uint32_t pins = 0, pindirs = 0;
+  std::vector<uint32_t> symbols;
+
+  sm_init(&dirs, &pins, &pindirs, true, 32);
+  sm_init(&pins_sm, &pins, &pindirs, true, 32);
+  const header_program_t *hd = find_program("pio_hiz_dirs");
+  const header_program_t *hp = find_program("pio_hiz_pins");
+  sm_load(&dirs, *hd, 0);       // Must be at address 0, out pc jumps to the symbol
+  sm_load(&pins_sm, *hp, hd->length);
+  dirs.sideset_bits = 2;
+  dirs.sideset_pindirs = true;
+  srand(3);
+  for(int ii = 0; ii < 100; ii++) {
+    uint32_t w = random_word();
+    dirs.fifo.push_back(w);
+    pins_sm.fifo.push_back(w);
+    for(int jj = 0; jj < 16; jj++) {
+      symbols.push_back((w >> 2*jj) & 3);
+    }
+  }
+
+  bool ok = true;
+  for(size_t t = 0; t < symbols.size(); t++) {
+    sm_step(&dirs);
+    sm_step(&pins_sm);
+    if(t == 0) {
+      ok = ok && (pindirs == 0);
+      continue;
+    }
+    uint32_t s = symbols[t - 1];
+    bool driven = (s == 1 || s == 2);
+    ok = ok && (pindirs == (driven ? 3u : 0u)) && (!driven || pins == s);
+  }
+  check(ok && !dirs.error && !pins_sm.error, "pio_hiz: directions and levels line up with the symbols");
+  check(dirs.fifo.size() == pins_sm.fifo.size(), "pio_hiz: both SMs read the words at the same rate");
+}
+
+
+// One symbol per clock
+static void test_stream()
+{
+  pio_sm_t sm;
+  uint32_t pins = 0, pindirs = 3;
+  std::vector<uint32_t> symbols;
+
+  sm_init(&sm, &pins, &pindirs, true, 32);
+  sm_load(&sm, *find_program("pio_serialiser"), 0);
+  srand(4);
+  for(int ii = 0; ii < 50; ii++) {
+    uint32_t w = random_word();
+    sm.fifo.push_back(w);
+    for(int jj = 0; jj < 16; jj++) {
+      symbols.push_back((w >> 2*jj) & 3);
+    }
+  }
+  bool ok = true;
+  for(uint32_t s : symbols) {
+    sm_step(&sm);
+    ok = ok && (pins == s);
+  }
+  check(ok && !sm.error, "pio_serialiser: one symbol per clock");
+}
+
+
+int main(int argc, char **argv)
+{
+  test_encodings(argc > 1 ? argv[1] : "..");
+  test_rle();
+  test_fracn();
+  test_hiz();
+  test_stream();
+  if(failures) {
+    printf("%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("All checks passed\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+// Test of the scheduler on a PC with a virtual clock. Built and run by the Makefile in this directory.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "scheduler.h"
+
+static uint32_t now_us;
+static uint32_t task_us[sched_max_tasks];  // How long each task runs
+static char order[64];                     // Tasks in the order that they ran, 'a' for task 0
+static int n_order;
+static int failures;
+
+static uint32_t virtual_clock()
+{
+  return now_us;
+}
+
+static void virtual_sleep(uint32_t us)
+{
+  now_us += us;
+}
+
+#define TASK(n) static void task_##n() { now_us += task_us[n]; if(n_order < 63) order[n_order++] = 'a' + n; }
+TASK(0)
+TASK(1)
+TASK(2)
+
+static void check(bool ok, const char *what)
+{
+  if(!ok) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+static void start(uint32_t t0)
+{
+  sched_clear();
+  now_us = t0;
+  n_order = 0;
+  memset(order, 0, sizeof(order));
+  memset(task_us, 0, sizeof(task_us));
+  sched_set_clock(virtual_clock, virtual_sleep);
+  sched_set_max_sleep(1000);
+}
+
+// Run the scheduler until the clock reaches end
+static void run_until(uint32_t end)
+{
+  while((int32_t)(now_us - end) < 0) {
+    sched_run();
+  }
+  order[n_order] = 0;
+}
+
+static sched_stats_t stats(int task)
+{
+  sched_stats_t st;
+  sched_get_stats(task, &st);
+  return st;
+}
+
+
+static void test_priority()
+{
+  start(0);
+  sched_add("low", task_0, 1000, 0, 0);
+  sched_add("high", task_1, 1000, 0, 2);
+  sched_add("mid", task_2, 1000, 0, 1);
+  run_until(1);
+  check(strcmp(order, "bca") == 0, "released tasks run by priority");
+}
+
+static void test_deadline()
+{
+  start(0);
+  sched_add("late", task_0, 1000, 800, 1);
+  sched_add("early", task_1, 1000, 200, 1);
+  run_until(1);
+  check(strcmp(order, "ba") == 0, "same priority runs by the earliest deadline");
+}
+
+static void test_period_and_sleep()
+{
+  start(0);
+  sched_add("a", task_0, 500, 0, 0);
+  run_until(10000);
+  sched_stats_t st = stats(0);
+  check(st.runs == 20, "periodic task runs once per period");
+  check(st.missed == 0 && st.skipped == 0, "idle periodic task meets its deadlines");
+  uint64_t sleep_us;
+  uint32_t elapsed = sched_get_elapsed(&sleep_us);
+  check(elapsed == 10000 && sleep_us == 10000, "sleeps until the next release");
+}
+
+static void test_missed_and_skipped()
+{
+  start(0);
+  sched_add("fast", task_0, 500, 100, 1);
+  sched_add("slow", task_1, 10000, 0, 2);
+  task_us[1] = 1700;
+  run_until(10000);
+  sched_stats_t st = stats(0);
+  check(st.missed == 1, "blocked task misses its deadline");
+  check(st.skipped == 3, "releases more than a period late are dropped");
+  check(st.max_late_us == 1700, "lateness of the start");
+  check(stats(1).max_us == 1700, "run time of the slow task");
+}
+
+static void test_one_shot()
+{
+  start(0);
+  int t = sched_add("once", task_0, 0, 0, 0);
+  run_until(5000);
+  check(stats(t).runs == 0, "one-shot task waits until armed");
+  sched_at(t, 300);
+  run_until(5299);
+  check(stats(t).runs == 0, "one-shot task waits for its delay");
+  run_until(6000);
+  check(stats(t).runs == 1, "one-shot task runs once");
+  sched_at(t, 0);
+  sched_cancel(t);
+  run_until(7000);
+  check(stats(t).runs == 1, "cancelled task does not run");
+}
+
+static void test_wrap_around()
+{
+  start(0xFFFFF000);
+  sched_add("a", task_0, 1000, 0, 0);
+  run_until(0x00003000);
+  sched_stats_t st = stats(0);
+  check(st.runs == 17, "clock wraps around");
+  check(st.missed == 0 && st.skipped == 0 && st.max_late_us == 0, "no false lateness at the wrap");
+}
+
+
+int main()
+{
+  test_priority();
+  test_deadline();
+  test_period_and_sleep();
+  test_missed_and_skipped();
+  test_one_shot();
+  test_wrap_around();
+  if(failures) {
+    printf("%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("All checks passed\n");
+  return EXIT_SUCCESS;
+}
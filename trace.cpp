@@ -0,0 +1,115 @@
+#include <arduino.h>
+#include "hardware/sync.h"
+#include "trace.h"
+#include "synth.h"
+
+
+typedef struct {
+  trace_record_t records[trace_ring_len];
+  uint32_t head;       // Number of records written, the oldest ones have been overwritten
+} trace_ring_t;
+
+static trace_ring_t trace_rings[2];
+static volatile bool trace_on = true;
+
+
+// Add a record to the ring of the calling core. Interrupts are disabled for the few instructions
+// that take a slot and fill it, so that the interrupt handler can not get the same slot.
+void trace_event(int event, uint32_t arg)
+{
+  if(!trace_on) {
+    return;
+  }
+  int core = rp2040.cpuid();
+  trace_ring_t *ring = &trace_rings[core];
+  uint32_t irq_state = save_and_disable_interrupts();
+  trace_record_t *rec = &ring->records[ring->head & (trace_ring_len - 1)];
+  rec->cycles = rp2040.getCycleCount();
+  rec->time_us = time_us_32();
+  rec->event = event;
+  rec->core = core;
+  rec->arg = arg;
+  ring->head++;
+  restore_interrupts(irq_state);
+}
+
+
+void trace_enable(bool on)
+{
+  trace_on = on;
+}
+
+
+bool trace_enabled()
+{
+  return trace_on;
+}
+
+
+void trace_clear()
+{
+  bool was_on = trace_on;
+  trace_on = false;
+  trace_rings[0].head = 0;
+  trace_rings[1].head = 0;
+  trace_on = was_on;
+}
+
+
+const char *trace_event_str(int event)
+{
+  switch(event) {
+    case TRACE_KEY_DOWN:
+      return "key_down";
+    case TRACE_KEY_UP:
+      return "key_up";
+    case TRACE_DMA_BUFFER:
+      return "dma_buffer";
+    case TRACE_RECALC_BEGIN:
+      return "recalc_begin";
+    case TRACE_RECALC_END:
+      return "recalc_end";
+    case TRACE_COMMAND:
+      return "command";
+    case TRACE_REFRESH:
+      return "refresh";
+    case TRACE_LOOP_ALARM:
+      return "loop_alarm";
+    case TRACE_PARK:
+      return "park";
+    case TRACE_WAKE:
+      return "wake";
+    default:
+      return "unknown";
+  }
+}
+
+
+// Print the records of both cores, oldest first, one per line:
+// core cycles time_us event arg
+// Tracing is paused while printing so that the records do not change underneath.
+void trace_print()
+{
+  bool was_on = trace_on;
+  trace_on = false;
+  Serial.print("trace begin ");
+  Serial.println(CPU_freq_actual, 0);
+  for(int core = 0; core < 2; core++) {
+    trace_ring_t *ring = &trace_rings[core];
+    uint32_t n = min(ring->head, (uint32_t)trace_ring_len);
+    for(uint32_t ii = ring->head - n; ii != ring->head; ii++) {
+      trace_record_t *rec = &ring->records[ii & (trace_ring_len - 1)];
+      Serial.print(rec->core);
+      Serial.print(" ");
+      Serial.print(rec->cycles);
+      Serial.print(" ");
+      Serial.print(rec->time_us);
+      Serial.print(" ");
+      Serial.print(trace_event_str(rec->event));
+      Serial.print(" ");
+      Serial.println(rec->arg);
+    }
+  }
+  Serial.println("trace end");
+  trace_on = was_on;
+}
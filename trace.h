@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+// Event tracer: fixed size records with timestamps in one ring buffer per core, written from the
+// interrupt handler and the loops of both cores. Each core only writes to its own ring, so the cores
+// never wait for each other. The "trace" command prints the records and trace2json.py converts
+// the printout to a Chrome trace (chrome://tracing or https://ui.perfetto.dev).
+
+enum trace_event_t {
+  TRACE_KEY_DOWN = 0,
+  TRACE_KEY_UP,
+  TRACE_DMA_BUFFER,    // The restart DMA has switched to another buffer, arg tells which one
+  TRACE_RECALC_BEGIN,
+  TRACE_RECALC_END,    // arg is the calculation time in us
+  TRACE_COMMAND,       // arg is the first four characters of the command
+  TRACE_REFRESH,       // Core 1 has refreshed the whole main buffer, arg is the number of words refreshed so far
+  TRACE_LOOP_ALARM,    // The main loop took too long, arg is the period in us
+  TRACE_PARK,          // The DMAs and the SM have been stopped while silent
+  TRACE_WAKE,          // They have been restarted, arg is the wake-up time in us
+  TRACE_N_EVENTS
+};
+
+const int trace_ring_len = 256;  // Records per core, a power of two
+
+typedef struct {
+  uint32_t cycles;     // CPU clock cycles, wraps around every 2^32 cycles
+  uint32_t time_us;    // Microseconds since boot, for unwrapping the cycles and aligning the cores
+  uint16_t event;
+  uint16_t core;
+  uint32_t arg;
+} trace_record_t;
+
+void trace_event(int event, uint32_t arg);
+void trace_enable(bool on);
+bool trace_enabled();
+void trace_clear();
+void trace_print();
+const char *trace_event_str(int event);
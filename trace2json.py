@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+# Convert the printout of the "trace" command to a Chrome trace, for chrome://tracing or https://ui.perfetto.dev
+#
+# Usage: trace2json.py serial_log.txt > trace.json
+#
+# The log may contain other text, only the lines between "trace begin" and "trace end" are used.
+# The cycle counts wrap around every 2^32 cycles, so they are unwrapped with the microsecond
+# timestamps, which are also used to align the two cores.
+
+import json
+import sys
+
+buffer_names = ["silent", "ramp_up", "main", "ramp_down"]
+
+
+def read_records(lines):
+    records = []
+    cpu_hz = None
+    for line in lines:
+        words = line.split()
+        if len(words) >= 3 and words[0] == "trace" and words[1] == "begin":
+            cpu_hz = float(words[2])
+            records = []
+        elif cpu_hz is not None and len(words) == 5 and words[0] in ("0", "1"):
+            records.append((int(words[0]), int(words[1]), int(words[2]), words[3], int(words[4])))
+    return cpu_hz, records
+
+
+def timestamps(cpu_hz, records):
+    # Time in us from the cycle count, unwrapped and offset so that it follows the microsecond timer
+    wrap_us = 2**32 / cpu_hz * 1e6
+    offset = {}
+    result = []
+    for core, cycles, time_us, event, arg in records:
+        t = cycles / cpu_hz * 1e6
+        if core not in offset:
+            offset[core] = time_us - t
+        n_wraps = round((time_us - offset[core] - t) / wrap_us)
+        result.append(t + n_wraps * wrap_us + offset[core])
+    return result
+
+
+def command_name(arg):
+    return arg.to_bytes(4, "little").rstrip(b"\0").decode("ascii", "replace")
+
+
+def main():
+    with open(sys.argv[1]) if len(sys.argv) > 1 else sys.stdin as f:
+        cpu_hz, records = read_records(f)
+    if not records:
+        sys.exit("No trace found")
+    events = []
+    for (core, cycles, time_us, event, arg), ts in zip(records, timestamps(cpu_hz, records)):
+        e = {"pid": 0, "tid": core, "ts": ts}
+        if event in ("key_down", "key_up"):
+            # On a track of its own, as the keying overlaps with the other spans
+            e["tid"] = 2
+            e.update(name="key down", cat="key", ph="B" if event == "key_down" else "E")
+        elif event in ("recalc_begin", "recalc_end"):
+            e.update(name="recalculate", cat="synth", ph="B" if event == "recalc_begin" else "E")
+            e["args"] = {"mode": arg} if event == "recalc_begin" else {"calculation_us": arg}
+        elif event == "dma_buffer":
+            name = buffer_names[arg] if arg < len(buffer_names) else str(arg)
+            e.update(name="buffer " + name, cat="dma", ph="i", s="t")
+        elif event in ("park", "wake"):
+            e.update(name="parked", cat="dma", ph="B" if event == "park" else "E")
+            if event == "wake":
+                e["args"] = {"wake_us": arg}
+        elif event == "command":
+            e.update(name="command " + command_name(arg), cat="command", ph="i", s="t")
+        else:
+            e.update(name=event, cat="synth", ph="i", s="t", args={"arg": arg})
+        events.append(e)
+    events.sort(key=lambda e: e["ts"])
+    for tid, name in ((0, "core 0"), (1, "core 1"), (2, "keying")):
+        events.append({"pid": 0, "tid": tid, "ph": "M", "name": "thread_name", "args": {"name": name}})
+    json.dump({"traceEvents": events, "displayTimeUnit": "ns"}, sys.stdout, indent=1)
+
+
+if __name__ == "__main__":
+    main()
@@ -23,6 +23,10 @@
      transmission and silence.
   5. Same as mode 3, except that key clicks are reduced by smooth transitions between 
      transmission and silence.
+  6. A PIO program makes a square wave with half-periods of N or N+1 clocks, chosen by a
+     pattern that the PIO keeps in a register. The half-period is a fraction of clocks with
+     a denominator of up to 32, so the resolution is much better than in mode 0. The jitter
+     is less than a clock and no DMA or CPU time is used. The output is differential.
 
   Mode 5 is the default.
 
@@ -38,6 +42,30 @@
   - Amplitude of HD3 compensation
   - Phase of HD3 compensation
   - Buffer size
+  - Shape of the keying envelope (raised cosine, Blackman-Harris, error function, 
+    Hann squared or user defined)
+  - Experimental fast synthesis of the sigma-delta modes from a table of precalculated patterns (pattern),
+    never on by default. About 5x faster, but the SNR is 15-20 dB lower without dither and about 7 dB
+    lower with it than with the true modulators, the dither is always white, and the 80 kB table is
+    recalculated whenever the frequency changes
+  - Compressed buffers (compress), long buffers stored as a dictionary of word runs played by chained DMA control blocks
+  - Dither seed (seed), the same settings give the same buffers
+  - Buffer cache (cache), recently calculated buffers are reused when switching back to their settings
+  - Buffer CRC check (crc), the DMA sniffer calculates the CRC of each played buffer and mismatches are counted
+  - Sine calculation for sigma delta (sine), exact or table lookup in software or by the SIO interpolators
+  - Dither refresh (refresh), core 1 recalculates the main buffer with new dither one segment at a time
+  - Extra outputs phase locked to the main output (outputs, phase)
+  - Transition penalty of the sigma-delta modulators (trans)
+  - Power bank capacity for the energy and battery time estimate (battery, energy)
+  - Arithmetic of the sigma-delta modulators (kernel), double or fixed point with the modulators in lockstep lanes
+  - Run-length encoded buffers (rle), played by a PIO program that expands runs of symbols, in modes 1-3 when the runs are long enough
+  - Zero level of trinary sigma delta (zero), both pins low or high alternating, both low, or both high impedance by a second SM that sets the pin directions
+  - Parking (park), stops the DMAs and the PIO when the output has been silent for a while and optionally lowers the system clock
+  - Amplitude bank (bank, level), levels calculated together with the main buffer and switched between at the buffer boundaries
+  - Tones added to the carrier (tones, tone), with a joint plan that holds a whole number of periods of each, and their intermodulation in analyze
+  - Fine tuning (fine), alternating between the plans just below and above the frequency for an average within a few uHz, with its close-in spurs in analyze
+  - Spur-ranked planning (spurplan), the plans within a tolerance of the frequency ranked by an analytic prediction of their spurs, and the prediction for the current plan
+  - Dither shape (dithershape), white, first or second order high-pass or band-stop around the carrier, at the same RMS
   - Silent output (useful e.g. for output impedance measurement)
 
   The processor clock is expected to be 200 MHz, but other frequencies are supported by 
@@ -71,6 +99,10 @@
 #include "Wire.h"
 #include "cmdArduino.h"
 #include "commands.h"
+#include "loopmon.h"
+#include "energy.h"
+#include "display.h"
+#include "scheduler.h"
 #include "transmitter_PiPico.h"
 
 
@@ -117,6 +149,9 @@ Bounce btn1 = Bounce();
 elapsedMillis global_time;
 
 uint32_t resistor_time;
+uint32_t cycle_start_time;  // When the fox cycle (fox string repeated, then call sign) started
+static uint32_t state1 = 0;  // Round of the fox cycle, the call sign is sent after round 9
+static uint32_t state2 = 0;  // Sending the string (0) or the pause after it (1)
 
 
 // Morse code constants
@@ -164,6 +199,26 @@ static const uint8_t MorseLengths[] = {
 
 
 void lcd_print_frequency();
+void lcd_print_status(uint32_t round);
+void task_commands();
+void task_keep_alive();
+void task_button();
+void task_status();
+void task_display();
+void task_morse();
+void task_park();
+
+
+// The clock and the sleep of the scheduler
+static uint32_t sched_clock()
+{
+  return time_us_32();
+}
+
+static void sched_sleep(uint32_t us)
+{
+  sleep_us(us);
+}
 
 
 void start_transmitting()
@@ -225,7 +280,19 @@ void setup()
   Serial.println("synth created");
 
   lcd.begin(20, 4);
+  display_begin(LCD_RS_Pin, LCD_EN_Pin, LCD_D4_Pin, LCD_D5_Pin, LCD_D6_Pin, LCD_D7_Pin);
   lcd_print_frequency();
+
+  // The morse keying has the highest priority and the tightest deadline, the LCD the lowest
+  sched_set_clock(sched_clock, sched_sleep);
+  sched_add("morse", task_morse, 500, 500, 3);
+  sched_add("button", task_button, 5000, 0, 2);
+  sched_add("commands", task_commands, 2000, 0, 1);
+  sched_add("keep-alive", task_keep_alive, 10000, 0, 1);
+  sched_add("status", task_status, 100000, 0, 0);
+  sched_add("display", task_display, 250, 0, 0);
+  sched_add("park", task_park, 5000, 0, 2);
+
   Serial.println("End of setup");
   Serial.flush();
 
@@ -252,10 +319,28 @@ void initMorseRate(uint32_t WPM)
 
 void lcd_print_frequency()
 {
-  uint32_t f;
-  f = target_freqs[current_freq_num];
-  lcd.clear();
-  lcd.print(f);
+  char line[display_cols + 1];
+  snprintf(line, sizeof(line), "%-20lu", (unsigned long)target_freqs[current_freq_num]);
+  display_write(0, 0, line);
+}
+
+
+// Show the mode, keying and progress through the fox cycle. The LCD is updated by display_poll().
+void lcd_print_status(uint32_t round)
+{
+  char line[display_cols + 1];
+
+  snprintf(line, sizeof(line), "Mode %d %-13.13s", rf_synth->get_mode(), rf_synth->get_mode_str());
+  display_write(1, 0, line);
+  snprintf(line, sizeof(line), "%-20s", key_down ? "Key down" : (rf_synth->is_output_enabled() ? "TX" : "--"));
+  display_write(2, 0, line);
+  if(key_down) {
+    snprintf(line, sizeof(line), "%-20s", "");
+  } else {
+    snprintf(line, sizeof(line), "Round %2lu %8lu s   ", (unsigned long)round, 
+             (unsigned long)((global_time - cycle_start_time)/1000));
+  }
+  display_write(3, 0, line);
 }
 
 
@@ -269,13 +354,43 @@ void next_frequency()
 }
 
 
+// Core 1 refreshes the dither of the synth buffer in the background, when enabled
+void setup1()
+{
+}
+
+
+void loop1()
+{
+  if(!rf_synth || !rf_synth->get_refresh() || rf_synth->is_parked()) {
+    // Let core 1 sleep (and save power) until the refresh is turned on or the outputs are woken up
+    sleep_ms(10);
+    return;
+  }
+  rf_synth->refresh_step();
+}
+
+
+// The main loop runs one task of the scheduler, or sleeps until the next one is due
 void loop()
 {
-  static uint32_t state1 = 0;
-  static uint32_t state2 = 0;
+  loopmon_begin();
+  if(sched_run() < 0) {
+    loopmon_mark(LOOP_IDLE);
+  }
+}
+
 
+void task_commands()
+{
   cmd.poll();
+  loopmon_mark(LOOP_COMMANDS);
+}
 
+
+// Pull power from the power bank now and then so that it does not turn itself off
+void task_keep_alive()
+{
   if (digitalRead(Resistor_Pin) == HIGH) {
     if (global_time > resistor_time + 1000) {
       //test_rational_approx();
@@ -291,13 +406,49 @@ void loop()
     }
   }
 
+  energy_update(digitalRead(Resistor_Pin) == HIGH);
+  loopmon_mark(LOOP_KEEP_ALIVE);
+}
+
+
+void task_button()
+{
   btn1.update();
   if(btn1.fell()) {
     next_frequency();
   }
+  loopmon_mark(LOOP_BUTTON);
+}
+
 
+void task_status()
+{
+  lcd_print_status(state1);
+  loopmon_mark(LOOP_DISPLAY);
+}
+
+
+void task_display()
+{
+  display_poll();
+  loopmon_mark(LOOP_DISPLAY);
+}
+
+
+// Stop the DMAs and the PIO when the output has been silent for a while
+void task_park()
+{
+  rf_synth->park_poll();
+  loopmon_mark(LOOP_PARK);
+}
+
+
+// Step the morse state machines: the fox string is sent ten times, then the call sign
+void task_morse()
+{
   if(key_down) {
     start_transmitting();
+    loopmon_mark(LOOP_MORSE);
     return;
   }
 
@@ -324,7 +475,8 @@ void loop()
     if(strlen(callsign) == 0) {
       // No callsign to transmit
       state2 = 0;
-      state1 = 0;      
+      state1 = 0;
+      cycle_start_time = global_time;
     } else {
       initMorseRate(2*morse_rate); // Fast
       switch (state2) {
@@ -343,6 +495,7 @@ void loop()
             digitalWrite(Resistor_Pin, LOW);
             state2 = 0;
             state1 = 0;
+            cycle_start_time = global_time;
           }
           break;
         default:
@@ -350,6 +503,7 @@ void loop()
       }
     }
   }
+  loopmon_mark(LOOP_MORSE);
 }
 
 